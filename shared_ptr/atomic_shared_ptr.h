@@ -0,0 +1,247 @@
+/*=============================================================================
+#     FileName: atomic_shared_ptr.h
+#         Desc: lock-free atomic shared_ptr and weak_ptr slots
+#       Author: Jeffrey Pu
+#        Email: pujunying@gmail.com
+#     HomePage: https://github.com/jfpu
+#      Version: 0.0.1
+#   LastChange: 2026-10-17 11:48:02
+#      History:
+=============================================================================*/
+
+#ifndef _ATOMIC_SHARED_PTR_H_
+#define _ATOMIC_SHARED_PTR_H_
+
+#include <atomic>
+#include <cstdint>
+#include <new>
+#include "shared_ptr.h"
+
+namespace jfpu {
+SP_BEGIN_NAMESPACE_ABI
+
+// Split reference counting.
+//
+// The slot is one 64 bit word: the address of a heap node holding the
+// current pointer value in the low bits, and a count of readers that
+// are copying from that node in the high bits.  A reader pins the node
+// with a single fetch_add on the word, copies the value and unpins by
+// decrementing the word again, as long as the node is still installed.
+//
+// A writer swaps in a new node and adds the pins it took out with the
+// old word to the old node's own _refs.  Readers that come late
+// decrement _refs instead; whoever brings it to zero deletes the node.
+// _refs may go negative in between.
+//
+// load() never waits on a lock.  The pin field allows 65535 readers
+// inside load() at the same time on a 64 bit target, and node addresses
+// must fit in 48 bits.  That holds for user space on x86-64 and AArch64
+// with 4-level paging; under 5-level paging Linux hands out higher
+// addresses only to mmap calls that ask for them.  A node that lands
+// above 48 bits all the same is freed again and the store throws
+// std::bad_alloc, in release builds too.  An empty value needs no node.
+
+template<typename Ptr>
+class sp_atomic_base {
+    struct node {
+        std::atomic<long> _refs;
+        Ptr _value;
+
+        explicit node(Ptr&& p) : _refs(0), _value(std::move(p)) {}
+    };
+
+    typedef std::uint64_t word_type;
+
+    static_assert(sizeof(void*) == 8 || sizeof(void*) == 4,
+                  "sp_atomic_base packs pointers into 64 bit words");
+
+    static const int ptr_bits = sizeof(void*) == 8 ? 48 : 32;
+    static const word_type pin_one = word_type(1) << ptr_bits;
+    static const word_type ptr_mask = pin_one - 1;
+
+    mutable std::atomic<word_type> _word;
+
+    sp_atomic_base(sp_atomic_base const& );
+    sp_atomic_base& operator=(sp_atomic_base const& );
+
+    static node* to_node(word_type w) {
+        return reinterpret_cast<node*>(static_cast<std::uintptr_t>(w & ptr_mask));
+    }
+
+    static long to_pins(word_type w) {
+        return static_cast<long>(w >> ptr_bits);
+    }
+
+    static word_type to_word(node* n) {
+        return static_cast<word_type>(reinterpret_cast<std::uintptr_t>(n));
+    }
+
+    static bool is_empty(const Ptr& p) {
+        return p._internal_equiv(Ptr());
+    }
+
+    static node* make_node(Ptr&& p) {
+        if(is_empty(p))
+            return NULL;
+        node* n = new node(std::move(p));
+        if(0 != (to_word(n) & ~ptr_mask)) {
+            delete n;
+            throw std::bad_alloc();
+        }
+        return n;
+    }
+
+    // Pins taken on a NULL word are never given back, nothing reads them.
+    node* pin() const {
+        return to_node(_word.fetch_add(pin_one) + pin_one);
+    }
+
+    void unpin(node* n) const {
+        if(NULL == n)
+            return;
+        word_type cur = _word.load();
+        while(to_node(cur) == n) {
+            if(_word.compare_exchange_weak(cur, cur - pin_one))
+                return;
+        }
+        // n was swapped out and our pin moved to _refs.
+        if(1 == n->_refs.fetch_sub(1))
+            delete n;
+    }
+
+    // Hand the pins of a word that is no longer installed to its node.
+    static void retire(word_type w) {
+        node* n = to_node(w);
+        long c = to_pins(w);
+        if(NULL != n && 0 == n->_refs.fetch_add(c) + c)
+            delete n;
+    }
+
+    // Like retire(), returning the value the word held.  The extra
+    // reference keeps the node alive while the value is copied, unless
+    // nobody else can see it and the value can be moved out.
+    static Ptr take(word_type w) {
+        node* n = to_node(w);
+        if(NULL == n)
+            return Ptr();
+        long c = to_pins(w);
+        if(0 == n->_refs.fetch_add(c + 1) + c) {
+            Ptr r(std::move(n->_value));
+            delete n;
+            return r;
+        }
+        Ptr r(n->_value);
+        if(1 == n->_refs.fetch_sub(1))
+            delete n;
+        return r;
+    }
+
+public:
+    sp_atomic_base() : _word(0) {}
+
+    explicit sp_atomic_base(Ptr p) : _word(to_word(make_node(std::move(p)))) {}
+
+    ~sp_atomic_base() {
+        retire(_word.load(std::memory_order_relaxed));
+    }
+
+    bool is_lock_free() const {
+        return _word.is_lock_free();
+    }
+
+    Ptr load() const {
+        node* n = pin();
+        if(NULL == n)
+            return Ptr();
+        Ptr r(n->_value);
+        unpin(n);
+        return r;
+    }
+
+    void store(Ptr desired) {
+        retire(_word.exchange(to_word(make_node(std::move(desired)))));
+    }
+
+    Ptr exchange(Ptr desired) {
+        return take(_word.exchange(to_word(make_node(std::move(desired)))));
+    }
+
+    // Succeeds if the slot holds the same pointer with the same owner
+    // as expected; otherwise expected gets the current value.
+    bool compare_exchange_strong(Ptr& expected, Ptr desired) {
+        node* d = NULL;
+        bool made = false;
+        for(;;) {
+            node* n = pin();
+            if(!(NULL == n ? is_empty(expected) : n->_value._internal_equiv(expected))) {
+                expected = NULL == n ? Ptr() : n->_value;
+                unpin(n);
+                delete d;
+                return false;
+            }
+            if(!made) {
+                try {
+                    d = make_node(std::move(desired));
+                } catch(...) {
+                    unpin(n);
+                    throw;
+                }
+                made = true;
+            }
+            word_type cur = _word.load();
+            while(to_node(cur) == n) {
+                if(_word.compare_exchange_weak(cur, to_word(d))) {
+                    retire(cur);
+                    unpin(n);
+                    return true;
+                }
+            }
+            // Replaced between the pin and the swap, compare again.
+            unpin(n);
+        }
+    }
+
+    // Never fails spuriously.
+    bool compare_exchange_weak(Ptr& expected, Ptr desired) {
+        return compare_exchange_strong(expected, std::move(desired));
+    }
+
+    operator Ptr() const {
+        return load();
+    }
+};
+
+
+
+template<typename T>
+class atomic_shared_ptr : public sp_atomic_base<shared_ptr<T> > {
+    typedef sp_atomic_base<shared_ptr<T> > base_type;
+public:
+    atomic_shared_ptr() : base_type() {}
+
+    atomic_shared_ptr(shared_ptr<T> p) : base_type(std::move(p)) {}
+
+    atomic_shared_ptr& operator=(shared_ptr<T> p) {
+        this->store(std::move(p));
+        return *this;
+    }
+};
+
+template<typename T>
+class atomic_weak_ptr : public sp_atomic_base<weak_ptr<T> > {
+    typedef sp_atomic_base<weak_ptr<T> > base_type;
+public:
+    atomic_weak_ptr() : base_type() {}
+
+    atomic_weak_ptr(weak_ptr<T> p) : base_type(std::move(p)) {}
+
+    atomic_weak_ptr& operator=(weak_ptr<T> p) {
+        this->store(std::move(p));
+        return *this;
+    }
+};
+
+SP_END_NAMESPACE_ABI
+}
+
+#endif
@@ -0,0 +1,258 @@
+/*=============================================================================
+#     FileName: intrusive_ptr.h
+#         Desc: smart pointer to objects that carry their own count
+#       Author: Jeffrey Pu
+#        Email: pujunying@gmail.com
+#     HomePage: https://github.com/jfpu
+#      Version: 0.0.1
+#   LastChange: 2026-10-17 13:20:44
+#      History:
+=============================================================================*/
+
+#ifndef _INTRUSIVE_PTR_H_
+#define _INTRUSIVE_PTR_H_
+
+#include <atomic>
+#include <iostream>
+#include <cassert>
+#include "sp_counted_base.h"
+
+namespace jfpu {
+SP_BEGIN_NAMESPACE_ABI
+
+// intrusive_ptr<T> keeps the reference count inside the object: there
+// is no control block to allocate and no second pointer to follow.  It
+// calls intrusive_ptr_add_ref(T*) and intrusive_ptr_release(T*), found
+// by argument dependent lookup; derive T from intrusive_ref_counter to
+// get both, or declare them for a type whose header already has a
+// counter.  There are no weak references.
+
+template<_Lock_policy _Lp>
+struct intrusive_count_word {
+    typedef std::atomic<long> type;
+};
+
+template<>
+struct intrusive_count_word<_S_single> {
+    typedef long type;
+};
+
+// Mixin that stores the count in Derived.  The count starts at 0, the
+// first intrusive_ptr takes it to 1.  Copying the object does not copy
+// the count.
+template<typename Derived, _Lock_policy _Lp = __default_lock_policy>
+class intrusive_ref_counter {
+    mutable typename intrusive_count_word<_Lp>::type _rc;
+
+    static void add_ref(const intrusive_ref_counter* p, std::true_type) {
+        ++p->_rc;
+    }
+
+    static void add_ref(const intrusive_ref_counter* p, std::false_type) {
+        p->_rc.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    static bool release(const intrusive_ref_counter* p, std::true_type) {
+        return 0 == --p->_rc;
+    }
+
+    static bool release(const intrusive_ref_counter* p, std::false_type) {
+        if(p->_rc.fetch_sub(1, sp_release_order) == 1) {
+            std::atomic_thread_fence(std::memory_order_acquire);
+            return true;
+        }
+        return false;
+    }
+
+    typedef std::integral_constant<bool, _S_single == _Lp> is_single;
+
+protected:
+    intrusive_ref_counter() : _rc(0) {}
+
+    intrusive_ref_counter(const intrusive_ref_counter& ) : _rc(0) {}
+
+    intrusive_ref_counter& operator=(const intrusive_ref_counter& ) {
+        return *this;
+    }
+
+    ~intrusive_ref_counter() {}
+
+public:
+    long use_count() const {
+        return _rc;
+    }
+
+    friend inline void intrusive_ptr_add_ref(const intrusive_ref_counter* p) {
+        add_ref(p, is_single());
+    }
+
+    friend inline void intrusive_ptr_release(const intrusive_ref_counter* p) {
+        if(release(p, is_single()))
+            delete static_cast<const Derived*>(p);
+    }
+};
+
+
+
+template<typename T>
+class intrusive_ptr {
+public:
+    typedef T element_type;
+    typedef T* pointer_type;
+    typedef intrusive_ptr<T> this_type;
+private:
+    pointer_type px;
+
+    template<typename Y> friend class intrusive_ptr;
+public:
+    intrusive_ptr() : px(NULL) {}
+
+    // add_ref false adopts a reference the caller already holds, e.g.
+    // one given up by detach().
+    intrusive_ptr(pointer_type p, bool add_ref = true) : px(p) {
+        if(NULL != px && add_ref)
+            intrusive_ptr_add_ref(px);
+    }
+
+    intrusive_ptr(const intrusive_ptr& r) : px(r.px) {
+        if(NULL != px)
+            intrusive_ptr_add_ref(px);
+    }
+
+    intrusive_ptr(intrusive_ptr&& r) noexcept : px(r.px) {
+        r.px = NULL;
+    }
+
+    template<typename Y,
+             typename Z = typename std::enable_if<std::is_convertible<Y*, T*>::value>::type >
+    intrusive_ptr(const intrusive_ptr<Y>& r) : px(r.px) {
+        if(NULL != px)
+            intrusive_ptr_add_ref(px);
+    }
+
+    template<typename Y,
+             typename Z = typename std::enable_if<std::is_convertible<Y*, T*>::value>::type >
+    intrusive_ptr(intrusive_ptr<Y>&& r) noexcept : px(r.px) {
+        r.px = NULL;
+    }
+
+    ~intrusive_ptr() {
+        if(NULL != px)
+            intrusive_ptr_release(px);
+    }
+
+    intrusive_ptr& operator=(const intrusive_ptr& r) {
+        this_type(r).swap(*this);
+        return *this;
+    }
+
+    intrusive_ptr& operator=(intrusive_ptr&& r) noexcept {
+        this_type(std::move(r)).swap(*this);
+        return *this;
+    }
+
+    template<typename Y>
+    intrusive_ptr& operator=(const intrusive_ptr<Y>& r) {
+        this_type(r).swap(*this);
+        return *this;
+    }
+
+    intrusive_ptr& operator=(pointer_type p) {
+        this_type(p).swap(*this);
+        return *this;
+    }
+
+    void reset() {
+        this_type().swap(*this);
+    }
+
+    void reset(pointer_type p, bool add_ref = true) {
+        this_type(p, add_ref).swap(*this);
+    }
+
+    pointer_type get() const {
+        return px;
+    }
+
+    // Gives up ownership without releasing the reference.
+    pointer_type detach() {
+        pointer_type p = px;
+        px = NULL;
+        return p;
+    }
+
+    T& operator*() const {
+        assert(NULL != px);
+        return *px;
+    }
+
+    pointer_type operator->() const {
+        assert(NULL != px);
+        return px;
+    }
+
+    bool operator!() const {
+        return NULL == px;
+    }
+
+    void swap(intrusive_ptr& r) {
+        std::swap(px, r.px);
+    }
+};
+
+template<typename T, typename U>
+inline bool operator==(const intrusive_ptr<T>& a, const intrusive_ptr<U>& b) {
+    return a.get() == b.get();
+}
+
+template<typename T, typename U>
+inline bool operator!=(const intrusive_ptr<T>& a, const intrusive_ptr<U>& b) {
+    return a.get() != b.get();
+}
+
+template<typename T>
+inline bool operator<(const intrusive_ptr<T>& a, const intrusive_ptr<T>& b) {
+    return a.get() < b.get();
+}
+
+template<typename T>
+inline void swap(intrusive_ptr<T>& a, intrusive_ptr<T>& b) {
+    a.swap(b);
+}
+
+template<typename T>
+inline T* get_pointer(const intrusive_ptr<T>& p) {
+    return p.get();
+}
+
+template<typename T, typename U>
+inline intrusive_ptr<T> static_pointer_cast(const intrusive_ptr<U>& p) {
+    return intrusive_ptr<T>(static_cast<T*>(p.get()));
+}
+
+template<typename T, typename U>
+inline intrusive_ptr<T> const_pointer_cast(const intrusive_ptr<U>& p) {
+    return intrusive_ptr<T>(const_cast<T*>(p.get()));
+}
+
+template<typename T, typename U>
+inline intrusive_ptr<T> dynamic_pointer_cast(const intrusive_ptr<U>& p) {
+    return intrusive_ptr<T>(dynamic_cast<T*>(p.get()));
+}
+
+template<typename T>
+std::ostream& operator<<(std::ostream& os, const intrusive_ptr<T>& p) {
+    os << p.get();
+    return os;
+}
+
+// Allocates T and takes the first reference.
+template<typename T, typename... Args>
+inline intrusive_ptr<T> make_intrusive(Args&&... args) {
+    return intrusive_ptr<T>(new T(std::forward<Args>(args)...));
+}
+
+SP_END_NAMESPACE_ABI
+}
+
+#endif
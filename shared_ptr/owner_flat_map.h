@@ -0,0 +1,512 @@
+/*=============================================================================
+#     FileName: owner_flat_map.h
+#         Desc: open addressing set and map keyed on shared ownership
+#       Author: Jeffrey Pu
+#        Email: pujunying@gmail.com
+#     HomePage: https://github.com/jfpu
+#      Version: 0.0.1
+#   LastChange: 2026-10-17 20:46:12
+#      History:
+=============================================================================*/
+
+#ifndef _OWNER_FLAT_MAP_H_
+#define _OWNER_FLAT_MAP_H_
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <tuple>
+#include <utility>
+#include "shared_ptr.h"
+
+namespace jfpu {
+SP_BEGIN_NAMESPACE_ABI
+
+// Sets and maps of shared_ptr or weak_ptr keys compared by owner, the
+// control block, like owner_before() but hashed.  A weak_ptr key keeps
+// its control block, so its identity stays valid after the object is
+// gone; erase_expired() drops those keys.
+//
+// Linear probing over two arrays: the control block addresses, which
+// are all a lookup reads until it finds its key, and the entries.  The
+// table grows by doubling at 3/4 load, erasing shifts the following
+// entries back instead of leaving tombstones.  Lookups take any
+// shared_ptr or weak_ptr with the same lock policy.  Empty pointers have
+// no owner and are never stored.
+//
+// Inserting or erasing invalidates iterators and references to entries.
+
+template<typename Entry, typename KeyOf>
+class sp_owner_table {
+    const void** _blocks;
+    Entry* _entries;
+    std::size_t _mask;
+    std::size_t _size;
+
+    static const std::size_t npos = std::size_t(-1);
+    static const std::size_t min_capacity = 16;
+
+    static std::size_t mix(const void* b) {
+        std::uint64_t x = static_cast<std::uint64_t>(reinterpret_cast<std::uintptr_t>(b));
+        x ^= x >> 33;
+        x *= 0xff51afd7ed558ccdull;
+        x ^= x >> 33;
+        return static_cast<std::size_t>(x);
+    }
+
+    std::size_t capacity_() const {
+        return NULL == _blocks ? 0 : _mask + 1;
+    }
+
+    void rehash(std::size_t cap) {
+        const void** blocks = new const void*[cap]();
+        Entry* entries;
+        try {
+            entries = std::allocator<Entry>().allocate(cap);
+        } catch(...) {
+            delete[] blocks;
+            throw;
+        }
+        std::size_t mask = cap - 1;
+        for(std::size_t i = 0, n = capacity_(); i < n; ++i) {
+            if(NULL == _blocks[i])
+                continue;
+            std::size_t j = mix(_blocks[i]) & mask;
+            while(NULL != blocks[j])
+                j = (j + 1) & mask;
+            ::new(static_cast<void*>(entries + j)) Entry(std::move(_entries[i]));
+            _entries[i].~Entry();
+            blocks[j] = _blocks[i];
+        }
+        free_arrays();
+        _blocks = blocks;
+        _entries = entries;
+        _mask = mask;
+    }
+
+    void free_arrays() {
+        if(NULL == _blocks)
+            return;
+        std::allocator<Entry>().deallocate(_entries, _mask + 1);
+        delete[] _blocks;
+        _blocks = NULL;
+        _entries = NULL;
+        _mask = 0;
+    }
+
+public:
+    typedef Entry value_type;
+
+    class const_iterator {
+        const sp_owner_table* _t;
+        std::size_t _i;
+
+        friend class sp_owner_table;
+
+        const_iterator(const sp_owner_table* t, std::size_t i) : _t(t), _i(i) {
+            skip();
+        }
+
+        void skip() {
+            std::size_t n = _t->capacity_();
+            while(_i < n && NULL == _t->_blocks[_i])
+                ++_i;
+        }
+
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef Entry value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef const Entry* pointer;
+        typedef const Entry& reference;
+
+        const_iterator() : _t(NULL), _i(0) {}
+
+        reference operator*() const {
+            return _t->_entries[_i];
+        }
+
+        pointer operator->() const {
+            return _t->_entries + _i;
+        }
+
+        const_iterator& operator++() {
+            ++_i;
+            skip();
+            return *this;
+        }
+
+        const_iterator operator++(int) {
+            const_iterator r(*this);
+            ++*this;
+            return r;
+        }
+
+        bool operator==(const const_iterator& r) const {
+            return _i == r._i;
+        }
+
+        bool operator!=(const const_iterator& r) const {
+            return _i != r._i;
+        }
+    };
+
+    sp_owner_table() : _blocks(NULL), _entries(NULL), _mask(0), _size(0) {}
+
+    sp_owner_table(const sp_owner_table& r) : _blocks(NULL), _entries(NULL), _mask(0), _size(0) {
+        reserve(r._size);
+        for(const_iterator it = r.begin(); it != r.end(); ++it)
+            emplace(KeyOf::block(*it), *it);
+    }
+
+    sp_owner_table(sp_owner_table&& r) noexcept
+      : _blocks(r._blocks), _entries(r._entries), _mask(r._mask), _size(r._size) {
+        r._blocks = NULL;
+        r._entries = NULL;
+        r._mask = 0;
+        r._size = 0;
+    }
+
+    ~sp_owner_table() {
+        clear();
+        free_arrays();
+    }
+
+    sp_owner_table& operator=(sp_owner_table r) {
+        swap(r);
+        return *this;
+    }
+
+    void swap(sp_owner_table& r) noexcept {
+        std::swap(_blocks, r._blocks);
+        std::swap(_entries, r._entries);
+        std::swap(_mask, r._mask);
+        std::swap(_size, r._size);
+    }
+
+    // Slot of the entry owned by b, npos if there is none.
+    std::size_t find_slot(const void* b) const {
+        if(NULL == b || 0 == _size)
+            return npos;
+        std::size_t i = mix(b) & _mask;
+        for(;;) {
+            const void* c = _blocks[i];
+            if(c == b)
+                return i;
+            if(NULL == c)
+                return npos;
+            i = (i + 1) & _mask;
+        }
+    }
+
+    Entry* entry_at(std::size_t i) const {
+        return npos == i ? NULL : _entries + i;
+    }
+
+    // The entry owned by b, made from args if there is none.  NULL for
+    // an empty owner.
+    template<typename... Args>
+    std::pair<Entry*, bool> emplace(const void* b, Args&&... args) {
+        if(NULL == b)
+            return std::pair<Entry*, bool>(NULL, false);
+        std::size_t i = find_slot(b);
+        if(npos != i)
+            return std::pair<Entry*, bool>(_entries + i, false);
+        if((_size + 1) * 4 > capacity_() * 3)
+            rehash(capacity_() < min_capacity ? min_capacity : capacity_() * 2);
+        i = mix(b) & _mask;
+        while(NULL != _blocks[i])
+            i = (i + 1) & _mask;
+        ::new(static_cast<void*>(_entries + i)) Entry(std::forward<Args>(args)...);
+        _blocks[i] = b;
+        ++_size;
+        return std::pair<Entry*, bool>(_entries + i, true);
+    }
+
+    // Removes slot i and moves back the entries after it that would
+    // otherwise no longer be found.
+    void erase_slot(std::size_t i) {
+        _entries[i].~Entry();
+        _blocks[i] = NULL;
+        --_size;
+        std::size_t j = i;
+        for(;;) {
+            j = (j + 1) & _mask;
+            if(NULL == _blocks[j])
+                return;
+            std::size_t home = mix(_blocks[j]) & _mask;
+            if(((j - home) & _mask) < ((j - i) & _mask))
+                continue;
+            ::new(static_cast<void*>(_entries + i)) Entry(std::move(_entries[j]));
+            _entries[j].~Entry();
+            _blocks[i] = _blocks[j];
+            _blocks[j] = NULL;
+            i = j;
+        }
+    }
+
+    std::size_t erase(const void* b) {
+        std::size_t i = find_slot(b);
+        if(npos == i)
+            return 0;
+        erase_slot(i);
+        return 1;
+    }
+
+    template<typename Pred>
+    std::size_t erase_if(Pred pred) {
+        std::size_t n = 0;
+        for(std::size_t i = 0; i < capacity_(); ) {
+            // An entry shifted into i is looked at on the next pass.
+            if(NULL != _blocks[i] && pred(_entries[i])) {
+                erase_slot(i);
+                ++n;
+            } else {
+                ++i;
+            }
+        }
+        return n;
+    }
+
+    void clear() {
+        for(std::size_t i = 0, n = capacity_(); i < n; ++i) {
+            if(NULL != _blocks[i]) {
+                _entries[i].~Entry();
+                _blocks[i] = NULL;
+            }
+        }
+        _size = 0;
+    }
+
+    // Room for n entries without growing.
+    void reserve(std::size_t n) {
+        std::size_t cap = min_capacity;
+        while(n * 4 > cap * 3)
+            cap *= 2;
+        if(cap > capacity_())
+            rehash(cap);
+    }
+
+    std::size_t size() const {
+        return _size;
+    }
+
+    bool empty() const {
+        return 0 == _size;
+    }
+
+    std::size_t capacity() const {
+        return capacity_();
+    }
+
+    const_iterator begin() const {
+        return const_iterator(this, 0);
+    }
+
+    const_iterator end() const {
+        return const_iterator(this, capacity_());
+    }
+};
+
+template<typename P>
+inline const void* sp_owner_of(const P& p) {
+    return p._internal_block();
+}
+
+template<typename Key>
+struct sp_owner_key_of_set {
+    static const void* block(const Key& k) {
+        return sp_owner_of(k);
+    }
+};
+
+template<typename Key, typename V>
+struct sp_owner_key_of_map {
+    static const void* block(const std::pair<Key, V>& e) {
+        return sp_owner_of(e.first);
+    }
+};
+
+
+
+// Set of shared_ptr<T> or weak_ptr<T>, one per owner.
+template<typename Key>
+class owner_flat_set {
+    typedef sp_owner_table<Key, sp_owner_key_of_set<Key> > table_type;
+
+    table_type _t;
+
+public:
+    typedef Key key_type;
+    typedef Key value_type;
+    typedef typename table_type::const_iterator iterator;
+    typedef typename table_type::const_iterator const_iterator;
+
+    // False if k's owner is already in the set, or k is empty.
+    bool insert(const Key& k) {
+        return _t.emplace(sp_owner_of(k), k).second;
+    }
+
+    bool insert(Key&& k) {
+        const void* b = sp_owner_of(k);
+        return _t.emplace(b, std::move(k)).second;
+    }
+
+    template<typename P>
+    bool contains(const P& p) const {
+        return NULL != _t.entry_at(_t.find_slot(sp_owner_of(p)));
+    }
+
+    // The key stored for p's owner, NULL if there is none.
+    template<typename P>
+    const Key* find(const P& p) const {
+        return _t.entry_at(_t.find_slot(sp_owner_of(p)));
+    }
+
+    template<typename P>
+    std::size_t erase(const P& p) {
+        return _t.erase(sp_owner_of(p));
+    }
+
+    template<typename Pred>
+    std::size_t erase_if(Pred pred) {
+        return _t.erase_if(pred);
+    }
+
+    // Drops the keys whose object is gone, for weak_ptr keys.
+    std::size_t erase_expired() {
+        return _t.erase_if([](const Key& k) { return 0 == k.use_count(); });
+    }
+
+    void clear() {
+        _t.clear();
+    }
+
+    void reserve(std::size_t n) {
+        _t.reserve(n);
+    }
+
+    void swap(owner_flat_set& r) noexcept {
+        _t.swap(r._t);
+    }
+
+    std::size_t size() const {
+        return _t.size();
+    }
+
+    bool empty() const {
+        return _t.empty();
+    }
+
+    const_iterator begin() const {
+        return _t.begin();
+    }
+
+    const_iterator end() const {
+        return _t.end();
+    }
+};
+
+// Map from shared_ptr<T> or weak_ptr<T>, by owner, to V.  Entries are
+// std::pair<Key, V>; iteration is read only, change values through
+// find() or operator[].
+template<typename Key, typename V>
+class owner_flat_map {
+    typedef std::pair<Key, V> entry_type;
+    typedef sp_owner_table<entry_type, sp_owner_key_of_map<Key, V> > table_type;
+
+    table_type _t;
+
+public:
+    typedef Key key_type;
+    typedef V mapped_type;
+    typedef entry_type value_type;
+    typedef typename table_type::const_iterator iterator;
+    typedef typename table_type::const_iterator const_iterator;
+
+    // The value for k's owner, made from args if there is none.  The
+    // second member is false if it was there already.  {NULL, false}
+    // for an empty k.
+    template<typename... Args>
+    std::pair<V*, bool> try_emplace(const Key& k, Args&&... args) {
+        std::pair<entry_type*, bool> r =
+            _t.emplace(sp_owner_of(k), std::piecewise_construct, std::forward_as_tuple(k),
+                       std::forward_as_tuple(std::forward<Args>(args)...));
+        return std::pair<V*, bool>(NULL == r.first ? NULL : &r.first->second, r.second);
+    }
+
+    // k must not be empty.
+    V& operator[](const Key& k) {
+        std::pair<V*, bool> r = try_emplace(k);
+        assert(NULL != r.first);
+        return *r.first;
+    }
+
+    template<typename P>
+    V* find(const P& p) {
+        entry_type* e = _t.entry_at(_t.find_slot(sp_owner_of(p)));
+        return NULL == e ? NULL : &e->second;
+    }
+
+    template<typename P>
+    const V* find(const P& p) const {
+        const entry_type* e = _t.entry_at(_t.find_slot(sp_owner_of(p)));
+        return NULL == e ? NULL : &e->second;
+    }
+
+    template<typename P>
+    bool contains(const P& p) const {
+        return NULL != _t.entry_at(_t.find_slot(sp_owner_of(p)));
+    }
+
+    template<typename P>
+    std::size_t erase(const P& p) {
+        return _t.erase(sp_owner_of(p));
+    }
+
+    template<typename Pred>
+    std::size_t erase_if(Pred pred) {
+        return _t.erase_if(pred);
+    }
+
+    // Drops the entries whose key's object is gone, for weak_ptr keys.
+    std::size_t erase_expired() {
+        return _t.erase_if([](const entry_type& e) { return 0 == e.first.use_count(); });
+    }
+
+    void clear() {
+        _t.clear();
+    }
+
+    void reserve(std::size_t n) {
+        _t.reserve(n);
+    }
+
+    void swap(owner_flat_map& r) noexcept {
+        _t.swap(r._t);
+    }
+
+    std::size_t size() const {
+        return _t.size();
+    }
+
+    bool empty() const {
+        return _t.empty();
+    }
+
+    const_iterator begin() const {
+        return _t.begin();
+    }
+
+    const_iterator end() const {
+        return _t.end();
+    }
+};
+
+SP_END_NAMESPACE_ABI
+}
+
+#endif
@@ -0,0 +1,251 @@
+/*=============================================================================
+#     FileName: read_mostly_shared_ptr.h
+#         Desc: shared_ptr slot read through per-thread cached copies
+#       Author: Jeffrey Pu
+#        Email: pujunying@gmail.com
+#     HomePage: https://github.com/jfpu
+#      Version: 0.0.1
+#   LastChange: 2026-10-17 18:21:40
+#      History:
+=============================================================================*/
+
+#ifndef _READ_MOSTLY_SHARED_PTR_H_
+#define _READ_MOSTLY_SHARED_PTR_H_
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <vector>
+#include "shared_ptr.h"
+
+namespace jfpu {
+SP_BEGIN_NAMESPACE_ABI
+
+// A shared_ptr<T> that is read far more often than it is replaced, such
+// as a global configuration.
+//
+// Every thread keeps its own copy of the current shared_ptr together
+// with the version it was taken at.  local() compares that version with
+// the slot's, which is a plain load of a line no reader writes to, and
+// hands out the thread's copy by reference, so a read touches neither
+// the control block nor anything another thread writes.  Only when the
+// version has moved does the thread take the slot's lock and copy the
+// new value.
+//
+// store() installs a new value under a new version.  The old value
+// lives on in the copies of the threads that have not read since and is
+// destroyed when the last of them moves on: at its next local() on this
+// slot, its release_local() or its exit.  A thread that stops reading
+// keeps its last version alive until then.
+//
+// Destroying the slot drops the copies of every thread, the ones that
+// stopped reading included: the per-thread tables of a T are listed
+// together with the slot ids, and the destructor clears its entry in
+// each before handing its id on.  Versions come from one counter per T
+// as well, so a copy taken from a destroyed slot could never match a
+// later slot that reuses its place anyway.
+
+template<typename T>
+class read_mostly_shared_ptr {
+    struct slot {
+        std::uint64_t version;
+        shared_ptr<T> value;
+
+        slot() : version(0) {}
+    };
+
+    // Growing a deque at the end keeps references to its elements.
+    typedef std::deque<slot> table;
+
+    // Frees the calling thread's table, and with it its copies, when
+    // the thread exits.
+    struct thread_exit {
+        ~thread_exit() {
+            dead() = true;
+            table* t = tls();
+            tls() = NULL;
+            {
+                shared_state& st = state();
+                std::lock_guard<std::mutex> lk(st.mutex);
+                st.tables.erase(std::find(st.tables.begin(), st.tables.end(), t));
+            }
+            delete t;
+        }
+    };
+
+    // The free slot ids and the tables of all threads.  Other threads
+    // touch a table only under the mutex, and only its entry for a slot
+    // being destroyed, which its own thread no longer reads; so a table
+    // grows under the mutex but its thread reads it without.
+    struct shared_state {
+        std::mutex mutex;
+        std::vector<std::size_t> free;
+        std::size_t next;
+        std::vector<table*> tables;
+
+        shared_state() : next(0) {}
+    };
+
+    alignas(64) std::atomic<std::uint64_t> _version;
+    alignas(64) std::mutex _mutex;
+    shared_ptr<T> _current;
+    std::size_t _id;
+
+    read_mostly_shared_ptr(read_mostly_shared_ptr const& );
+    read_mostly_shared_ptr& operator=(read_mostly_shared_ptr const& );
+
+    static std::uint64_t next_version() {
+        static std::atomic<std::uint64_t> v(0);
+        return v.fetch_add(1, std::memory_order_relaxed) + 1;
+    }
+
+    // Never destroyed, slots may be destroyed during static destruction.
+    static shared_state& state() {
+        static shared_state* r = new shared_state();
+        return *r;
+    }
+
+    static std::size_t take_id() {
+        shared_state& st = state();
+        std::lock_guard<std::mutex> lk(st.mutex);
+        if(st.free.empty())
+            return st.next++;
+        std::size_t id = st.free.back();
+        st.free.pop_back();
+        return id;
+    }
+
+    // Takes the first copy of this slot still held by any thread out of
+    // its table, empty once there are none left.
+    shared_ptr<T> take_copy() {
+        shared_state& st = state();
+        std::lock_guard<std::mutex> lk(st.mutex);
+        for(std::size_t i = 0; i < st.tables.size(); ++i) {
+            table& t = *st.tables[i];
+            if(t.size() <= _id)
+                continue;
+            slot& s = t[_id];
+            s.version = 0;
+            if(NULL != s.value.get())
+                return std::move(s.value);
+        }
+        st.free.push_back(_id);
+        return shared_ptr<T>();
+    }
+
+    static table*& tls() {
+        static thread_local table* t = NULL;
+        return t;
+    }
+
+    // Set once the calling thread's table is gone.  local() called from
+    // destructors of later thread_local objects gets a new table that
+    // is never freed.
+    static bool& dead() {
+        static thread_local bool d = false;
+        return d;
+    }
+
+    static table& local_table() {
+        table*& t = tls();
+        if(NULL == t) {
+            t = new table();
+            {
+                shared_state& st = state();
+                std::lock_guard<std::mutex> lk(st.mutex);
+                st.tables.push_back(t);
+            }
+            if(!dead())
+                static thread_local thread_exit hook;
+        }
+        return *t;
+    }
+
+    static void grow(table& t, std::size_t n) {
+        shared_state& st = state();
+        std::lock_guard<std::mutex> lk(st.mutex);
+        t.resize(n);
+    }
+
+    slot& refresh(slot& s) {
+        std::lock_guard<std::mutex> lk(_mutex);
+        s.value = _current;
+        s.version = _version.load(std::memory_order_relaxed);
+        return s;
+    }
+
+public:
+    read_mostly_shared_ptr()
+      : _version(next_version()), _id(take_id()) {}
+
+    explicit read_mostly_shared_ptr(const shared_ptr<T>& p)
+      : _version(next_version()), _current(p), _id(take_id()) {}
+
+    // Drops every thread's copy, one at a time outside the lock since
+    // the deleter may run, and gives the id back once none are left.
+    ~read_mostly_shared_ptr() {
+        while(NULL != take_copy().get())
+            ;
+    }
+
+    // The calling thread's copy of the current value.  The reference
+    // stays valid until the thread's next local() or release_local()
+    // on this slot; copy it to keep the value longer.
+    const shared_ptr<T>& local() {
+        table& t = local_table();
+        if(t.size() <= _id)
+            grow(t, _id + 1);
+        slot& s = t[_id];
+        if(s.version != _version.load(std::memory_order_acquire))
+            refresh(s);
+        return s.value;
+    }
+
+    T* operator->() {
+        return local().get();
+    }
+
+    T& operator*() {
+        return *local();
+    }
+
+    // A copy of the current value that does not go through the thread's
+    // cache.  Costs a lock and a reference count increment.
+    shared_ptr<T> load() {
+        std::lock_guard<std::mutex> lk(_mutex);
+        return _current;
+    }
+
+    void store(const shared_ptr<T>& p) {
+        // Released after the lock, the deleter may run here.
+        shared_ptr<T> old;
+        {
+            std::lock_guard<std::mutex> lk(_mutex);
+            old = _current;
+            _current = p;
+            _version.store(next_version(), std::memory_order_release);
+        }
+    }
+
+    // Drops the calling thread's copy, so that a thread that is done
+    // reading does not keep an old value alive.
+    void release_local() {
+        table* t = tls();
+        if(NULL == t || t->size() <= _id)
+            return;
+        slot& s = (*t)[_id];
+        s.value.reset();
+        s.version = 0;
+    }
+
+    std::uint64_t version() const {
+        return _version.load(std::memory_order_acquire);
+    }
+};
+
+SP_END_NAMESPACE_ABI
+}
+
+#endif
@@ -0,0 +1,189 @@
+/*=============================================================================
+#     FileName: shared_handle.h
+#         Desc: one-word shared owner of a make_shared object
+#       Author: Jeffrey Pu
+#        Email: pujunying@gmail.com
+#     HomePage: https://github.com/jfpu
+#      Version: 0.0.1
+#   LastChange: 2026-10-17 19:16:05
+#      History:
+=============================================================================*/
+
+#ifndef _SHARED_HANDLE_H_
+#define _SHARED_HANDLE_H_
+
+#include <stdexcept>
+#include <typeinfo>
+#include "shared_ptr.h"
+
+namespace jfpu {
+SP_BEGIN_NAMESPACE_ABI
+
+inline void
+sp_throw_bad_handle()
+{
+#if __EXCEPTIONS
+    throw std::invalid_argument("shared_handle: not a make_shared block");
+#else
+    __builtin_abort();
+#endif
+}
+
+// A shared_ptr<T> in one pointer instead of two.
+//
+// Only the control block pointer is stored.  The block is always the
+// one make_shared<T> creates, so the object is found at a fixed offset
+// inside it and get() costs an add, not a load.  In exchange there is
+// no aliasing and no other kind of block: a shared_ptr<T> can become a
+// shared_handle<T> only if it came from make_shared<T> and points at
+// the object itself, anything else throws std::invalid_argument.
+//
+// Moving between shared_ptr<T> and shared_handle<T> hands the
+// reference over without touching the counters; copying takes one as
+// usual.  Checking a shared_ptr costs a typeid compare, so keep the
+// conversions out of the loops that walk the handles.
+template<typename T>
+class shared_handle {
+    static_assert(!std::is_array<T>::value, "shared_handle does not hold arrays");
+
+    typedef sp_counted_base<> base_type;
+    typedef sp_counted_impl_inplace<T, std::allocator<typename std::remove_cv<T>::type> > block_type;
+
+    block_type* _pi;
+
+    static block_type* block_of(const shared_ptr<T>& p) {
+        base_type* pi = p._internal_block();
+        if(NULL == pi)
+            return NULL;
+#ifdef __GXX_RTTI
+        if(typeid(*pi) != typeid(block_type))
+            sp_throw_bad_handle();
+#endif
+        block_type* b = static_cast<block_type*>(pi);
+        if(b->ptr() != p.get())
+            sp_throw_bad_handle();
+        return b;
+    }
+
+public:
+    typedef T element_type;
+
+    shared_handle() : _pi(NULL) {}
+
+    ~shared_handle() {
+        if(NULL != _pi) {
+            SP_PROFILE_COUNT(_pi, sp_prof_release);
+            _pi->release();
+        }
+    }
+
+    shared_handle(const shared_handle& r) : _pi(r._pi) {
+        if(NULL != _pi) {
+            SP_PROFILE_COUNT(_pi, sp_prof_add_ref_copy);
+            _pi->add_ref_copy();
+        }
+    }
+
+    shared_handle(shared_handle&& r) noexcept : _pi(r._pi) {
+        r._pi = NULL;
+    }
+
+    explicit shared_handle(const shared_ptr<T>& p) : _pi(block_of(p)) {
+        if(NULL != _pi) {
+            SP_PROFILE_COUNT(_pi, sp_prof_add_ref_copy);
+            _pi->add_ref_copy();
+        }
+    }
+
+    // Takes over p's reference and leaves p empty.
+    explicit shared_handle(shared_ptr<T>&& p) : _pi(block_of(p)) {
+        p._internal_detach();
+    }
+
+    shared_handle& operator=(const shared_handle& r) {
+        shared_handle(r).swap(*this);
+        return *this;
+    }
+
+    shared_handle& operator=(shared_handle&& r) noexcept {
+        shared_handle(std::move(r)).swap(*this);
+        return *this;
+    }
+
+    void swap(shared_handle& r) noexcept {
+        block_type* pi = _pi;
+        _pi = r._pi;
+        r._pi = pi;
+    }
+
+    void reset() {
+        shared_handle().swap(*this);
+    }
+
+    // A new owner of the object, the handle keeps its own.
+    operator shared_ptr<T>() const & {
+        return shared_handle(*this).release_shared();
+    }
+
+    operator shared_ptr<T>() && {
+        return release_shared();
+    }
+
+    // Hands the reference over to a shared_ptr, the handle is left empty.
+    shared_ptr<T> release_shared() {
+        if(NULL == _pi)
+            return shared_ptr<T>();
+        block_type* pi = _pi;
+        _pi = NULL;
+        return shared_ptr<T>(sp_adopt_tag(), pi->ptr(), shared_count<>::adopt(pi));
+    }
+
+    T* get() const {
+        return NULL == _pi ? NULL : _pi->ptr();
+    }
+
+    T& operator*() const {
+        assert(NULL != _pi);
+        return *_pi->ptr();
+    }
+
+    T* operator->() const {
+        assert(NULL != _pi);
+        return _pi->ptr();
+    }
+
+    bool operator!() const {
+        return NULL == _pi;
+    }
+
+    long use_count() const {
+        return NULL == _pi ? 0 : _pi->use_count();
+    }
+
+    bool unique() const {
+        return 1 == use_count();
+    }
+
+    bool operator==(const shared_handle& r) const {
+        return _pi == r._pi;
+    }
+
+    bool operator!=(const shared_handle& r) const {
+        return _pi != r._pi;
+    }
+};
+
+template<typename T>
+inline void swap(shared_handle<T>& a, shared_handle<T>& b) {
+    a.swap(b);
+}
+
+template<typename T, typename... Args>
+inline shared_handle<T> make_shared_handle(Args&&... args) {
+    return shared_handle<T>(jfpu::make_shared<T>(std::forward<Args>(args)...));
+}
+
+SP_END_NAMESPACE_ABI
+}
+
+#endif
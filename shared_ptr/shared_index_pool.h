@@ -0,0 +1,476 @@
+/*=============================================================================
+#     FileName: shared_index_pool.h
+#         Desc: 32 bit shared/weak handles into a slab pool of objects
+#       Author: Jeffrey Pu
+#        Email: pujunying@gmail.com
+#     HomePage: https://github.com/jfpu
+#      Version: 0.0.1
+#   LastChange: 2026-10-17 19:47:33
+#      History:
+=============================================================================*/
+
+#ifndef _SHARED_INDEX_POOL_H_
+#define _SHARED_INDEX_POOL_H_
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Reference counted objects named by a 32 bit index instead of a
+// pointer, for object graphs too large for a pointer and a control
+// block per edge.
+//
+// shared_index_pool<T, Tag> is a single pool per T and Tag.  Objects
+// live in slabs of 1 << SP_INDEX_SLAB_BITS slots; each slab keeps the
+// strong counts in an array of their own, beside the objects, and the
+// slot generations are kept in arrays that are never freed.  A handle
+// is the slot index in the low SP_INDEX_BITS bits and the slot's
+// generation in the rest; 0 is the empty handle.
+//
+// shared_index_handle behaves like shared_ptr: copying retains, the
+// last release destroys the object.  The slot's generation then moves
+// on and the slot is reused.  weak_index_handle has no weak count: it
+// remembers the generation, and lock() succeeds only while the slot
+// still holds that generation and the object is alive.  A slot whose
+// generation has no next value is never used again, so a generation is
+// never seen twice.
+//
+// release_range() gives back the slots freed by a range of handles
+// under one lock.  compact() hands out the lowest free slots first from
+// then on and frees slabs at the end that hold no object.
+
+#ifndef SP_INDEX_BITS
+#define SP_INDEX_BITS 26
+#endif
+
+#ifndef SP_INDEX_SLAB_BITS
+#define SP_INDEX_SLAB_BITS 12
+#endif
+
+namespace jfpu {
+
+template<typename T, typename Tag = void>
+class shared_index_handle;
+
+template<typename T, typename Tag = void>
+class weak_index_handle;
+
+template<typename T, typename Tag = void>
+class shared_index_pool {
+    static_assert(SP_INDEX_BITS > SP_INDEX_SLAB_BITS && SP_INDEX_BITS < 32,
+                  "SP_INDEX_BITS out of range");
+
+public:
+    static const std::uint32_t index_mask = (std::uint32_t(1) << SP_INDEX_BITS) - 1;
+    static const std::uint32_t max_generation = (std::uint32_t(1) << (32 - SP_INDEX_BITS)) - 1;
+
+private:
+    static const std::uint32_t slab_size = std::uint32_t(1) << SP_INDEX_SLAB_BITS;
+    static const std::uint32_t slab_mask = slab_size - 1;
+    static const std::uint32_t slabs = std::uint32_t(1) << (SP_INDEX_BITS - SP_INDEX_SLAB_BITS);
+
+    typedef typename std::aligned_storage<sizeof(T), std::alignment_of<T>::value>::type storage_type;
+
+    struct slab {
+        std::atomic<std::uint32_t> refs[slab_size];
+        storage_type objects[slab_size];
+
+        slab() {
+            for(std::uint32_t i = 0; i < slab_size; ++i)
+                refs[i].store(0, std::memory_order_relaxed);
+        }
+    };
+
+    std::atomic<slab*> _slabs[slabs];
+    std::atomic<std::atomic<std::uint32_t>*> _generations[slabs];
+    std::mutex _mutex;
+    std::vector<std::uint32_t> _free;
+    std::uint32_t _next;
+    std::size_t _live;
+
+    friend class shared_index_handle<T, Tag>;
+    friend class weak_index_handle<T, Tag>;
+
+    shared_index_pool(shared_index_pool const& );
+    shared_index_pool& operator=(shared_index_pool const& );
+
+    shared_index_pool() : _next(0), _live(0) {
+        for(std::uint32_t i = 0; i < slabs; ++i) {
+            _slabs[i].store(NULL, std::memory_order_relaxed);
+            _generations[i].store(NULL, std::memory_order_relaxed);
+        }
+    }
+
+    slab* slab_of(std::uint32_t i) const {
+        return _slabs[i >> SP_INDEX_SLAB_BITS].load(std::memory_order_acquire);
+    }
+
+    std::atomic<std::uint32_t>& refs(std::uint32_t i) const {
+        return slab_of(i)->refs[i & slab_mask];
+    }
+
+    std::atomic<std::uint32_t>& generation(std::uint32_t i) const {
+        return _generations[i >> SP_INDEX_SLAB_BITS].load(std::memory_order_acquire)[i & slab_mask];
+    }
+
+    T* object(std::uint32_t i) const {
+        return static_cast<T*>(static_cast<void*>(&slab_of(i)->objects[i & slab_mask]));
+    }
+
+    static std::uint32_t index_of(std::uint32_t h) {
+        return h & index_mask;
+    }
+
+    static std::uint32_t generation_of(std::uint32_t h) {
+        return h >> SP_INDEX_BITS;
+    }
+
+    // Makes sure slot i has a slab, lock held.
+    void ensure_slab(std::uint32_t i) {
+        std::uint32_t s = i >> SP_INDEX_SLAB_BITS;
+        if(NULL == _generations[s].load(std::memory_order_relaxed)) {
+            std::atomic<std::uint32_t>* g = new std::atomic<std::uint32_t>[slab_size];
+            for(std::uint32_t j = 0; j < slab_size; ++j)
+                g[j].store(1, std::memory_order_relaxed);
+            _generations[s].store(g, std::memory_order_release);
+        }
+        if(NULL == _slabs[s].load(std::memory_order_relaxed))
+            _slabs[s].store(new slab(), std::memory_order_release);
+    }
+
+    // A free slot, lock held.  Slots out of generations are skipped.
+    std::uint32_t take_slot() {
+        if(!_free.empty()) {
+            std::uint32_t i = _free.back();
+            _free.pop_back();
+            return i;
+        }
+        for(;;) {
+            if(_next > index_mask)
+                throw std::bad_alloc();
+            std::uint32_t i = _next++;
+            ensure_slab(i);
+            if(generation(i).load(std::memory_order_relaxed) <= max_generation)
+                return i;
+        }
+    }
+
+    // Destroys the object of a slot whose count reached 0 and moves the
+    // generation on.  Returns false if the slot has none left.
+    bool retire(std::uint32_t i) {
+        object(i)->~T();
+        std::atomic<std::uint32_t>& g = generation(i);
+        std::uint32_t n = g.load(std::memory_order_relaxed) + 1;
+        g.store(n, std::memory_order_release);
+        return n <= max_generation;
+    }
+
+    void retain(std::uint32_t h) {
+        refs(index_of(h)).fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void release(std::uint32_t h) {
+        std::uint32_t i = index_of(h);
+        if(refs(i).fetch_sub(1, std::memory_order_acq_rel) != 1)
+            return;
+        bool reuse = retire(i);
+        std::lock_guard<std::mutex> lk(_mutex);
+        --_live;
+        if(reuse)
+            _free.push_back(i);
+    }
+
+    // Retains the object of h if it is still alive.
+    bool retain_if_alive(std::uint32_t h) {
+        std::uint32_t i = index_of(h);
+        if(generation(i).load(std::memory_order_acquire) != generation_of(h))
+            return false;
+        std::atomic<std::uint32_t>& r = refs(i);
+        std::uint32_t c = r.load(std::memory_order_relaxed);
+        do {
+            if(0 == c)
+                return false;
+        } while(!r.compare_exchange_weak(c, c + 1,
+                                         std::memory_order_acq_rel,
+                                         std::memory_order_relaxed));
+        // The slot may have been reused between the two loads, then the
+        // count taken belongs to another object.
+        if(generation(i).load(std::memory_order_acquire) == generation_of(h))
+            return true;
+        release(h);
+        return false;
+    }
+
+    bool alive(std::uint32_t h) const {
+        std::uint32_t i = index_of(h);
+        return generation(i).load(std::memory_order_acquire) == generation_of(h)
+            && refs(i).load(std::memory_order_relaxed) > 0;
+    }
+
+public:
+    // Never destroyed, handles may be released during static destruction.
+    static shared_index_pool& instance() {
+        static shared_index_pool* r = new shared_index_pool();
+        return *r;
+    }
+
+    template<typename... Args>
+    shared_index_handle<T, Tag> make(Args&&... args) {
+        std::uint32_t i;
+        {
+            std::lock_guard<std::mutex> lk(_mutex);
+            i = take_slot();
+            ++_live;
+        }
+        try {
+            ::new(static_cast<void*>(object(i))) T(std::forward<Args>(args)...);
+        } catch(...) {
+            std::lock_guard<std::mutex> lk(_mutex);
+            --_live;
+            _free.push_back(i);
+            throw;
+        }
+        refs(i).store(1, std::memory_order_release);
+        return shared_index_handle<T, Tag>(
+            i | (generation(i).load(std::memory_order_relaxed) << SP_INDEX_BITS), false);
+    }
+
+    // Releases every handle in [first, last) and leaves them empty.  The
+    // freed slots go back to the free list under one lock.
+    template<typename It>
+    void release_range(It first, It last) {
+        std::vector<std::uint32_t> freed;
+        std::size_t dead = 0;
+        for(; first != last; ++first) {
+            std::uint32_t h = first->_h;
+            if(0 == h)
+                continue;
+            first->_h = 0;
+            std::uint32_t i = index_of(h);
+            if(refs(i).fetch_sub(1, std::memory_order_acq_rel) != 1)
+                continue;
+            ++dead;
+            if(retire(i))
+                freed.push_back(i);
+        }
+        if(0 == dead)
+            return;
+        std::lock_guard<std::mutex> lk(_mutex);
+        _live -= dead;
+        _free.insert(_free.end(), freed.begin(), freed.end());
+    }
+
+    // From here on the lowest free slots are handed out first, and
+    // slabs at the end without a live object are freed.  Returns the
+    // number of slabs freed.  No other thread may use the pool, or any
+    // of its handles, meanwhile.
+    std::size_t compact() {
+        std::lock_guard<std::mutex> lk(_mutex);
+        std::size_t freed = 0;
+        while(_next > 0) {
+            std::uint32_t s = (_next - 1) >> SP_INDEX_SLAB_BITS;
+            slab* p = _slabs[s].load(std::memory_order_relaxed);
+            std::uint32_t begin = s << SP_INDEX_SLAB_BITS;
+            bool empty = true;
+            for(std::uint32_t i = begin; i < _next && empty; ++i)
+                empty = 0 == p->refs[i & slab_mask].load(std::memory_order_relaxed);
+            if(!empty)
+                break;
+            _free.erase(std::remove_if(_free.begin(), _free.end(),
+                                       [begin](std::uint32_t i) { return i >= begin; }),
+                        _free.end());
+            _slabs[s].store(NULL, std::memory_order_relaxed);
+            delete p;
+            _next = begin;
+            ++freed;
+        }
+        std::sort(_free.begin(), _free.end(), std::greater<std::uint32_t>());
+        return freed;
+    }
+
+    // Live objects.
+    std::size_t size() {
+        std::lock_guard<std::mutex> lk(_mutex);
+        return _live;
+    }
+
+    // Slots handed out so far, live or free.
+    std::size_t capacity() {
+        std::lock_guard<std::mutex> lk(_mutex);
+        return _next;
+    }
+};
+
+
+
+template<typename T, typename Tag>
+class shared_index_handle {
+    typedef shared_index_pool<T, Tag> pool_type;
+
+    std::uint32_t _h;
+
+    friend class shared_index_pool<T, Tag>;
+    friend class weak_index_handle<T, Tag>;
+
+    // Takes over a reference already counted.
+    shared_index_handle(std::uint32_t h, bool) : _h(h) {}
+
+    static pool_type& pool() {
+        return pool_type::instance();
+    }
+
+public:
+    typedef T element_type;
+
+    shared_index_handle() : _h(0) {}
+
+    ~shared_index_handle() {
+        if(0 != _h)
+            pool().release(_h);
+    }
+
+    shared_index_handle(const shared_index_handle& r) : _h(r._h) {
+        if(0 != _h)
+            pool().retain(_h);
+    }
+
+    shared_index_handle(shared_index_handle&& r) noexcept : _h(r._h) {
+        r._h = 0;
+    }
+
+    shared_index_handle& operator=(const shared_index_handle& r) {
+        shared_index_handle(r).swap(*this);
+        return *this;
+    }
+
+    shared_index_handle& operator=(shared_index_handle&& r) noexcept {
+        shared_index_handle(std::move(r)).swap(*this);
+        return *this;
+    }
+
+    void swap(shared_index_handle& r) noexcept {
+        std::swap(_h, r._h);
+    }
+
+    void reset() {
+        shared_index_handle().swap(*this);
+    }
+
+    T* get() const {
+        return 0 == _h ? NULL : pool().object(pool_type::index_of(_h));
+    }
+
+    T& operator*() const {
+        assert(0 != _h);
+        return *pool().object(pool_type::index_of(_h));
+    }
+
+    T* operator->() const {
+        assert(0 != _h);
+        return pool().object(pool_type::index_of(_h));
+    }
+
+    bool operator!() const {
+        return 0 == _h;
+    }
+
+    long use_count() const {
+        return 0 == _h ? 0 : pool().refs(pool_type::index_of(_h)).load(std::memory_order_relaxed);
+    }
+
+    bool unique() const {
+        return 1 == use_count();
+    }
+
+    // The slot, dense from 0, for side arrays indexed by object.
+    std::uint32_t index() const {
+        return pool_type::index_of(_h);
+    }
+
+    std::uint32_t value() const {
+        return _h;
+    }
+
+    bool operator==(const shared_index_handle& r) const {
+        return _h == r._h;
+    }
+
+    bool operator!=(const shared_index_handle& r) const {
+        return _h != r._h;
+    }
+
+    bool operator<(const shared_index_handle& r) const {
+        return _h < r._h;
+    }
+};
+
+template<typename T, typename Tag>
+class weak_index_handle {
+    typedef shared_index_pool<T, Tag> pool_type;
+
+    std::uint32_t _h;
+
+public:
+    typedef T element_type;
+
+    weak_index_handle() : _h(0) {}
+
+    weak_index_handle(const shared_index_handle<T, Tag>& r) : _h(r._h) {}
+
+    weak_index_handle& operator=(const shared_index_handle<T, Tag>& r) {
+        _h = r._h;
+        return *this;
+    }
+
+    void reset() {
+        _h = 0;
+    }
+
+    void swap(weak_index_handle& r) noexcept {
+        std::swap(_h, r._h);
+    }
+
+    bool expired() const {
+        return 0 == _h || !pool_type::instance().alive(_h);
+    }
+
+    long use_count() const {
+        return expired() ? 0 : pool_type::instance().refs(pool_type::index_of(_h))
+                                   .load(std::memory_order_relaxed);
+    }
+
+    // Empty if the object is gone, like weak_ptr::lock().
+    shared_index_handle<T, Tag> lock() const {
+        if(0 == _h || !pool_type::instance().retain_if_alive(_h))
+            return shared_index_handle<T, Tag>();
+        return shared_index_handle<T, Tag>(_h, false);
+    }
+
+    bool operator==(const weak_index_handle& r) const {
+        return _h == r._h;
+    }
+
+    bool operator<(const weak_index_handle& r) const {
+        return _h < r._h;
+    }
+};
+
+template<typename T, typename Tag>
+inline void swap(shared_index_handle<T, Tag>& a, shared_index_handle<T, Tag>& b) {
+    a.swap(b);
+}
+
+template<typename T, typename Tag = void, typename... Args>
+inline shared_index_handle<T, Tag> make_shared_index(Args&&... args) {
+    return shared_index_pool<T, Tag>::instance().make(std::forward<Args>(args)...);
+}
+
+}
+
+#endif
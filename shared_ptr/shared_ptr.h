@@ -15,14 +15,30 @@
 #include "shared_ptr_base.h"
 
 namespace jfpu {
+SP_BEGIN_NAMESPACE_ABI
 
 template<typename T> class weak_ptr;
+template<typename T> class shared_ptr;
+
+// Selects the single object or the array forms of make_shared.
+template<typename T>
+struct sp_if_not_array : std::enable_if<!std::is_array<T>::value, shared_ptr<T> > {};
+
+template<typename T>
+struct sp_if_unbounded_array
+  : std::enable_if<std::is_array<T>::value && 0 == std::extent<T>::value, shared_ptr<T> > {};
+
+template<typename T>
+struct sp_if_bounded_array : std::enable_if<0 != std::extent<T>::value, shared_ptr<T> > {};
+
+template<typename T, typename Alloc, typename... Args>
+typename sp_if_not_array<T>::type allocate_shared(const Alloc& a, Args&&... args);
 
 // The actual shared_ptr, with forwarding constructors and assignment operators.
 template<typename T>
 class shared_ptr : public __shared_ptr<T> {
-    typedef T element_type;
-    typedef T* pointer_type;
+    typedef typename __shared_ptr<T>::element_type element_type;
+    typedef typename __shared_ptr<T>::pointer_type pointer_type;
 public:
     shared_ptr() : __shared_ptr<T>() {}
 
@@ -32,8 +48,22 @@ public:
     template<typename Y, typename D>
     shared_ptr(Y* p, D d) : __shared_ptr<T>(p, d) {}
 
+    template<typename Y, typename D, typename A>
+    shared_ptr(Y* p, D d, A a) : __shared_ptr<T>(p, d, a) {}
+
+    // Non-standard, see __shared_ptr(sp_adopt_tag, ...).
+    shared_ptr(sp_adopt_tag tag, pointer_type p, shared_count<>&& pn)
+      : __shared_ptr<T>(tag, p, std::move(pn)) {}
+
+    shared_ptr(const shared_ptr& sp) : __shared_ptr<T>(sp) {}
+
+    shared_ptr(shared_ptr&& sp) noexcept : __shared_ptr<T>(std::move(sp)) {}
+
     template<typename Y>
     shared_ptr(const shared_ptr<Y>& sp) : __shared_ptr<T>(sp) {}
+
+    template<typename Y>
+    shared_ptr(shared_ptr<Y>&& sp) noexcept : __shared_ptr<T>(std::move(sp)) {}
     
     template<typename Y>
     shared_ptr(shared_ptr<Y> const& sp, pointer_type p) : __shared_ptr<T>(sp, p) {}
@@ -41,6 +71,12 @@ public:
     template<typename Y>
     explicit shared_ptr(const weak_ptr<Y>& wp) : __shared_ptr<T>(wp) {}
 
+    template<typename Y>
+    shared_ptr(const weak_ptr<Y>& wp, sp_nothrow_tag tag) : __shared_ptr<T>(wp, tag) {}
+
+    template<typename Y, typename D>
+    shared_ptr(std::unique_ptr<Y, D>&& up) : __shared_ptr<T>(std::move(up)) {}
+
 #if !defined(__GXX_EXPERIMENTAL_CXX0X__) || _GLIBCXX_USE_DEPRECATED
     template<typename Y>
     explicit shared_ptr(std::auto_ptr<Y>& ap) : __shared_ptr<T>(ap) {}
@@ -58,21 +94,165 @@ public:
     shared_ptr(const shared_ptr<Y>& sp, __dynamic_cast_tag)
       : __shared_ptr<T>(sp, __dynamic_cast_tag()) {}
 
+    shared_ptr& operator=(const shared_ptr& sp) {
+        this->__shared_ptr<T>::operator=(sp);
+        return *this;
+    }
+
+    shared_ptr& operator=(shared_ptr&& sp) noexcept {
+        this->__shared_ptr<T>::operator=(std::move(sp));
+        return *this;
+    }
+
     template<typename Y>
     shared_ptr& operator=(const shared_ptr<Y>& sp) {
         this->__shared_ptr<T>::operator=(sp);
         return *this;
     }
+
+    template<typename Y>
+    shared_ptr& operator=(shared_ptr<Y>&& sp) noexcept {
+        this->__shared_ptr<T>::operator=(std::move(sp));
+        return *this;
+    }
     
 #if !defined(__GXX_EXPERIMENTAL_CXX0X__) || _GLIBCXX_USE_DEPRECATED
     template<typename Y>
     shared_ptr& operator=(std::auto_ptr<Y>& ap) {
         this->__shared_ptr<T>::operator=(ap);
+        return *this;
     }
 #endif
-    
+
+private:
+    // This constructor is non-standard, it is used by allocate_shared.
+    template<typename Alloc, typename... Args>
+    shared_ptr(sp_alloc_shared_tag<Alloc> tag, Args&&... args)
+      : __shared_ptr<T>(tag, std::forward<Args>(args)...) {}
+
+    template<typename Y, typename Alloc, typename... Args>
+    friend typename sp_if_not_array<Y>::type allocate_shared(const Alloc& a, Args&&... args);
 };
 
+// Create an object that is owned by a shared_ptr.  The object and the
+// reference counts are placed in one block obtained from a copy of a,
+// which is also used to construct and destroy the object.  Passing a
+// std::pmr::polymorphic_allocator routes the block to its resource.
+template<typename T, typename Alloc, typename... Args>
+inline typename sp_if_not_array<T>::type allocate_shared(const Alloc& a, Args&&... args) {
+    return shared_ptr<T>(sp_alloc_shared_tag<Alloc>(a), std::forward<Args>(args)...);
+}
+
+// Create an object that is owned by a shared_ptr.  The object and the
+// reference counts are placed in one allocation, which saves a call to
+// operator new and keeps the counters next to the object.
+template<typename T, typename... Args>
+inline typename sp_if_not_array<T>::type make_shared(Args&&... args) {
+    typedef typename std::remove_cv<T>::type value_type;
+    return jfpu::allocate_shared<T>(std::allocator<value_type>(), std::forward<Args>(args)...);
+}
+
+// Arrays: one allocation for the block and n elements of
+// shared_ptr<T[]>, or N of shared_ptr<T[N]>.  The elements are value
+// initialized, copies of v, or with the _for_overwrite forms default
+// initialized, which leaves trivial types such as double unzeroed.
+template<typename T, typename Alloc>
+inline shared_ptr<T> __allocate_shared_array(const Alloc& a, std::size_t n, sp_array_init init,
+                                             const typename std::remove_extent<T>::type* v) {
+    typedef typename std::remove_cv<typename std::remove_extent<T>::type>::type value_type;
+    typedef sp_counted_impl_array<value_type, Alloc> impl_type;
+    impl_type* pi = impl_type::create(a, n, init, v);
+    return shared_ptr<T>(sp_adopt_tag(), pi->ptr(), shared_count<>::adopt(pi));
+}
+
+template<typename T, typename Alloc>
+inline typename sp_if_unbounded_array<T>::type allocate_shared(const Alloc& a, std::size_t n) {
+    return jfpu::__allocate_shared_array<T>(a, n, sp_array_value_init, NULL);
+}
+
+template<typename T, typename Alloc>
+inline typename sp_if_unbounded_array<T>::type
+allocate_shared(const Alloc& a, std::size_t n, const typename std::remove_extent<T>::type& v) {
+    return jfpu::__allocate_shared_array<T>(a, n, sp_array_copy_init, &v);
+}
+
+template<typename T, typename Alloc>
+inline typename sp_if_bounded_array<T>::type allocate_shared(const Alloc& a) {
+    return jfpu::__allocate_shared_array<T>(a, std::extent<T>::value, sp_array_value_init, NULL);
+}
+
+template<typename T, typename Alloc>
+inline typename sp_if_bounded_array<T>::type
+allocate_shared(const Alloc& a, const typename std::remove_extent<T>::type& v) {
+    return jfpu::__allocate_shared_array<T>(a, std::extent<T>::value, sp_array_copy_init, &v);
+}
+
+template<typename T, typename Alloc>
+inline typename sp_if_unbounded_array<T>::type
+allocate_shared_for_overwrite(const Alloc& a, std::size_t n) {
+    return jfpu::__allocate_shared_array<T>(a, n, sp_array_default_init, NULL);
+}
+
+template<typename T, typename Alloc>
+inline typename sp_if_bounded_array<T>::type allocate_shared_for_overwrite(const Alloc& a) {
+    return jfpu::__allocate_shared_array<T>(a, std::extent<T>::value, sp_array_default_init, NULL);
+}
+
+template<typename T>
+inline typename sp_if_unbounded_array<T>::type make_shared(std::size_t n) {
+    typedef typename std::remove_cv<typename std::remove_extent<T>::type>::type value_type;
+    return jfpu::allocate_shared<T>(std::allocator<value_type>(), n);
+}
+
+template<typename T>
+inline typename sp_if_unbounded_array<T>::type
+make_shared(std::size_t n, const typename std::remove_extent<T>::type& v) {
+    typedef typename std::remove_cv<typename std::remove_extent<T>::type>::type value_type;
+    return jfpu::allocate_shared<T>(std::allocator<value_type>(), n, v);
+}
+
+template<typename T>
+inline typename sp_if_bounded_array<T>::type make_shared() {
+    typedef typename std::remove_cv<typename std::remove_extent<T>::type>::type value_type;
+    return jfpu::allocate_shared<T>(std::allocator<value_type>());
+}
+
+template<typename T>
+inline typename sp_if_bounded_array<T>::type
+make_shared(const typename std::remove_extent<T>::type& v) {
+    typedef typename std::remove_cv<typename std::remove_extent<T>::type>::type value_type;
+    return jfpu::allocate_shared<T>(std::allocator<value_type>(), v);
+}
+
+template<typename T>
+inline typename sp_if_unbounded_array<T>::type make_shared_for_overwrite(std::size_t n) {
+    typedef typename std::remove_cv<typename std::remove_extent<T>::type>::type value_type;
+    return jfpu::allocate_shared_for_overwrite<T>(std::allocator<value_type>(), n);
+}
+
+template<typename T>
+inline typename sp_if_bounded_array<T>::type make_shared_for_overwrite() {
+    typedef typename std::remove_cv<typename std::remove_extent<T>::type>::type value_type;
+    return jfpu::allocate_shared_for_overwrite<T>(std::allocator<value_type>());
+}
+
+
+// Pointers whose reference counts are plain integers, without atomic
+// instructions.  Only for objects that never leave the thread that
+// created them.  shared_from_this() on them needs T derived from
+// __enable_shared_from_this<T, _S_single>; enable_shared_from_this<T>
+// refuses to compile with them.
+template<typename T>
+using local_shared_ptr = __shared_ptr<T, _S_single>;
+
+template<typename T>
+using local_weak_ptr = __weak_ptr<T, _S_single>;
+
+template<typename T, typename... Args>
+inline local_shared_ptr<T> make_local_shared(Args&&... args) {
+    return jfpu::__make_shared<T, _S_single>(std::forward<Args>(args)...);
+}
+
 // shared_ptr specialized algorithms.
 template<typename Y>
 inline void swap(shared_ptr<Y>& spa, shared_ptr<Y>& spb) {
@@ -94,6 +274,32 @@ inline shared_ptr<T> dynamic_pointer_cast(const shared_ptr<Y>& r) {
     return shared_ptr<T>(r, __dynamic_cast_tag());
 }
 
+// Hash and equality on the owner instead of the pointer value, for
+// unordered containers keyed on object identity.  shared_ptr and
+// weak_ptr keys mix freely.
+struct owner_hash {
+    typedef void is_transparent;
+
+    template<typename T, _Lock_policy _Lp>
+    std::size_t operator()(const __shared_ptr<T, _Lp>& p) const {
+        return p.owner_hash();
+    }
+
+    template<typename T, _Lock_policy _Lp>
+    std::size_t operator()(const __weak_ptr<T, _Lp>& p) const {
+        return p.owner_hash();
+    }
+};
+
+struct owner_equal {
+    typedef void is_transparent;
+
+    template<typename P, typename Q>
+    bool operator()(const P& a, const Q& b) const {
+        return a.owner_equal(b);
+    }
+};
+
 
 // The actual shared_ptr, with forwarding constructors and assignment operators.
 template<typename T>
@@ -101,42 +307,110 @@ class weak_ptr : public __weak_ptr<T> {
 public:
     weak_ptr() : __weak_ptr<T>() {}
 
+    weak_ptr(const weak_ptr& r) : __weak_ptr<T>(r) {}
+
+    weak_ptr(weak_ptr&& r) noexcept : __weak_ptr<T>(std::move(r)) {}
+
     template<typename Y>
     weak_ptr(const weak_ptr<Y>& r) : __weak_ptr<T>(r) {}
 
+    template<typename Y>
+    weak_ptr(weak_ptr<Y>&& r) noexcept : __weak_ptr<T>(std::move(r)) {}
+
     template<typename Y>
     weak_ptr(const shared_ptr<Y>& r) : __weak_ptr<T>(r) {}
 
+    weak_ptr& operator=(const weak_ptr& r) {
+        this->__weak_ptr<T>::operator=(r);
+        return *this;
+    }
+
+    weak_ptr& operator=(weak_ptr&& r) noexcept {
+        this->__weak_ptr<T>::operator=(std::move(r));
+        return *this;
+    }
+
     template<typename Y>
     weak_ptr& operator=(const weak_ptr<Y>& r) {
         this->__weak_ptr<T>::operator=(r);
+        return *this;
+    }
+
+    template<typename Y>
+    weak_ptr& operator=(weak_ptr<Y>&& r) noexcept {
+        this->__weak_ptr<T>::operator=(std::move(r));
+        return *this;
     }
 
     template<typename Y>
     weak_ptr& operator=(const shared_ptr<Y>& r) {
         this->__weak_ptr<T>::operator=(r);
+        return *this;
     }
 
     shared_ptr<T> lock() const {
-#ifdef __GTHREADS
-        if(this->expired())
-            return shared_ptr<T>();
-
-        __try {
-            return shared_ptr<T>(*this);
-        } __catch(const bad_weak_ptr&) {
-            return shared_ptr<T>();
-        }
-#else
-        return this->expired() ? shared_ptr<T>()
-                               : shared_ptr<T>(*this);
-#endif
+        return shared_ptr<T>(*this, sp_nothrow_tag());
     }
 
 
 };
 
 
+
+// Derive T from it to get a shared_ptr to *this from within T, see
+// __enable_shared_from_this.
+template<typename T>
+class enable_shared_from_this {
+protected:
+    enable_shared_from_this() {}
+
+    enable_shared_from_this(const enable_shared_from_this& ) {}
+
+    enable_shared_from_this& operator=(const enable_shared_from_this& ) {
+        return *this;
+    }
+
+    ~enable_shared_from_this() {}
+
+public:
+    // Throws bad_weak_ptr if no shared_ptr owns the object.
+    shared_ptr<T> shared_from_this() {
+        return shared_ptr<T>(_weak_this);
+    }
+
+    shared_ptr<const T> shared_from_this() const {
+        return shared_ptr<const T>(_weak_this);
+    }
+
+    weak_ptr<T> weak_from_this() const {
+        return _weak_this;
+    }
+
+private:
+    template<typename Y>
+    void m_weak_assign(Y* p, const shared_count<>& pn) const {
+        if(_weak_this.expired())
+            static_cast<__weak_ptr<T>&>(_weak_this).m_assign(p, pn);
+    }
+
+    // Taking any policy turns a local_shared_ptr owner into an error
+    // instead of a silent no-op.
+    template<_Lock_policy _Lp, typename Y>
+    friend inline void __enable_shared_from_this_helper(const shared_count<_Lp>& pn,
+                                                        const enable_shared_from_this* pe,
+                                                        const Y* px) {
+        static_assert(_Lp == __default_lock_policy,
+                      "enable_shared_from_this<T> works with shared_ptr<T> only, "
+                      "derive from __enable_shared_from_this<T, _Lp> for other policies");
+        if(NULL != pe)
+            pe->m_weak_assign(const_cast<Y*>(px), pn);
+    }
+
+    mutable weak_ptr<T> _weak_this;
+};
+
+
+SP_END_NAMESPACE_ABI
 }
 
 
@@ -12,6 +12,7 @@
 #ifndef _SHARED_PTR_BASE_H_
 #define _SHARED_PTR_BASE_H_
 
+#include <functional>
 #include <iostream>
 #include <memory>
 #include <cassert>
@@ -19,92 +20,160 @@
 #include "sp_counted_base.h"
 
 namespace jfpu {
+SP_BEGIN_NAMESPACE_ABI
 
 
 
-template<typename T>
+template<typename T, _Lock_policy _Lp = __default_lock_policy>
 class __weak_ptr;
 
+template<typename T, _Lock_policy _Lp = __default_lock_policy>
+class __shared_ptr;
+
+template<typename T, _Lock_policy _Lp = __default_lock_policy,
+         typename Alloc, typename... Args>
+__shared_ptr<T, _Lp> __allocate_shared(const Alloc& a, Args&&... args);
+
+template<typename T, _Lock_policy _Lp = __default_lock_policy>
+class __enable_shared_from_this;
+
+template<typename T>
+class enable_shared_from_this;
+
+// Every constructor that takes ownership of a new object calls this.
+// The overload declared by __enable_shared_from_this is a better match
+// for objects derived from it; all others end up here.
+template<_Lock_policy _Lp>
+inline void __enable_shared_from_this_helper(const shared_count<_Lp>& , ...) {}
+
+// The raw pointer held by a unique_ptr, fancy pointers included.
+template<typename T>
+inline T* sp_to_address(T* p) {
+    return p;
+}
+
+template<typename P>
+inline auto sp_to_address(const P& p) -> decltype(p.operator->()) {
+    return p.operator->();
+}
+
 
 
 // A smart pointer with reference-counted copy semantics.  The
 // object pointed to is deleted when the last shared_ptr pointing to
 // it is destroyed or reset.
-template<typename T>
+// For T = U[] or U[N] the pointer is a U* owned with delete[] and
+// operator[] is the way to reach the elements.
+template<typename T, _Lock_policy _Lp>
 class __shared_ptr {
 public:
-    typedef T element_type;
-    typedef T* pointer_type;
-    typedef __shared_ptr<T> this_type;
+    typedef typename std::remove_extent<T>::type element_type;
+    typedef element_type* pointer_type;
+    typedef __shared_ptr<T, _Lp> this_type;
 private:
     pointer_type px;
-    shared_count pn;
+    shared_count<_Lp> pn;
 
     // used for access private member variable.
-    template<typename Y> friend class __shared_ptr;
-    template<typename Y> friend class __weak_ptr;
+    template<typename Y, _Lock_policy _Lp2> friend class __shared_ptr;
+    template<typename Y, _Lock_policy _Lp2> friend class __weak_ptr;
 public:
     
     __shared_ptr() : px(NULL), pn() {}
     ~__shared_ptr() {};
 
-    __shared_ptr(pointer_type p) : px(p), pn(p) {}
+    __shared_ptr(pointer_type p)
+      : px(p), pn(p, typename sp_default_deleter<T, element_type>::type()) {
+        __enable_shared_from_this_helper(pn, p, p);
+    }
+
+    __shared_ptr(const __shared_ptr& r) : px(r.px), pn(r.pn) {}
 
-    __shared_ptr(__shared_ptr& r) : px(r.px), pn() {
-        pn.swap(r.pn);
+    // Moving leaves r empty and does not touch the reference counts.
+    __shared_ptr(__shared_ptr&& r) noexcept : px(r.px), pn(std::move(r.pn)) {
         r.px = NULL;
     }
 
     template<typename Y>
-    __shared_ptr(const __shared_ptr<Y>& rhs, pointer_type p)
+    __shared_ptr(const __shared_ptr<Y, _Lp>& rhs, pointer_type p)
       : px(p), pn(rhs.pn) {
         __glibcxx_function_requires(_ConvertibleConcept<Y*, T*>)
       }
 
     // http://en.cppreference.com/w/cpp/memory/enable_shared_from_this
     template<typename Y>
-    explicit __shared_ptr(Y* __p) : px(__p), pn(__p) {
+    explicit __shared_ptr(Y* __p)
+      : px(__p), pn(__p, typename sp_default_deleter<T, Y>::type()) {
         __glibcxx_function_requires(_ConvertibleConcept<Y*, T*>)
-        #if 0
-        typedef int _IsComplete[sizeof(Y)];
-        __enable_shared_from_this_helper(_M_refcount, __p, __p);
-        #endif
+        static_assert( sizeof(Y) > 0, "incomplete type" );
+        __enable_shared_from_this_helper(pn, __p, __p);
     }
 
     template<typename D>
     __shared_ptr(std::nullptr_t p, D d) : px(NULL), pn(p, d) {}
+
+    // Non-standard: takes over the reference held by pn, which comes
+    // from shared_count::adopt() on a control block built elsewhere.
+    __shared_ptr(sp_adopt_tag, pointer_type p, shared_count<_Lp>&& pn)
+      : px(p), pn(std::move(pn)) {
+        __enable_shared_from_this_helper(this->pn, p, p);
+    }
     
     template<typename Y, typename D>
     __shared_ptr(Y* p, D d) : px(p), pn(p, d) {
         __glibcxx_function_requires(_ConvertibleConcept<Y*, T*>)
+        __enable_shared_from_this_helper(pn, p, p);
+    }
+
+    // The control block is allocated with a.
+    template<typename Y, typename D, typename A>
+    __shared_ptr(Y* p, D d, A a) : px(p), pn(p, d, a) {
+        __glibcxx_function_requires(_ConvertibleConcept<Y*, T*>)
+        __enable_shared_from_this_helper(pn, p, p);
     }
+
+    template<typename D, typename A>
+    __shared_ptr(std::nullptr_t p, D d, A a) : px(NULL), pn(p, d, a) {}
     
     // http://en.cppreference.com/w/cpp/types/is_convertible
     template<typename Y,
              typename Z = typename std::enable_if<std::is_convertible<Y*, T*>::value>::type >
-    __shared_ptr(const __shared_ptr<Y>& r) : px(r.px), pn(r.pn) {}
+    __shared_ptr(const __shared_ptr<Y, _Lp>& r) : px(r.px), pn(r.pn) {}
+
+    template<typename Y,
+             typename Z = typename std::enable_if<std::is_convertible<Y*, T*>::value>::type >
+    __shared_ptr(__shared_ptr<Y, _Lp>&& r) noexcept : px(r.px), pn(std::move(r.pn)) {
+        r.px = NULL;
+    }
     #if 0
     template<typename Y,
              typename Z = typename std::enable_if<std::is_convertible<Y*, T*>::value>::type >
-    __shared_ptr(const __shared_ptr<Y>& r) : px(r.px), pn(r) {
+    __shared_ptr(const __shared_ptr<Y, _Lp>& r) : px(r.px), pn(r) {
         pn.swap(r.pn);
         r.px = NULL;
     }
     #endif
 
     template<typename Y>
-    explicit __shared_ptr(const __weak_ptr<Y>& r) : pn(r.pn) {
+    explicit __shared_ptr(const __weak_ptr<Y, _Lp>& r) : pn(r.pn) {
         __glibcxx_function_requires(_ConvertibleConcept<Y*, T*>);
         px = r.px;
     }
+
+    // Empty instead of throwing bad_weak_ptr if r has expired.
+    template<typename Y>
+    __shared_ptr(const __weak_ptr<Y, _Lp>& r, sp_nothrow_tag tag) : pn(r.pn, tag) {
+        __glibcxx_function_requires(_ConvertibleConcept<Y*, T*>);
+        px = pn.empty() ? NULL : r.px;
+    }
     
     // If an exception is thrown this constructor has no effect.
     template<typename Y, typename D>
-    __shared_ptr(std::unique_ptr<Y, D>&& r) : px(r.px), pn() {
+    __shared_ptr(std::unique_ptr<Y, D>&& r) : px(sp_to_address(r.get())), pn() {
         __glibcxx_function_requires(_ConvertibleConcept<Y*, T*>);
-        Y* tmp = r.release();
-        pn = shared_count(std::move(tmp));
-        // __enable_shared_from_this_helper(pn, tmp, tmp);
+        auto tmp = sp_to_address(r.get());
+        pn = shared_count<_Lp>(std::move(r));
+        __enable_shared_from_this_helper(pn, tmp, tmp);
     }
     
 #if !defined(__GXX_EXPERIMENTAL_CXX0X__) || _GLIBCXX_USE_DEPRECATED
@@ -115,27 +184,40 @@ public:
     explicit __shared_ptr(std::auto_ptr<Y>& r) : px(r.get()), pn() {
         __glibcxx_function_requires(_ConvertibleConcept<Y*, T*>)
         static_assert( sizeof(Y) > 0, "incomplete type" );
-        Y* tmp = r.release();
-        pn = shared_count(std::move(tmp));
-        // __enable_shared_from_this_helper(pn, tmp, tmp);
+        Y* tmp = r.get();
+        pn = shared_count<_Lp>(r);
+        __enable_shared_from_this_helper(pn, tmp, tmp);
     }
 #endif
 
     template<typename Y>
-    __shared_ptr(const __shared_ptr<Y>& r, __static_cast_tag)
+    __shared_ptr(const __shared_ptr<Y, _Lp>& r, __static_cast_tag)
       : px(static_cast<element_type*>(r.px)), pn(r.pn) {}
     
     template<typename Y>
-    __shared_ptr(const __shared_ptr<Y>& r, __const_cast_tag)
+    __shared_ptr(const __shared_ptr<Y, _Lp>& r, __const_cast_tag)
       : px(const_cast<element_type*>(r.px)), pn(r.pn) {}
     
     template<typename Y>
-    __shared_ptr(const __shared_ptr<Y>& r, __dynamic_cast_tag)
+    __shared_ptr(const __shared_ptr<Y, _Lp>& r, __dynamic_cast_tag)
       : px(dynamic_cast<element_type*>(r.px)), pn(r.pn) {
         if(NULL == px)
-            pn = shared_count();
+            pn = shared_count<_Lp>();
     }
     
+protected:
+    // Used by make_shared/allocate_shared, the object is constructed
+    // inside the control block.
+    template<typename Alloc, typename... Args>
+    __shared_ptr(sp_alloc_shared_tag<Alloc> tag, Args&&... args)
+      : px(NULL), pn(px, tag, std::forward<Args>(args)...) {
+        __enable_shared_from_this_helper(pn, px, px);
+    }
+
+    template<typename Y, _Lock_policy _Lp2, typename Alloc, typename... Args>
+    friend __shared_ptr<Y, _Lp2> __allocate_shared(const Alloc& a, Args&&... args);
+
+public:
     void reset() {
         this_type().swap(*this);
     }
@@ -148,12 +230,12 @@ public:
     }
 
     template<typename Y>
-    void reset(__shared_ptr<Y> const& r) {
+    void reset(__shared_ptr<Y, _Lp> const& r) {
         r.swap(*this);
     }
 
     template<typename Y>
-    void reset(__shared_ptr<Y> const& r, pointer_type p) {
+    void reset(__shared_ptr<Y, _Lp> const& r, pointer_type p) {
         this_type(r, p).swap(*this);
     }
     
@@ -161,6 +243,11 @@ public:
     void reset(Y* p, D d) {
         __shared_ptr(p, d).swap(*this);
     }
+
+    template<typename Y, typename D, typename A>
+    void reset(Y* p, D d, A a) {
+        __shared_ptr(p, d, a).swap(*this);
+    }
     
     pointer_type get() const {
         return px;
@@ -180,7 +267,7 @@ public:
     }
     #if 0
     template<typename Y>
-    void swap(__shared_ptr<Y>& r) {
+    void swap(__shared_ptr<Y, _Lp>& r) {
         std::swap(px, static_cast<T*>(r.px));
         pn.swap(r.pn);
     }
@@ -192,24 +279,50 @@ private:
     }
 public:
     
-    template<typename D, typename Y>
-    friend D* get_deleter(const __shared_ptr<Y>& p);
+    template<typename D, typename Y, _Lock_policy _Lp2>
+    friend D* get_deleter(const __shared_ptr<Y, _Lp2>& p);
     
     template<typename Y>
-    bool owner_before(__shared_ptr<Y> const& rhs) const {
+    bool owner_before(__shared_ptr<Y, _Lp> const& rhs) const {
         return pn < rhs.pn;
     }
     
     template<typename Y>
-    bool owner_before(__weak_ptr<Y> const& rhs) const {
+    bool owner_before(__weak_ptr<Y, _Lp> const& rhs) const {
         return pn < rhs.pn;
     }
+
+    // Hash and equality of the control block, the same for every
+    // pointer sharing ownership with this one, aliases included.
+    std::size_t owner_hash() const {
+        return std::hash<const void*>()(pn._internal_block());
+    }
+
+    template<typename Y>
+    bool owner_equal(__shared_ptr<Y, _Lp> const& rhs) const {
+        return pn._internal_block() == rhs._internal_block();
+    }
+
+    template<typename Y>
+    bool owner_equal(__weak_ptr<Y, _Lp> const& rhs) const {
+        return pn._internal_block() == rhs._internal_block();
+    }
     
     bool _internal_equiv(__shared_ptr const& rhs) const {
         return px == rhs.px && pn == rhs.pn;
     }
+
+    // Used by sp_batch.h, see shared_count.
+    sp_counted_base<_Lp>* _internal_block() const {
+        return pn._internal_block();
+    }
+
+    sp_counted_base<_Lp>* _internal_detach() {
+        px = NULL;
+        return pn._internal_detach();
+    }
     
-    element_type operator*() const {
+    typename std::add_lvalue_reference<element_type>::type operator*() const {
         assert(NULL != px);
         return *px;
     }
@@ -218,6 +331,12 @@ public:
         assert(NULL != px);
         return px;
     }
+
+    typename std::add_lvalue_reference<element_type>::type operator[](std::ptrdiff_t i) const {
+        assert(NULL != px && 0 <= i);
+        assert(0 == std::extent<T>::value || i < std::ptrdiff_t(std::extent<T>::value));
+        return px[i];
+    }
     
     bool operator!() const {
         return NULL == px;
@@ -227,6 +346,17 @@ public:
         this_type(r).swap(*this);
         return *this;
     }
+
+    __shared_ptr& operator=(__shared_ptr&& r) noexcept {
+        this_type(std::move(r)).swap(*this);
+        return *this;
+    }
+
+    template<typename Y>
+    __shared_ptr& operator=(__shared_ptr<Y, _Lp>&& r) noexcept {
+        this_type(std::move(r)).swap(*this);
+        return *this;
+    }
     
 // http://zh.cppreference.com/w/cpp/algorithm/move
 //#if _GLIBCXX_USE_DEPRECATED
@@ -254,73 +384,86 @@ public:
     }
     
     template<typename Y>
-    friend inline bool operator<(__shared_ptr const& l, __shared_ptr<Y> const& r) {
-        l.owner_before(r);
+    friend inline bool operator<(__shared_ptr const& l, __shared_ptr<Y, _Lp> const& r) {
+        return l.owner_before(r);
     }
     
     template<typename Y>
-    friend inline bool operator==(__shared_ptr const& l, __shared_ptr<Y> const& r) {
+    friend inline bool operator==(__shared_ptr const& l, __shared_ptr<Y, _Lp> const& r) {
         return l.get() == r.get();
     }
     
     template<typename Y>
-    friend inline bool operator!=(__shared_ptr const& l, __shared_ptr<Y> const& r) {
+    friend inline bool operator!=(__shared_ptr const& l, __shared_ptr<Y, _Lp> const& r) {
         return l.get() != r.get();
     }
 
     
 };
 
-template<typename Y>
-inline void swap(__shared_ptr<Y>& lhs, __shared_ptr<Y>& rhs) {
+template<typename Y, _Lock_policy _Lp>
+inline void swap(__shared_ptr<Y, _Lp>& lhs, __shared_ptr<Y, _Lp>& rhs) {
     lhs.swap(rhs);
 }
 
-template<typename T, typename U>
-__shared_ptr<T> static_pointer_cast(__shared_ptr<U> const& rhs) {
+template<typename T, typename U, _Lock_policy _Lp>
+__shared_ptr<T, _Lp> static_pointer_cast(__shared_ptr<U, _Lp> const& rhs) {
     (void)static_cast<T*>(static_cast<U*>(0));
-    typedef typename __shared_ptr<T>::pointer_type PE;
+    typedef typename __shared_ptr<T, _Lp>::pointer_type PE;
     PE p = static_cast<PE>(rhs.get());
-    return __shared_ptr<T>(rhs, p);
+    return __shared_ptr<T, _Lp>(rhs, p);
 }
 
-template<typename T, typename U>
-__shared_ptr<T> const_pointer_cast(__shared_ptr<U> const& rhs) {
+template<typename T, typename U, _Lock_policy _Lp>
+__shared_ptr<T, _Lp> const_pointer_cast(__shared_ptr<U, _Lp> const& rhs) {
     (void)const_cast<T*>(static_cast<U*>(0));
-    typedef typename __shared_ptr<T>::pointer_type PE;
+    typedef typename __shared_ptr<T, _Lp>::pointer_type PE;
     PE p = const_cast<PE>(rhs.get());
-    return __shared_ptr<T>(rhs, p);
+    return __shared_ptr<T, _Lp>(rhs, p);
 }
 
-template<typename T, typename U>
-__shared_ptr<T> dynamic_pointer_cast(__shared_ptr<U> const& rhs) {
+template<typename T, typename U, _Lock_policy _Lp>
+__shared_ptr<T, _Lp> dynamic_pointer_cast(__shared_ptr<U, _Lp> const& rhs) {
     (void)dynamic_cast<T*>(static_cast<U*>(0));
-    typedef typename __shared_ptr<T>::pointer_type PE;
+    typedef typename __shared_ptr<T, _Lp>::pointer_type PE;
     PE p = dynamic_cast<PE>(rhs.get());
-    return __shared_ptr<T>(rhs, p);
+    return __shared_ptr<T, _Lp>(rhs, p);
 }
 
-template<typename T, typename U>
-__shared_ptr<T> reinterpret_pointer_cast(__shared_ptr<U> const& rhs) {
+template<typename T, typename U, _Lock_policy _Lp>
+__shared_ptr<T, _Lp> reinterpret_pointer_cast(__shared_ptr<U, _Lp> const& rhs) {
     (void)reinterpret_cast<T*>(static_cast<U*>(0));
-    typedef typename __shared_ptr<T>::pointer_type PE;
+    typedef typename __shared_ptr<T, _Lp>::pointer_type PE;
     PE p = reinterpret_cast<PE>(rhs.get());
-    return __shared_ptr<T>(rhs, p);
+    return __shared_ptr<T, _Lp>(rhs, p);
 }
 
-template<typename T>
-inline typename __shared_ptr<T>::pointer_type get_pointer(__shared_ptr<T> const& rhs) {
+// Create an object that is owned by a __shared_ptr, the object and
+// its reference counts share a single allocation obtained from a.
+template<typename T, _Lock_policy _Lp, typename Alloc, typename... Args>
+inline __shared_ptr<T, _Lp> __allocate_shared(const Alloc& a, Args&&... args) {
+    return __shared_ptr<T, _Lp>(sp_alloc_shared_tag<Alloc>(a), std::forward<Args>(args)...);
+}
+
+template<typename T, _Lock_policy _Lp = __default_lock_policy, typename... Args>
+inline __shared_ptr<T, _Lp> __make_shared(Args&&... args) {
+    typedef typename std::remove_cv<T>::type value_type;
+    return jfpu::__allocate_shared<T, _Lp>(std::allocator<value_type>(), std::forward<Args>(args)...);
+}
+
+template<typename T, _Lock_policy _Lp>
+inline typename __shared_ptr<T, _Lp>::pointer_type get_pointer(__shared_ptr<T, _Lp> const& rhs) {
     return rhs.get();
 }
 
-template<typename T>
-std::ostream& operator<<(std::ostream& os, __shared_ptr<T> const& rhs) {
+template<typename T, _Lock_policy _Lp>
+std::ostream& operator<<(std::ostream& os, __shared_ptr<T, _Lp> const& rhs) {
     os << rhs.get();
     return os;
 }
 
-template<typename D, typename Y>
-inline D* get_deleter(const __shared_ptr<Y>& p) {
+template<typename D, typename Y, _Lock_policy _Lp>
+inline D* get_deleter(const __shared_ptr<Y, _Lp>& p) {
 #ifdef __GXX_RTTI
     return static_cast<D*>(p.m_get_deleter(typeid(D)));
 #else
@@ -329,67 +472,81 @@ inline D* get_deleter(const __shared_ptr<Y>& p) {
 }
 
 
-template<typename T>
+template<typename T, _Lock_policy _Lp>
 class __weak_ptr {
 public:
-    typedef T element_type;
-    typedef T* pointer_type;
-    typedef __weak_ptr<T> this_type;
+    typedef typename std::remove_extent<T>::type element_type;
+    typedef element_type* pointer_type;
+    typedef __weak_ptr<T, _Lp> this_type;
 private:
     pointer_type px;
-    weak_count pn;
+    weak_count<_Lp> pn;
 
 public:
     __weak_ptr() : px(NULL), pn() {}
+
+    __weak_ptr(const __weak_ptr& r) : px(r.px), pn(r.pn) {}
+
+    __weak_ptr(__weak_ptr&& r) noexcept : px(r.px), pn(std::move(r.pn)) {
+        r.px = NULL;
+    }
     
 
     // It is not possible to avoid spurious access violations since in multithreaded
     // programs r.px may bt invalidated at any point.
     template<typename Y>
-    __weak_ptr(const __weak_ptr<Y>& r) : pn(r.pn) {
+    __weak_ptr(const __weak_ptr<Y, _Lp>& r) : pn(r.pn) {
         __glibcxx_function_requires(_ConvertibleConcept<Y*, T*>);
         px = r.lock().get();
     }
 
+    // Same as the converting copy, r.px may already be dangling.
+    template<typename Y>
+    __weak_ptr(__weak_ptr<Y, _Lp>&& r) noexcept : px(r.lock().get()), pn(std::move(r.pn)) {
+        __glibcxx_function_requires(_ConvertibleConcept<Y*, T*>);
+        r.px = NULL;
+    }
+
     template<typename Y>
-    __weak_ptr(const __shared_ptr<Y>& r) : px(r.px), pn(r.pn) {
+    __weak_ptr(const __shared_ptr<Y, _Lp>& r) : px(r.px), pn(r.pn) {
         __glibcxx_function_requires(_ConvertibleConcept<Y*, T*>);
     }
 
+    __weak_ptr& operator=(const __weak_ptr& r) {
+        px = r.px;
+        pn = r.pn;
+        return *this;
+    }
+
+    __weak_ptr& operator=(__weak_ptr&& r) noexcept {
+        __weak_ptr(std::move(r)).swap(*this);
+        return *this;
+    }
+
     template<typename Y>
-    __weak_ptr& operator=(const __weak_ptr<Y>& r) {
-        if(*this != r) {
-            px = r.lock().get();
-            pn = r.pn;
-        }
+    __weak_ptr& operator=(const __weak_ptr<Y, _Lp>& r) {
+        px = r.lock().get();
+        pn = r.pn;
         return *this;
     }
 
     template<typename Y>
-    __weak_ptr& operator=(const __shared_ptr<Y>& r) {
-        if(*this != r) {
-            px = r.px;
-            pn = r.pn;
-        }
+    __weak_ptr& operator=(__weak_ptr<Y, _Lp>&& r) noexcept {
+        __weak_ptr(std::move(r)).swap(*this);
         return *this;
     }
 
-    __shared_ptr<T> lock() const {
-#ifndef __GTHREADS
-        if(expired())
-            return __shared_ptr<element_type>();
+    template<typename Y>
+    __weak_ptr& operator=(const __shared_ptr<Y, _Lp>& r) {
+        px = r.px;
+        pn = r.pn;
+        return *this;
+    }
 
-        __try {
-            return __shared_ptr<element_type>(*this);
-        } __catch(const bad_weak_ptr&) {
-            // Q: How can we get here?
-            // A: Another thread may have invalidated r after the use_count test above
-            return __shared_ptr<element_type>();
-        }
-#else
-        return expired() ? __shared_ptr<element_type>()
-                         : __shared_ptr<element_type>(*this);
-#endif
+    // A single add-if-not-zero on the count, no exception if another
+    // thread released the last reference meanwhile.
+    __shared_ptr<T, _Lp> lock() const {
+        return __shared_ptr<T, _Lp>(*this, sp_nothrow_tag());
     }
 
     long use_count() const {
@@ -409,24 +566,47 @@ public:
         pn.swap(r.pn);
     }
 
+    // See __shared_ptr::owner_hash(), an expired pointer keeps its owner.
+    std::size_t owner_hash() const {
+        return std::hash<const void*>()(pn._internal_block());
+    }
+
+    template<typename Y>
+    bool owner_equal(__shared_ptr<Y, _Lp> const& rhs) const {
+        return pn._internal_block() == rhs._internal_block();
+    }
+
+    template<typename Y>
+    bool owner_equal(__weak_ptr<Y, _Lp> const& rhs) const {
+        return pn._internal_block() == rhs._internal_block();
+    }
+
+    bool _internal_equiv(__weak_ptr const& rhs) const {
+        return px == rhs.px && pn == rhs.pn;
+    }
+
+    sp_counted_base<_Lp>* _internal_block() const {
+        return pn._internal_block();
+    }
+
 private:
-    void m_assign(T* ptr, const shared_count& refcount) {
+    void m_assign(pointer_type ptr, const shared_count<_Lp>& refcount) {
         px = ptr;
         pn = refcount;
     }
 
     template<typename Y >
-    bool m_less(const __weak_ptr<Y>& rhs) const {
+    bool m_less(const __weak_ptr<Y, _Lp>& rhs) const {
         return pn < rhs.pn;
     }
 
-    template<typename Y> friend class __shared_ptr;
-    template<typename Y> friend class __weak_ptr;
-    // friend class __enable_shared_from_this<T>;
-    //  friend class enable_shared_from_this<T>;
+    template<typename Y, _Lock_policy _Lp2> friend class __shared_ptr;
+    template<typename Y, _Lock_policy _Lp2> friend class __weak_ptr;
+    friend class __enable_shared_from_this<T, _Lp>;
+    friend class enable_shared_from_this<T>;
 
     template<typename Y>
-    friend inline bool operator<(const __weak_ptr& lhs, const __weak_ptr<Y>& rhs) {
+    friend inline bool operator<(const __weak_ptr& lhs, const __weak_ptr<Y, _Lp>& rhs) {
         return lhs.m_less(rhs);
     }
 
@@ -434,6 +614,61 @@ private:
 
 
 
+
+// Derive T from it to get a __shared_ptr to *this from within T.  The
+// first __shared_ptr that takes ownership of the object fills in
+// _weak_this; copying or assigning the base leaves it alone.
+template<typename T, _Lock_policy _Lp>
+class __enable_shared_from_this {
+protected:
+    __enable_shared_from_this() {}
+
+    __enable_shared_from_this(const __enable_shared_from_this& ) {}
+
+    __enable_shared_from_this& operator=(const __enable_shared_from_this& ) {
+        return *this;
+    }
+
+    ~__enable_shared_from_this() {}
+
+public:
+    // Throws bad_weak_ptr if no __shared_ptr owns the object.
+    __shared_ptr<T, _Lp> shared_from_this() {
+        return __shared_ptr<T, _Lp>(_weak_this);
+    }
+
+    __shared_ptr<const T, _Lp> shared_from_this() const {
+        return __shared_ptr<const T, _Lp>(_weak_this);
+    }
+
+    __weak_ptr<T, _Lp> weak_from_this() const {
+        return _weak_this;
+    }
+
+private:
+    template<typename Y>
+    void m_weak_assign(Y* p, const shared_count<_Lp>& pn) const {
+        if(_weak_this.expired())
+            _weak_this.m_assign(p, pn);
+    }
+
+    // Owners of another policy would otherwise pick the no-op overload.
+    template<_Lock_policy _Lp2, typename Y>
+    friend inline void __enable_shared_from_this_helper(const shared_count<_Lp2>& pn,
+                                                        const __enable_shared_from_this* pe,
+                                                        const Y* px) {
+        static_assert(_Lp2 == _Lp,
+                      "__enable_shared_from_this<T, _Lp> needs an owner with the policy _Lp");
+        if(NULL != pe)
+            pe->m_weak_assign(const_cast<Y*>(px), pn);
+    }
+
+    mutable __weak_ptr<T, _Lp> _weak_this;
+};
+
+
+
+SP_END_NAMESPACE_ABI
 }
 
 
@@ -0,0 +1,215 @@
+/*=============================================================================
+#     FileName: sp_arena.h
+#         Desc: shared_ptrs allocated from a monotonic arena
+#       Author: Jeffrey Pu
+#        Email: pujunying@gmail.com
+#     HomePage: https://github.com/jfpu
+#      Version: 0.0.1
+#   LastChange: 2026-10-17 20:18:44
+#      History:
+=============================================================================*/
+
+#ifndef _SP_ARENA_H_
+#define _SP_ARENA_H_
+
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <type_traits>
+#include "shared_ptr.h"
+
+namespace jfpu {
+SP_BEGIN_NAMESPACE_ABI
+
+// Monotonic arena: allocation bumps a pointer through chunks taken from
+// operator new, nothing is freed before release() or the destructor,
+// which free everything at once.  Allocation is not thread safe; one
+// thread at a time, typically the one serving the request.
+//
+// In builds without NDEBUG the arena counts the control blocks made by
+// allocate_arena_shared() that are still alive and release() asserts
+// there are none.
+class sp_arena {
+    struct chunk {
+        chunk* prev;
+        std::size_t size;
+    };
+
+    chunk* _chunks;
+    char* _cur;
+    char* _end;
+    std::size_t _next_size;
+#ifndef NDEBUG
+    std::atomic<long> _blocks;
+#endif
+
+    sp_arena(sp_arena const& );
+    sp_arena& operator=(sp_arena const& );
+
+    void* allocate_slow(std::size_t n, std::size_t align) {
+        std::size_t size = _next_size;
+        while(size < n + align + sizeof(chunk))
+            size *= 2;
+        chunk* c = static_cast<chunk*>(::operator new(size));
+        c->prev = _chunks;
+        c->size = size;
+        _chunks = c;
+        _cur = reinterpret_cast<char*>(c + 1);
+        _end = reinterpret_cast<char*>(c) + size;
+        _next_size = size * 2;
+        return allocate(n, align);
+    }
+
+public:
+    explicit sp_arena(std::size_t first_chunk = 4096)
+      : _chunks(NULL), _cur(NULL), _end(NULL), _next_size(first_chunk) {
+#ifndef NDEBUG
+        _blocks = 0;
+#endif
+    }
+
+    ~sp_arena() {
+        release();
+    }
+
+    void* allocate(std::size_t n, std::size_t align = alignof(std::max_align_t)) {
+        std::uintptr_t p = reinterpret_cast<std::uintptr_t>(_cur);
+        std::uintptr_t a = (p + align - 1) & ~static_cast<std::uintptr_t>(align - 1);
+        if(NULL == _cur || a + n > reinterpret_cast<std::uintptr_t>(_end))
+            return allocate_slow(n, align);
+        _cur = reinterpret_cast<char*>(a + n);
+        return reinterpret_cast<void*>(a);
+    }
+
+    // Frees every chunk.  Objects allocated from the arena must be gone.
+    void release() {
+#ifndef NDEBUG
+        assert(0 == _blocks.load(std::memory_order_acquire));
+#endif
+        while(NULL != _chunks) {
+            chunk* prev = _chunks->prev;
+            ::operator delete(_chunks);
+            _chunks = prev;
+        }
+        _cur = NULL;
+        _end = NULL;
+    }
+
+    // Bytes held in chunks.
+    std::size_t reserved() const {
+        std::size_t n = 0;
+        for(chunk* c = _chunks; NULL != c; c = c->prev)
+            n += c->size;
+        return n;
+    }
+
+    void _internal_block_created() {
+#ifndef NDEBUG
+        _blocks.fetch_add(1, std::memory_order_relaxed);
+#endif
+    }
+
+    void _internal_block_destroyed() {
+#ifndef NDEBUG
+        _blocks.fetch_sub(1, std::memory_order_release);
+#endif
+    }
+};
+
+template<typename R>
+inline void sp_arena_block_created(R& ) {}
+
+template<typename R>
+inline void sp_arena_block_destroyed(R& ) {}
+
+inline void sp_arena_block_created(sp_arena& a) {
+    a._internal_block_created();
+}
+
+inline void sp_arena_block_destroyed(sp_arena& a) {
+    a._internal_block_destroyed();
+}
+
+
+
+// make_shared layout in memory from Resource, anything with
+// allocate(bytes, alignment): sp_arena or std::pmr::memory_resource
+// (say a monotonic_buffer_resource).  The memory is never given back
+// one block at a time, destroy() only runs the block's destructor.
+// dispose() destroys the object, and does nothing at all for trivially
+// destructible types.
+template<typename T, typename Resource, _Lock_policy _Lp = __default_lock_policy>
+class sp_counted_arena_inplace final : public sp_counted_base<_Lp> {
+    typedef typename std::remove_cv<T>::type value_type;
+    typedef typename std::aligned_storage<sizeof(T),
+                                          std::alignment_of<T>::value>::type storage_type;
+
+    Resource& _resource;
+    storage_type _storage;
+
+    sp_counted_arena_inplace(sp_counted_arena_inplace const& );
+    sp_counted_arena_inplace& operator=(sp_counted_arena_inplace const& );
+
+public:
+    template<typename... Args>
+    explicit sp_counted_arena_inplace(Resource& r, Args&&... args) : _resource(r) {
+        ::new(static_cast<void*>(ptr())) value_type(std::forward<Args>(args)...);
+        sp_arena_block_created(_resource);
+        SP_BLOCK_BIND(sp_counted_arena_inplace);
+    }
+
+    value_type* ptr() {
+        return static_cast<value_type*>(static_cast<void*>(&_storage));
+    }
+
+    void dispose() {
+        if(!std::is_trivially_destructible<value_type>::value)
+            ptr()->~value_type();
+    }
+
+    void destroy() {
+        Resource& r = _resource;
+        this->~sp_counted_arena_inplace();
+        sp_arena_block_destroyed(r);
+    }
+
+    void release_last() {
+        SP_PROFILE_DISPOSE(this, sp_counted_arena_inplace::dispose());
+        this->weak_release();
+    }
+
+    void* get_deleter(const std::type_info& ti) {
+#ifdef __GXX_RTTI
+        return ti == typeid(sp_inplace_tag<T>) ? static_cast<void*>(ptr()) : NULL;
+#else
+        return NULL;
+#endif
+    }
+
+    // If the object's constructor throws, the memory stays in the arena
+    // until it is released.
+    template<typename... Args>
+    static sp_counted_arena_inplace* create(Resource& r, Args&&... args) {
+        void* p = r.allocate(sizeof(sp_counted_arena_inplace),
+                             std::alignment_of<sp_counted_arena_inplace>::value);
+        return ::new(p) sp_counted_arena_inplace(r, std::forward<Args>(args)...);
+    }
+};
+
+// Like make_shared, with the block and the object in memory from r.
+// Every shared_ptr and weak_ptr to the object must be gone before r
+// frees its memory.
+template<typename T, typename Resource, typename... Args>
+inline shared_ptr<T> allocate_arena_shared(Resource& r, Args&&... args) {
+    static_assert(!std::is_array<T>::value, "allocate_arena_shared does not make arrays");
+    typedef sp_counted_arena_inplace<T, Resource> impl_type;
+    impl_type* pi = impl_type::create(r, std::forward<Args>(args)...);
+    return shared_ptr<T>(sp_adopt_tag(), pi->ptr(), shared_count<>::adopt(pi));
+}
+
+SP_END_NAMESPACE_ABI
+}
+
+#endif
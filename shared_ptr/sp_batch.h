@@ -0,0 +1,198 @@
+/*=============================================================================
+#     FileName: sp_batch.h
+#         Desc: batched release and copy of ranges of shared_ptrs
+#       Author: Jeffrey Pu
+#        Email: pujunying@gmail.com
+#     HomePage: https://github.com/jfpu
+#      Version: 0.0.1
+#   LastChange: 2026-10-17 16:41:55
+#      History:
+=============================================================================*/
+
+#ifndef _SP_BATCH_H_
+#define _SP_BATCH_H_
+
+#include <iterator>
+#include "shared_ptr.h"
+
+namespace jfpu {
+SP_BEGIN_NAMESPACE_ABI
+
+// Walking a range of shared_ptrs one element at a time stalls on every
+// control block: the atomic on _pi cannot start until the load of _pi
+// is done and the block's line has arrived.  release_range() and
+// copy_range() instead
+//   - prefetch the control block SP_BATCH_PREFETCH elements ahead,
+//   - fold a run of adjacent elements with the same control block into
+//     one atomic add of the run length,
+//   - (release_range) run the deleters of the blocks that reached zero
+//     after the counts of up to SP_BATCH_DEFERRED blocks are done, so
+//     the deleters do not sit between the decrements.
+
+#ifndef SP_BATCH_PREFETCH
+#define SP_BATCH_PREFETCH 8
+#endif
+
+#ifndef SP_BATCH_DEFERRED
+#define SP_BATCH_DEFERRED 64
+#endif
+
+template<typename Block>
+struct sp_batch_policy;
+
+template<_Lock_policy _Lp>
+struct sp_batch_policy<sp_counted_base<_Lp> > {
+    static const _Lock_policy value = _Lp;
+};
+
+template<_Lock_policy _Lp>
+class sp_batch_releaser {
+    sp_counted_base<_Lp>* _run;
+    long _n;
+    sp_counted_base<_Lp>* _last[SP_BATCH_DEFERRED];
+    int _nlast;
+
+    sp_batch_releaser(sp_batch_releaser const& );
+    sp_batch_releaser& operator=(sp_batch_releaser const& );
+
+    void end_run() {
+        if(NULL == _run)
+            return;
+        SP_PROFILE_COUNT_N(_run, sp_prof_release, _n);
+        if(_run->release_n(_n)) {
+            _last[_nlast++] = _run;
+            if(SP_BATCH_DEFERRED == _nlast)
+                flush();
+        }
+        _run = NULL;
+    }
+
+    void flush() {
+        int n = _nlast;
+        _nlast = 0;
+        for(int i = 0; i < n; ++i)
+            _last[i]->release_last();
+    }
+
+public:
+    sp_batch_releaser() : _run(NULL), _n(0), _nlast(0) {}
+
+    ~sp_batch_releaser() {
+        end_run();
+        flush();
+    }
+
+    // Takes over the reference held through pi.
+    void add(sp_counted_base<_Lp>* pi) {
+        if(pi == _run) {
+            ++_n;
+            return;
+        }
+        end_run();
+        _run = pi;
+        _n = 1;
+    }
+};
+
+template<typename T, _Lock_policy _Lp>
+inline void sp_batch_prefetch(const __shared_ptr<T, _Lp>& p) {
+    __builtin_prefetch(p._internal_block(), 1);
+}
+
+template<typename T, _Lock_policy _Lp>
+inline sp_counted_base<_Lp>* sp_batch_detach(__shared_ptr<T, _Lp>& p) {
+    return p._internal_detach();
+}
+
+template<typename T, _Lock_policy _Lp>
+inline sp_counted_base<_Lp>* sp_batch_block(const __shared_ptr<T, _Lp>& p) {
+    return p._internal_block();
+}
+
+// Steps ahead by up to SP_BATCH_PREFETCH elements, less near last.
+template<typename It>
+inline It sp_batch_ahead(It first, It last) {
+    for(int i = 0; i < SP_BATCH_PREFETCH && first != last; ++i)
+        ++first;
+    return first;
+}
+
+
+
+// Releases every shared_ptr in [first, last) and leaves them empty.
+// The same as calling reset() on each of them, except that deleters
+// may run later than the decrement of their own element.
+template<typename It>
+void release_range(It first, It last) {
+    typedef typename std::iterator_traits<It>::value_type value_type;
+    typedef decltype(sp_batch_block(std::declval<value_type&>())) block_pointer;
+    typedef typename std::remove_pointer<block_pointer>::type block_type;
+    sp_batch_releaser<sp_batch_policy<block_type>::value> rel;
+    It ahead = sp_batch_ahead(first, last);
+    for(; first != last; ++first) {
+        if(ahead != last) {
+            sp_batch_prefetch(*ahead);
+            ++ahead;
+        }
+        block_pointer pi = sp_batch_detach(*first);
+        if(NULL != pi)
+            rel.add(pi);
+    }
+}
+
+// Copies [first, last) to out and returns the end of the output, like
+// std::copy.  References to one control block in a row are taken with
+// a single atomic add.  If writing to out throws, the references not
+// handed out yet are given back.
+template<typename It, typename Out>
+Out copy_range(It first, It last, Out out) {
+    typedef typename std::iterator_traits<It>::value_type value_type;
+    typedef decltype(sp_batch_block(std::declval<value_type&>())) block_pointer;
+    typedef typename std::remove_pointer<block_pointer>::type block_type;
+    typedef shared_count<sp_batch_policy<block_type>::value> count_type;
+    It ahead = sp_batch_ahead(first, last);
+    while(first != last) {
+        block_pointer pi = sp_batch_block(*first);
+        if(NULL == pi) {
+            *out = *first;
+            ++out;
+            ++first;
+            if(ahead != last)
+                ++ahead;
+            continue;
+        }
+        // Length of the run of elements sharing pi.
+        It end = first;
+        long n = 0;
+        do {
+            if(ahead != last) {
+                sp_batch_prefetch(*ahead);
+                ++ahead;
+            }
+            ++end;
+            ++n;
+        } while(end != last && sp_batch_block(*end) == pi);
+
+        SP_PROFILE_COUNT_N(pi, sp_prof_add_ref_copy, n);
+        pi->add_ref_copy(n);
+        try {
+            for(; first != end; ++first, --n) {
+                // Owns one of the n references from here on.
+                value_type v(sp_adopt_tag(), first->get(), count_type::adopt(pi));
+                *out = std::move(v);
+                ++out;
+            }
+        } catch(...) {
+            --n;
+            if(n > 0 && pi->release_n(n))
+                pi->release_last();
+            throw;
+        }
+    }
+    return out;
+}
+
+SP_END_NAMESPACE_ABI
+}
+
+#endif
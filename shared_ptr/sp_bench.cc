@@ -0,0 +1,499 @@
+/*=============================================================================
+#     FileName: sp_bench.cc
+#         Desc: microbenchmarks of jfpu::shared_ptr against std and boost
+#       Author: Jeffrey Pu
+#        Email: pujunying@gmail.com
+#     HomePage: https://github.com/jfpu
+#      Version: 0.0.1
+#   LastChange: 2026-10-17 14:02:31
+#      History:
+=============================================================================*/
+
+// make bench                       jfpu and std, CSV on stdout
+// make bench BOOST=1 FORMAT=json   also boost::shared_ptr, JSON
+//
+// Every benchmark runs a fixed number of operations; the first round
+// is a warm-up, the minimum and the median of the following rounds are
+// reported in nanoseconds per operation.  --cpu N pins the process.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+#ifdef __linux__
+#include <sched.h>
+#endif
+#include "shared_ptr.h"
+#include "sp_arena.h"
+#include "sp_batch.h"
+#if SP_BENCH_WITH_BOOST
+#include <boost/shared_ptr.hpp>
+#include <boost/weak_ptr.hpp>
+#include <boost/make_shared.hpp>
+#endif
+
+namespace {
+
+// Keeps the compiler from dropping the value or hoisting it out of the
+// timed loop.
+template<typename T>
+inline void do_not_optimize(T const& v) {
+    asm volatile("" : : "g"(&v) : "memory");
+}
+
+struct Base {
+    virtual ~Base() {}
+    int b;
+};
+
+struct Derived : Base {
+    int d;
+};
+
+struct jfpu_impl {
+    static const char* name() { return "jfpu"; }
+
+    template<typename T>
+    struct ptr {
+        typedef jfpu::shared_ptr<T> shared;
+        typedef jfpu::weak_ptr<T> weak;
+    };
+
+    template<typename T, typename... Args>
+    static jfpu::shared_ptr<T> make(Args&&... args) {
+        return jfpu::make_shared<T>(std::forward<Args>(args)...);
+    }
+
+    template<typename T, typename U>
+    static jfpu::shared_ptr<T> static_cast_to(const jfpu::shared_ptr<U>& p) {
+        return jfpu::static_pointer_cast<T>(p);
+    }
+
+    template<typename T, typename U>
+    static jfpu::shared_ptr<T> dynamic_cast_to(const jfpu::shared_ptr<U>& p) {
+        return jfpu::dynamic_pointer_cast<T>(p);
+    }
+};
+
+struct std_impl {
+    static const char* name() { return "std"; }
+
+    template<typename T>
+    struct ptr {
+        typedef std::shared_ptr<T> shared;
+        typedef std::weak_ptr<T> weak;
+    };
+
+    template<typename T, typename... Args>
+    static std::shared_ptr<T> make(Args&&... args) {
+        return std::make_shared<T>(std::forward<Args>(args)...);
+    }
+
+    template<typename T, typename U>
+    static std::shared_ptr<T> static_cast_to(const std::shared_ptr<U>& p) {
+        return std::static_pointer_cast<T>(p);
+    }
+
+    template<typename T, typename U>
+    static std::shared_ptr<T> dynamic_cast_to(const std::shared_ptr<U>& p) {
+        return std::dynamic_pointer_cast<T>(p);
+    }
+};
+
+#if SP_BENCH_WITH_BOOST
+struct boost_impl {
+    static const char* name() { return "boost"; }
+
+    template<typename T>
+    struct ptr {
+        typedef boost::shared_ptr<T> shared;
+        typedef boost::weak_ptr<T> weak;
+    };
+
+    template<typename T, typename... Args>
+    static boost::shared_ptr<T> make(Args&&... args) {
+        return boost::make_shared<T>(std::forward<Args>(args)...);
+    }
+
+    template<typename T, typename U>
+    static boost::shared_ptr<T> static_cast_to(const boost::shared_ptr<U>& p) {
+        return boost::static_pointer_cast<T>(p);
+    }
+
+    template<typename T, typename U>
+    static boost::shared_ptr<T> dynamic_cast_to(const boost::shared_ptr<U>& p) {
+        return boost::dynamic_pointer_cast<T>(p);
+    }
+};
+#endif
+
+
+
+struct options {
+    long iters;
+    int reps;
+    int cpu;
+    std::string format;
+    std::string filter;
+    std::string impls;
+
+    options() : iters(1000000), reps(7), cpu(-1), format("csv"), impls("jfpu,std,boost") {}
+};
+
+struct result {
+    std::string impl;
+    std::string bench;
+    long iters;
+    double min_ns;
+    double median_ns;
+};
+
+typedef std::chrono::steady_clock bench_clock;
+
+class runner {
+    const options& _opt;
+    std::vector<result> _results;
+
+public:
+    explicit runner(const options& opt) : _opt(opt) {}
+
+    const std::vector<result>& results() const {
+        return _results;
+    }
+
+    bool wanted(const char* bench) const {
+        return _opt.filter.empty() || NULL != std::strstr(bench, _opt.filter.c_str());
+    }
+
+    long iters() const {
+        return _opt.iters;
+    }
+
+    // f(n) performs n operations and returns the time they took, so
+    // the setup and teardown of each round stay out of the measurement.
+    template<typename F>
+    void run(const char* impl, const char* bench, F f) {
+        if(!wanted(bench))
+            return;
+        std::vector<double> ns;
+        for(int r = 0; r <= _opt.reps; ++r) {
+            bench_clock::duration d = f(_opt.iters);
+            if(0 == r)
+                continue;
+            ns.push_back(std::chrono::duration<double, std::nano>(d).count() / _opt.iters);
+        }
+        std::sort(ns.begin(), ns.end());
+        result res;
+        res.impl = impl;
+        res.bench = bench;
+        res.iters = _opt.iters;
+        res.min_ns = ns.front();
+        res.median_ns = ns[ns.size() / 2];
+        _results.push_back(res);
+    }
+};
+
+
+
+template<typename I>
+void run_suite(runner& r) {
+    typedef typename I::template ptr<int>::shared sp_int;
+    typedef typename I::template ptr<int>::weak wp_int;
+    typedef typename I::template ptr<Base>::shared sp_base;
+    typedef typename I::template ptr<Derived>::shared sp_derived;
+    const char* impl = I::name();
+
+    r.run(impl, "construct_new", [](long n) {
+        bench_clock::time_point t0 = bench_clock::now();
+        for(long i = 0; i < n; ++i) {
+            sp_int p(new int(int(i)));
+            do_not_optimize(p);
+        }
+        return bench_clock::now() - t0;
+    });
+
+    r.run(impl, "make_shared", [](long n) {
+        bench_clock::time_point t0 = bench_clock::now();
+        for(long i = 0; i < n; ++i) {
+            sp_int p = I::template make<int>(int(i));
+            do_not_optimize(p);
+        }
+        return bench_clock::now() - t0;
+    });
+
+    r.run(impl, "copy", [](long n) {
+        sp_int src = I::template make<int>(1);
+        bench_clock::time_point t0 = bench_clock::now();
+        for(long i = 0; i < n; ++i) {
+            sp_int p(src);
+            do_not_optimize(p);
+        }
+        return bench_clock::now() - t0;
+    });
+
+    r.run(impl, "move", [](long n) {
+        sp_int a = I::template make<int>(1);
+        sp_int b;
+        bench_clock::time_point t0 = bench_clock::now();
+        for(long i = 0; i < n; ++i) {
+            b = std::move(a);
+            a = std::move(b);
+            do_not_optimize(a);
+        }
+        return bench_clock::now() - t0;
+    });
+
+    r.run(impl, "destroy", [](long n) {
+        std::vector<sp_int> v;
+        v.reserve(n);
+        for(long i = 0; i < n; ++i)
+            v.push_back(I::template make<int>(int(i)));
+        bench_clock::time_point t0 = bench_clock::now();
+        v.clear();
+        return bench_clock::now() - t0;
+    });
+
+    r.run(impl, "weak_lock", [](long n) {
+        sp_int p = I::template make<int>(1);
+        wp_int w(p);
+        bench_clock::time_point t0 = bench_clock::now();
+        for(long i = 0; i < n; ++i) {
+            sp_int q = w.lock();
+            do_not_optimize(q);
+        }
+        return bench_clock::now() - t0;
+    });
+
+    r.run(impl, "weak_lock_expired", [](long n) {
+        wp_int w(I::template make<int>(1));
+        bench_clock::time_point t0 = bench_clock::now();
+        for(long i = 0; i < n; ++i) {
+            sp_int q = w.lock();
+            do_not_optimize(q);
+        }
+        return bench_clock::now() - t0;
+    });
+
+    r.run(impl, "expired", [](long n) {
+        sp_int p = I::template make<int>(1);
+        wp_int w(p);
+        long alive = 0;
+        bench_clock::time_point t0 = bench_clock::now();
+        for(long i = 0; i < n; ++i) {
+            do_not_optimize(w);
+            alive += !w.expired();
+        }
+        do_not_optimize(alive);
+        return bench_clock::now() - t0;
+    });
+
+    r.run(impl, "static_pointer_cast", [](long n) {
+        sp_derived d = I::template make<Derived>();
+        sp_base b = d;
+        bench_clock::time_point t0 = bench_clock::now();
+        for(long i = 0; i < n; ++i) {
+            sp_derived q = I::template static_cast_to<Derived>(b);
+            do_not_optimize(q);
+        }
+        return bench_clock::now() - t0;
+    });
+
+    r.run(impl, "dynamic_pointer_cast", [](long n) {
+        sp_derived d = I::template make<Derived>();
+        sp_base b = d;
+        bench_clock::time_point t0 = bench_clock::now();
+        for(long i = 0; i < n; ++i) {
+            sp_derived q = I::template dynamic_cast_to<Derived>(b);
+            do_not_optimize(q);
+        }
+        return bench_clock::now() - t0;
+    });
+
+    // push_back without reserve: the reallocations move the elements.
+    r.run(impl, "vector_growth", [](long n) {
+        sp_int src = I::template make<int>(1);
+        bench_clock::time_point t0 = bench_clock::now();
+        {
+            std::vector<sp_int> v;
+            for(long i = 0; i < n; ++i)
+                v.push_back(src);
+            do_not_optimize(v);
+        }
+        return bench_clock::now() - t0;
+    });
+}
+
+
+
+// sp_batch.h against the element by element loops, on a vector whose
+// control blocks are scattered over the heap as in a long running
+// program: made in order, then shuffled with a fixed seed.
+std::vector<jfpu::shared_ptr<int> > scattered(long n) {
+    std::vector<jfpu::shared_ptr<int> > v;
+    v.reserve(n);
+    for(long i = 0; i < n; ++i)
+        v.push_back(jfpu::make_shared<int>(int(i)));
+    std::shuffle(v.begin(), v.end(), std::mt19937(42));
+    return v;
+}
+
+void run_batch_suite(runner& r) {
+    typedef jfpu::shared_ptr<int> sp_int;
+
+    r.run("jfpu", "destroy_scattered", [](long n) {
+        std::vector<sp_int> v = scattered(n);
+        bench_clock::time_point t0 = bench_clock::now();
+        v.clear();
+        return bench_clock::now() - t0;
+    });
+
+    r.run("jfpu", "destroy_scattered_release_range", [](long n) {
+        std::vector<sp_int> v = scattered(n);
+        bench_clock::time_point t0 = bench_clock::now();
+        jfpu::release_range(v.begin(), v.end());
+        v.clear();
+        return bench_clock::now() - t0;
+    });
+
+    r.run("jfpu", "copy_scattered", [](long n) {
+        std::vector<sp_int> src = scattered(n);
+        std::vector<sp_int> dst;
+        dst.reserve(n);
+        bench_clock::time_point t0 = bench_clock::now();
+        std::copy(src.begin(), src.end(), std::back_inserter(dst));
+        bench_clock::duration d = bench_clock::now() - t0;
+        do_not_optimize(dst);
+        return d;
+    });
+
+    r.run("jfpu", "copy_scattered_copy_range", [](long n) {
+        std::vector<sp_int> src = scattered(n);
+        std::vector<sp_int> dst;
+        dst.reserve(n);
+        bench_clock::time_point t0 = bench_clock::now();
+        jfpu::copy_range(src.begin(), src.end(), std::back_inserter(dst));
+        bench_clock::duration d = bench_clock::now() - t0;
+        do_not_optimize(dst);
+        return d;
+    });
+}
+
+// n shared_ptrs made and dropped together, as in one request.
+void run_arena_suite(runner& r) {
+    typedef jfpu::shared_ptr<int> sp_int;
+
+    r.run("jfpu", "request_make_shared", [](long n) {
+        std::vector<sp_int> v;
+        v.reserve(n);
+        bench_clock::time_point t0 = bench_clock::now();
+        for(long i = 0; i < n; ++i)
+            v.push_back(jfpu::make_shared<int>(int(i)));
+        v.clear();
+        return bench_clock::now() - t0;
+    });
+
+    r.run("jfpu", "request_arena_shared", [](long n) {
+        std::vector<sp_int> v;
+        v.reserve(n);
+        jfpu::sp_arena a;
+        bench_clock::time_point t0 = bench_clock::now();
+        for(long i = 0; i < n; ++i)
+            v.push_back(jfpu::allocate_arena_shared<int>(a, int(i)));
+        v.clear();
+        a.release();
+        return bench_clock::now() - t0;
+    });
+}
+
+
+
+void print_csv(const std::vector<result>& rs) {
+    std::printf("impl,benchmark,iterations,ns_per_op_min,ns_per_op_median\n");
+    for(std::size_t i = 0; i < rs.size(); ++i)
+        std::printf("%s,%s,%ld,%.3f,%.3f\n", rs[i].impl.c_str(), rs[i].bench.c_str(),
+                    rs[i].iters, rs[i].min_ns, rs[i].median_ns);
+}
+
+void print_json(const std::vector<result>& rs, const options& opt) {
+    std::printf("{\n  \"compiler\": \"%s\",\n  \"reps\": %d,\n  \"results\": [\n", __VERSION__, opt.reps);
+    for(std::size_t i = 0; i < rs.size(); ++i)
+        std::printf("    {\"impl\": \"%s\", \"benchmark\": \"%s\", \"iterations\": %ld, "
+                    "\"ns_per_op_min\": %.3f, \"ns_per_op_median\": %.3f}%s\n",
+                    rs[i].impl.c_str(), rs[i].bench.c_str(), rs[i].iters,
+                    rs[i].min_ns, rs[i].median_ns, i + 1 < rs.size() ? "," : "");
+    std::printf("  ]\n}\n");
+}
+
+void usage(const char* argv0) {
+    std::fprintf(stderr,
+                 "usage: %s [--iters N] [--reps N] [--format csv|json] [--filter NAME]\n"
+                 "          [--impl jfpu,std,boost] [--cpu N]\n", argv0);
+    std::exit(2);
+}
+
+bool impl_wanted(const options& opt, const char* name) {
+    return std::string::npos != ("," + opt.impls + ",").find(std::string(",") + name + ",");
+}
+
+}
+
+int main(int argc, char* argv[]) {
+    options opt;
+    for(int i = 1; i < argc; ++i) {
+        std::string a = argv[i];
+        if(i + 1 >= argc)
+            usage(argv[0]);
+        const char* v = argv[++i];
+        if("--iters" == a)
+            opt.iters = std::atol(v);
+        else if("--reps" == a)
+            opt.reps = std::atoi(v);
+        else if("--format" == a)
+            opt.format = v;
+        else if("--filter" == a)
+            opt.filter = v;
+        else if("--impl" == a)
+            opt.impls = v;
+        else if("--cpu" == a)
+            opt.cpu = std::atoi(v);
+        else
+            usage(argv[0]);
+    }
+    if(opt.iters <= 0 || opt.reps <= 0 || ("csv" != opt.format && "json" != opt.format))
+        usage(argv[0]);
+
+#ifdef __linux__
+    if(opt.cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(opt.cpu, &set);
+        if(0 != sched_setaffinity(0, sizeof(set), &set))
+            std::perror("sched_setaffinity");
+    }
+#endif
+
+    runner r(opt);
+    if(impl_wanted(opt, jfpu_impl::name())) {
+        run_suite<jfpu_impl>(r);
+        run_batch_suite(r);
+        run_arena_suite(r);
+    }
+    if(impl_wanted(opt, std_impl::name()))
+        run_suite<std_impl>(r);
+#if SP_BENCH_WITH_BOOST
+    if(impl_wanted(opt, boost_impl::name()))
+        run_suite<boost_impl>(r);
+#endif
+
+    if("json" == opt.format)
+        print_json(r.results(), opt);
+    else
+        print_csv(r.results());
+    return 0;
+}
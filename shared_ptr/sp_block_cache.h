@@ -0,0 +1,336 @@
+/*=============================================================================
+#     FileName: sp_block_cache.h
+#         Desc: per-thread magazine cache for control block memory
+#       Author: Jeffrey Pu
+#        Email: pujunying@gmail.com
+#     HomePage: https://github.com/jfpu
+#      Version: 0.0.1
+#   LastChange: 2026-10-17 17:20:06
+#      History:
+=============================================================================*/
+
+#ifndef _SP_BLOCK_CACHE_H_
+#define _SP_BLOCK_CACHE_H_
+
+#include <cstddef>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+// Magazine allocator for control blocks.
+//
+// Sizes up to SP_BLOCK_CACHE_MAX_SIZE are rounded up to a multiple of
+// 16 bytes; each such size class has, per thread, a loaded and a
+// previous magazine of up to SP_BLOCK_CACHE_MAGAZINE free blocks.
+// Allocation pops from the loaded one, freeing pushes onto it, and the
+// two are swapped when that avoids going further.  Only when both are
+// empty (allocating) or full (freeing) does the thread trade a whole
+// magazine with the size class's depot, under the depot's lock.
+//
+// A block freed on another thread than the one that allocated it goes
+// into the freeing thread's magazine and travels back through the depot
+// with a full magazine, so a producer/consumer pair exchanges blocks in
+// batches instead of one at a time.
+//
+// The depot keeps at most SP_BLOCK_CACHE_DEPOT magazines of each kind
+// per size class and gives anything beyond that back to operator
+// delete; a thread holds at most two magazines per size class and hands
+// them to the depot when it exits.  trim() empties the depots.
+
+#ifndef SP_BLOCK_CACHE_MAX_SIZE
+#define SP_BLOCK_CACHE_MAX_SIZE 128
+#endif
+
+#ifndef SP_BLOCK_CACHE_MAGAZINE
+#define SP_BLOCK_CACHE_MAGAZINE 32
+#endif
+
+#ifndef SP_BLOCK_CACHE_DEPOT
+#define SP_BLOCK_CACHE_DEPOT 64
+#endif
+
+namespace jfpu {
+
+class sp_block_cache {
+    static const std::size_t granule = 16;
+    static const int classes = (SP_BLOCK_CACHE_MAX_SIZE + granule - 1) / granule;
+
+    struct magazine {
+        magazine* next;
+        int n;
+        void* slots[SP_BLOCK_CACHE_MAGAZINE];
+    };
+
+    struct alignas(64) depot {
+        std::mutex mutex;
+        magazine* full;
+        std::size_t nfull;
+        magazine* empty;
+        std::size_t nempty;
+    };
+
+    struct thread_cache {
+        magazine* loaded[classes];
+        magazine* previous[classes];
+
+        thread_cache() {
+            for(int c = 0; c < classes; ++c) {
+                loaded[c] = NULL;
+                previous[c] = NULL;
+            }
+        }
+
+        ~thread_cache() {
+            dead() = true;
+            for(int c = 0; c < classes; ++c) {
+                instance().put(c, loaded[c]);
+                instance().put(c, previous[c]);
+            }
+        }
+    };
+
+    depot _depots[classes];
+
+    sp_block_cache(sp_block_cache const& );
+    sp_block_cache& operator=(sp_block_cache const& );
+
+    sp_block_cache() {
+        for(int c = 0; c < classes; ++c) {
+            _depots[c].full = NULL;
+            _depots[c].nfull = 0;
+            _depots[c].empty = NULL;
+            _depots[c].nempty = 0;
+        }
+    }
+
+    // Set once the calling thread's magazines are gone; blocks freed by
+    // destructors of later thread_local objects bypass the cache.
+    static bool& dead() {
+        static thread_local bool d = false;
+        return d;
+    }
+
+    static thread_cache* local() {
+        if(dead())
+            return NULL;
+        static thread_local thread_cache t;
+        return &t;
+    }
+
+    static void free_blocks(magazine* m) {
+        while(m->n > 0)
+            ::operator delete(m->slots[--m->n]);
+    }
+
+    // Hands a magazine to the depot: to the full list if it holds any
+    // blocks, to the empty list otherwise.  Past the bound the blocks
+    // and the magazine are freed.
+    void put(int c, magazine* m) {
+        if(NULL == m)
+            return;
+        depot& d = _depots[c];
+        {
+            std::lock_guard<std::mutex> lk(d.mutex);
+            if(m->n > 0 && d.nfull < SP_BLOCK_CACHE_DEPOT) {
+                m->next = d.full;
+                d.full = m;
+                ++d.nfull;
+                return;
+            }
+            if(0 == m->n && d.nempty < SP_BLOCK_CACHE_DEPOT) {
+                m->next = d.empty;
+                d.empty = m;
+                ++d.nempty;
+                return;
+            }
+        }
+        free_blocks(m);
+        delete m;
+    }
+
+    magazine* take_full(int c) {
+        depot& d = _depots[c];
+        std::lock_guard<std::mutex> lk(d.mutex);
+        magazine* m = d.full;
+        if(NULL != m) {
+            d.full = m->next;
+            --d.nfull;
+        }
+        return m;
+    }
+
+    // NULL if there is none and no memory for a new one.
+    magazine* take_empty(int c) {
+        depot& d = _depots[c];
+        {
+            std::lock_guard<std::mutex> lk(d.mutex);
+            magazine* m = d.empty;
+            if(NULL != m) {
+                d.empty = m->next;
+                --d.nempty;
+                return m;
+            }
+        }
+        magazine* m = new(std::nothrow) magazine;
+        if(NULL != m)
+            m->n = 0;
+        return m;
+    }
+
+    static int size_class(std::size_t n) {
+        return static_cast<int>((n + granule - 1) / granule) - 1;
+    }
+
+    void* allocate_slow(thread_cache* t, int c) {
+        magazine*& loaded = t->loaded[c];
+        magazine*& previous = t->previous[c];
+        if(NULL != previous && previous->n > 0) {
+            std::swap(loaded, previous);
+            return loaded->slots[--loaded->n];
+        }
+        magazine* m = take_full(c);
+        if(NULL == m)
+            return ::operator new((c + 1) * granule);
+        put(c, loaded);
+        loaded = m;
+        return loaded->slots[--loaded->n];
+    }
+
+    void deallocate_slow(thread_cache* t, int c, void* p) {
+        magazine*& loaded = t->loaded[c];
+        magazine*& previous = t->previous[c];
+        if(NULL != previous && previous->n < SP_BLOCK_CACHE_MAGAZINE) {
+            std::swap(loaded, previous);
+            loaded->slots[loaded->n++] = p;
+            return;
+        }
+        magazine* m = take_empty(c);
+        if(NULL == m) {
+            ::operator delete(p);
+            return;
+        }
+        put(c, previous);
+        previous = loaded;
+        loaded = m;
+        loaded->slots[loaded->n++] = p;
+    }
+
+public:
+    // Never destroyed, blocks may be freed during static destruction.
+    // Placed in static storage since plain new ignores the depot
+    // alignment before C++17.
+    static sp_block_cache& instance() {
+        static std::aligned_storage<sizeof(sp_block_cache),
+                                    alignof(sp_block_cache)>::type mem;
+        static sp_block_cache* r = ::new(static_cast<void*>(&mem)) sp_block_cache();
+        return *r;
+    }
+
+    // Memory for n bytes aligned to align.  The cache only holds memory
+    // from plain operator new, over-aligned requests go to the aligned
+    // operator new (C++17) or, before that, get what plain new gives.
+    static void* allocate(std::size_t n, std::size_t align = alignof(std::max_align_t)) {
+#ifdef __cpp_aligned_new
+        if(align > __STDCPP_DEFAULT_NEW_ALIGNMENT__)
+            return ::operator new(n, std::align_val_t(align));
+#else
+        (void)align;
+#endif
+        if(n > SP_BLOCK_CACHE_MAX_SIZE)
+            return ::operator new(n);
+        // Always the whole size class: deallocate() may cache the block
+        // on a thread whose magazines are still there.
+        int c = size_class(n);
+        thread_cache* t = local();
+        if(NULL == t)
+            return ::operator new((c + 1) * granule);
+        magazine* m = t->loaded[c];
+        if(NULL != m && m->n > 0)
+            return m->slots[--m->n];
+        return instance().allocate_slow(t, c);
+    }
+
+    // n and align must be the ones given to allocate().
+    static void deallocate(void* p, std::size_t n, std::size_t align = alignof(std::max_align_t)) {
+#ifdef __cpp_aligned_new
+        if(align > __STDCPP_DEFAULT_NEW_ALIGNMENT__) {
+            ::operator delete(p, std::align_val_t(align));
+            return;
+        }
+#else
+        (void)align;
+#endif
+        thread_cache* t;
+        if(n > SP_BLOCK_CACHE_MAX_SIZE || NULL == (t = local())) {
+            ::operator delete(p);
+            return;
+        }
+        int c = size_class(n);
+        magazine* m = t->loaded[c];
+        if(NULL != m && m->n < SP_BLOCK_CACHE_MAGAZINE) {
+            m->slots[m->n++] = p;
+            return;
+        }
+        instance().deallocate_slow(t, c, p);
+    }
+
+    // Gives the calling thread's magazines to the depots.
+    void trim_thread() {
+        thread_cache* t = local();
+        if(NULL == t)
+            return;
+        for(int c = 0; c < classes; ++c) {
+            put(c, t->loaded[c]);
+            put(c, t->previous[c]);
+            t->loaded[c] = NULL;
+            t->previous[c] = NULL;
+        }
+    }
+
+    // Frees everything held by the depots.  Magazines of other threads
+    // are left alone.
+    void trim() {
+        for(int c = 0; c < classes; ++c) {
+            depot& d = _depots[c];
+            magazine* full;
+            magazine* empty;
+            {
+                std::lock_guard<std::mutex> lk(d.mutex);
+                full = d.full;
+                empty = d.empty;
+                d.full = NULL;
+                d.empty = NULL;
+                d.nfull = 0;
+                d.nempty = 0;
+            }
+            while(NULL != full) {
+                magazine* next = full->next;
+                free_blocks(full);
+                delete full;
+                full = next;
+            }
+            while(NULL != empty) {
+                magazine* next = empty->next;
+                delete empty;
+                empty = next;
+            }
+        }
+    }
+
+    // Free blocks held by the depots.
+    std::size_t depot_blocks() {
+        std::size_t n = 0;
+        for(int c = 0; c < classes; ++c) {
+            depot& d = _depots[c];
+            std::lock_guard<std::mutex> lk(d.mutex);
+            for(magazine* m = d.full; NULL != m; m = m->next)
+                n += m->n;
+        }
+        return n;
+    }
+};
+
+}
+
+#endif
@@ -0,0 +1,1459 @@
+/*=============================================================================
+#     FileName: sp_check.cc
+#         Desc: behavior checks, built in every configuration by make check
+#       Author: Jeffrey Pu
+#        Email: pujunying@gmail.com
+#     HomePage: https://github.com/jfpu
+#      Version: 0.0.1
+#   LastChange: 2026-10-18 09:12:40
+#      History:
+=============================================================================*/
+
+// make check
+//
+// Every check_* function exercises one header.  A failed SP_CHECK
+// prints where it failed and the run goes on, failing the exit status.
+// Checks that depend on a configuration macro are compiled only in the
+// make check build that sets it.
+
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#if __cplusplus >= 201703L
+#include <memory_resource>
+#endif
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "shared_ptr.h"
+#include "atomic_shared_ptr.h"
+#include "intrusive_ptr.h"
+#include "owner_flat_map.h"
+#include "read_mostly_shared_ptr.h"
+#include "shared_handle.h"
+#include "shared_index_pool.h"
+#include "sp_arena.h"
+#include "sp_batch.h"
+#include "sp_block_cache.h"
+#include "sp_deferred.h"
+#include "weak_value_cache.h"
+#if SP_ENABLE_COUNT_HOOKS
+#include "sp_counted_biased.h"
+#include "sp_counted_sharded.h"
+#endif
+
+// Lets a check make the next allocation of its thread fail, see the
+// size the last one asked for and count the blocks still allocated.
+// Kept out of line, g++ otherwise sees malloc and free paired with new
+// and delete and warns.
+static thread_local int fail_new_countdown = 0;
+static thread_local std::size_t last_new_size = 0;
+static std::atomic<long> heap_blocks(0);
+
+__attribute__((noinline)) void* operator new(std::size_t n) {
+    if(fail_new_countdown > 0 && 0 == --fail_new_countdown)
+        throw std::bad_alloc();
+    void* p = std::malloc(0 == n ? 1 : n);
+    if(NULL == p)
+        throw std::bad_alloc();
+    last_new_size = n;
+    heap_blocks.fetch_add(1, std::memory_order_relaxed);
+    return p;
+}
+
+__attribute__((noinline)) void* operator new(std::size_t n, const std::nothrow_t& ) noexcept {
+    try {
+        return ::operator new(n);
+    } catch(const std::bad_alloc& ) {
+        return NULL;
+    }
+}
+
+__attribute__((noinline)) void operator delete(void* p) noexcept {
+    if(NULL != p)
+        heap_blocks.fetch_sub(1, std::memory_order_relaxed);
+    std::free(p);
+}
+
+__attribute__((noinline)) void operator delete(void* p, std::size_t ) noexcept {
+    if(NULL != p)
+        heap_blocks.fetch_sub(1, std::memory_order_relaxed);
+    std::free(p);
+}
+
+namespace {
+
+int failures = 0;
+
+#define SP_CHECK(e)                                                           \
+    do {                                                                      \
+        if(!(e)) {                                                            \
+            std::fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #e); \
+            ++failures;                                                       \
+        }                                                                     \
+    } while(0)
+
+const int thread_count = 4;
+
+// Counts live instances; magic is cleared by the destructor so a use
+// after destruction shows up as a wrong value.
+struct counted {
+    static std::atomic<int> live;
+    int magic;
+
+    counted() : magic(0x5eed) {
+        ++live;
+    }
+
+    ~counted() {
+        magic = 0;
+        --live;
+    }
+};
+
+std::atomic<int> counted::live(0);
+
+struct counting_deleter {
+    int* calls;
+
+    explicit counting_deleter(int* c) : calls(c) {}
+
+    void operator()(counted* p) const {
+        ++*calls;
+        delete p;
+    }
+};
+
+// The next operator new of this thread throws.  Empties the block cache
+// first so the next control block does come from operator new.
+void fail_next_new() {
+#if SP_USE_BLOCK_CACHE
+    jfpu::sp_block_cache::instance().trim_thread();
+    jfpu::sp_block_cache::instance().trim();
+#endif
+    fail_new_countdown = 1;
+}
+
+struct throwing_ctor {
+    explicit throwing_ctor(bool t) {
+        if(t)
+            throw std::runtime_error("ctor");
+    }
+};
+
+
+
+template<jfpu::_Lock_policy _Lp>
+void check_concurrent_copy() {
+    {
+        jfpu::__shared_ptr<counted, _Lp> p(new counted);
+        std::vector<std::thread> threads;
+        for(int t = 0; t < thread_count; ++t) {
+            threads.push_back(std::thread([&p]() {
+                for(int i = 0; i < 100000; ++i) {
+                    jfpu::__shared_ptr<counted, _Lp> q(p);
+                    jfpu::__weak_ptr<counted, _Lp> w(q);
+                    jfpu::__shared_ptr<counted, _Lp> r(std::move(q));
+                    if(0x5eed != r->magic)
+                        std::abort();
+                }
+            }));
+        }
+        for(std::size_t t = 0; t < threads.size(); ++t)
+            threads[t].join();
+        SP_CHECK(1 == p.use_count());
+        SP_CHECK(1 == counted::live);
+    }
+    SP_CHECK(0 == counted::live);
+}
+
+// lock() racing with the release of the last owner: a lock either
+// fails or returns a live object, and the object is destroyed once.
+void check_weak_lock_race() {
+    for(int round = 0; round < 2000; ++round) {
+        jfpu::shared_ptr<counted> p = jfpu::make_shared<counted>();
+        jfpu::weak_ptr<counted> w(p);
+        std::atomic<bool> go(false);
+        std::atomic<int> bad(0);
+        std::vector<std::thread> threads;
+        for(int t = 0; t < thread_count; ++t) {
+            threads.push_back(std::thread([&]() {
+                while(!go.load(std::memory_order_acquire))
+                    ;
+                for(int i = 0; i < 64; ++i) {
+                    jfpu::shared_ptr<counted> q = w.lock();
+                    if(q.get() != NULL && 0x5eed != q->magic)
+                        ++bad;
+                }
+            }));
+        }
+        go.store(true, std::memory_order_release);
+        p.reset();
+        for(std::size_t t = 0; t < threads.size(); ++t)
+            threads[t].join();
+        SP_CHECK(0 == bad);
+        SP_CHECK(w.expired());
+        SP_CHECK(NULL == w.lock().get());
+        SP_CHECK(0 == counted::live);
+    }
+}
+
+void check_exception_paths() {
+    int calls = 0;
+
+    // The block for shared_ptr(p, d) cannot be made: d(p) runs once.
+    {
+        counted* raw = new counted;
+        fail_next_new();
+        try {
+            jfpu::shared_ptr<counted> p(raw, counting_deleter(&calls));
+            SP_CHECK(false);
+        } catch(const std::bad_alloc& ) {
+        }
+    }
+    SP_CHECK(1 == calls);
+    SP_CHECK(0 == counted::live);
+
+    // The block for shared_ptr(unique_ptr&&) or shared_ptr(auto_ptr&)
+    // cannot be made: the source still owns its pointer.
+    calls = 0;
+    {
+        std::unique_ptr<counted, counting_deleter> u(new counted, counting_deleter(&calls));
+        fail_next_new();
+        try {
+            jfpu::shared_ptr<counted> p(std::move(u));
+            SP_CHECK(false);
+        } catch(const std::bad_alloc& ) {
+        }
+        SP_CHECK(NULL != u.get());
+        SP_CHECK(0 == calls);
+        SP_CHECK(1 == counted::live);
+
+        std::auto_ptr<counted> a(new counted);
+        fail_next_new();
+        try {
+            jfpu::shared_ptr<counted> p(a);
+            SP_CHECK(false);
+        } catch(const std::bad_alloc& ) {
+        }
+        SP_CHECK(NULL != a.get());
+        SP_CHECK(2 == counted::live);
+    }
+    SP_CHECK(1 == calls);
+    SP_CHECK(0 == counted::live);
+
+    {
+        std::unique_ptr<counted> u(new counted);
+        jfpu::shared_ptr<counted> p(std::move(u));
+        SP_CHECK(NULL == u.get());
+        SP_CHECK(1 == p.use_count());
+        std::unique_ptr<counted> e;
+        jfpu::shared_ptr<counted> q(std::move(e));
+        SP_CHECK(0 == q.use_count());
+        std::unique_ptr<int[]> a(new int[4]());
+        jfpu::shared_ptr<int[]> s(std::move(a));
+        SP_CHECK(0 == s[3]);
+    }
+    SP_CHECK(0 == counted::live);
+
+    try {
+        jfpu::shared_ptr<throwing_ctor> p = jfpu::make_shared<throwing_ctor>(true);
+        SP_CHECK(false);
+    } catch(const std::runtime_error& ) {
+    }
+
+    // Sizes that overflow are refused before anything is allocated.
+    try {
+        jfpu::shared_ptr<int[]> p = jfpu::make_shared<int[]>(std::size_t(-1) / 2);
+        SP_CHECK(false);
+    } catch(const std::bad_array_new_length& ) {
+    }
+
+    try {
+        jfpu::shared_ptr<counted> p;
+        jfpu::weak_ptr<counted> w(p);
+        jfpu::shared_ptr<counted> q(w);
+        SP_CHECK(false);
+    } catch(const jfpu::bad_weak_ptr& ) {
+    }
+}
+
+struct node : jfpu::intrusive_ref_counter<node> {
+    counted c;
+};
+
+struct self : jfpu::enable_shared_from_this<self> {
+    counted c;
+};
+
+struct local_self : jfpu::__enable_shared_from_this<local_self, jfpu::_S_single> {
+    counted c;
+};
+
+void check_intrusive_ptr() {
+    {
+        jfpu::intrusive_ptr<node> p = jfpu::make_intrusive<node>();
+        std::vector<std::thread> threads;
+        for(int t = 0; t < thread_count; ++t) {
+            threads.push_back(std::thread([&p]() {
+                for(int i = 0; i < 100000; ++i) {
+                    jfpu::intrusive_ptr<node> q(p);
+                    jfpu::intrusive_ptr<node> r(std::move(q));
+                    if(0x5eed != r->c.magic)
+                        std::abort();
+                }
+            }));
+        }
+        for(std::size_t t = 0; t < threads.size(); ++t)
+            threads[t].join();
+        SP_CHECK(1 == p->use_count());
+
+        // A raw pointer can be taken up again.
+        jfpu::intrusive_ptr<node> q(p.get());
+        SP_CHECK(2 == p->use_count());
+        node* raw = q.detach();
+        SP_CHECK(2 == p->use_count());
+        jfpu::intrusive_ptr<node> r(raw, false);
+        SP_CHECK(2 == p->use_count());
+    }
+    SP_CHECK(0 == counted::live);
+}
+
+void check_enable_shared_from_this() {
+    {
+        jfpu::shared_ptr<self> p = jfpu::make_shared<self>();
+        jfpu::shared_ptr<self> q = p->shared_from_this();
+        SP_CHECK(2 == p.use_count());
+        SP_CHECK(!p.owner_before(q) && !q.owner_before(p));
+
+        std::unique_ptr<self> u(new self);
+        jfpu::shared_ptr<self> r(std::move(u));
+        SP_CHECK(2 == r->shared_from_this().use_count());
+
+        // Every owning constructor of the local policy as well.
+        jfpu::local_shared_ptr<local_self> l = jfpu::make_local_shared<local_self>();
+        SP_CHECK(!l->weak_from_this().expired());
+        SP_CHECK(2 == l->shared_from_this().use_count());
+        jfpu::local_shared_ptr<local_self> m(new local_self);
+        SP_CHECK(2 == m->shared_from_this().use_count());
+    }
+    SP_CHECK(0 == counted::live);
+
+    // Not owned by any shared_ptr.
+    self s;
+    try {
+        s.shared_from_this();
+        SP_CHECK(false);
+    } catch(const jfpu::bad_weak_ptr& ) {
+    }
+    SP_CHECK(s.weak_from_this().expired());
+}
+
+// Readers load while writers store, exchange and compare-exchange; each
+// value is stored by exactly one writer and destroyed exactly once.
+void check_atomic_shared_ptr() {
+    {
+        jfpu::atomic_shared_ptr<counted> slot(jfpu::make_shared<counted>());
+        jfpu::atomic_weak_ptr<counted> weak_slot;
+        std::atomic<bool> done(false);
+        std::atomic<int> bad(0);
+        std::vector<std::thread> threads;
+        for(int t = 0; t < thread_count; ++t) {
+            threads.push_back(std::thread([&]() {
+                while(!done.load(std::memory_order_relaxed)) {
+                    jfpu::shared_ptr<counted> p = slot.load();
+                    if(NULL == p.get() || 0x5eed != p->magic)
+                        ++bad;
+                    jfpu::shared_ptr<counted> q = weak_slot.load().lock();
+                    if(NULL != q.get() && 0x5eed != q->magic)
+                        ++bad;
+                }
+            }));
+        }
+        for(int t = 0; t < 2; ++t) {
+            threads.push_back(std::thread([&, t]() {
+                for(int i = 0; i < 20000; ++i) {
+                    jfpu::shared_ptr<counted> p = jfpu::make_shared<counted>();
+                    if(0 == i % 3) {
+                        slot.store(p);
+                    } else if(1 == i % 3) {
+                        if(NULL == slot.exchange(p).get())
+                            ++bad;
+                    } else {
+                        jfpu::shared_ptr<counted> expected = slot.load();
+                        jfpu::shared_ptr<counted> desired = p;
+                        while(!slot.compare_exchange_weak(expected, desired))
+                            ;
+                    }
+                    if(0 == t)
+                        weak_slot.store(jfpu::weak_ptr<counted>(p));
+                }
+            }));
+        }
+        for(std::size_t t = thread_count; t < threads.size(); ++t)
+            threads[t].join();
+        done.store(true);
+        for(int t = 0; t < thread_count; ++t)
+            threads[t].join();
+        SP_CHECK(0 == bad);
+        SP_CHECK(1 == counted::live);
+        // The slot and the copy loaded to look at it.
+        SP_CHECK(2 == slot.load().use_count());
+
+        // A failed compare-exchange hands back the current value.
+        jfpu::shared_ptr<counted> other = jfpu::make_shared<counted>();
+        jfpu::shared_ptr<counted> expected = other;
+        SP_CHECK(!slot.compare_exchange_strong(expected, other));
+        SP_CHECK(expected.get() == slot.load().get());
+        SP_CHECK(slot.compare_exchange_strong(expected, jfpu::shared_ptr<counted>()));
+        SP_CHECK(NULL == slot.load().get());
+    }
+    SP_CHECK(0 == counted::live);
+}
+
+// Threads that read once and then wait: their copies keep an old value
+// alive after store(), but not after the slot is destroyed.
+void check_read_mostly_shared_ptr() {
+    std::mutex m;
+    std::condition_variable cv;
+    int readers = 0;
+    bool finish = false;
+    std::atomic<int> bad(0);
+    std::vector<std::thread> threads;
+    {
+        jfpu::read_mostly_shared_ptr<counted> slot(jfpu::make_shared<counted>());
+        for(int t = 0; t < thread_count; ++t) {
+            threads.push_back(std::thread([&]() {
+                if(0x5eed != slot->magic)
+                    ++bad;
+                std::unique_lock<std::mutex> lk(m);
+                ++readers;
+                cv.notify_all();
+                cv.wait(lk, [&]() { return finish; });
+            }));
+        }
+        {
+            std::unique_lock<std::mutex> lk(m);
+            cv.wait(lk, [&]() { return thread_count == readers; });
+        }
+        SP_CHECK(0 == bad);
+        slot.store(jfpu::make_shared<counted>());
+        SP_CHECK(2 == counted::live);
+        SP_CHECK(0x5eed == slot->magic);
+        slot.release_local();
+        SP_CHECK(2 == counted::live);
+    }
+    SP_CHECK(0 == counted::live);
+
+    // The next slot reuses the id; nothing stale shows through.
+    jfpu::read_mostly_shared_ptr<counted> next;
+    SP_CHECK(NULL == next.local().get());
+    {
+        std::lock_guard<std::mutex> lk(m);
+        finish = true;
+        cv.notify_all();
+    }
+    for(std::size_t t = 0; t < threads.size(); ++t)
+        threads[t].join();
+}
+
+// Threads asking for the same key share one build; a value is rebuilt
+// only after it expired, and a failed build is left to a waiter.
+void check_weak_value_cache() {
+    jfpu::weak_value_cache<int, counted> cache(4);
+    std::atomic<int> builds(0);
+    auto build = [&builds]() {
+        ++builds;
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        return jfpu::make_shared<counted>();
+    };
+    {
+        jfpu::shared_ptr<counted> got[thread_count];
+        std::vector<std::thread> threads;
+        for(int t = 0; t < thread_count; ++t) {
+            threads.push_back(std::thread([&, t]() {
+                got[t] = cache.get_or_build(7, build);
+            }));
+        }
+        for(std::size_t t = 0; t < threads.size(); ++t)
+            threads[t].join();
+        SP_CHECK(1 == builds);
+        for(int t = 0; t < thread_count; ++t)
+            SP_CHECK(got[t] == got[0] && NULL != got[t].get());
+        SP_CHECK(got[0] == cache.find(7));
+        SP_CHECK(1 == counted::live);
+    }
+    // The cache holds no reference of its own.
+    SP_CHECK(0 == counted::live);
+    SP_CHECK(NULL == cache.find(7).get());
+    SP_CHECK(1 == cache.size());
+    jfpu::shared_ptr<counted> p = cache.get_or_build(7, build);
+    SP_CHECK(2 == builds);
+
+    // An empty result is returned but not cached.
+    SP_CHECK(NULL == cache.get_or_build(8, []() { return jfpu::shared_ptr<counted>(); }).get());
+    SP_CHECK(1 == cache.size());
+
+    // The first builder throws while a second thread waits for it.
+    std::atomic<bool> waiting(false);
+    std::atomic<bool> threw(false);
+    std::atomic<bool> rebuilt(false);
+    std::thread first([&]() {
+        try {
+            cache.get_or_build(9, [&]() -> jfpu::shared_ptr<counted> {
+                while(!waiting)
+                    std::this_thread::yield();
+                std::this_thread::sleep_for(std::chrono::milliseconds(5));
+                throw std::runtime_error("build");
+            });
+        } catch(const std::runtime_error& ) {
+            threw = true;
+        }
+    });
+    std::thread second([&]() {
+        // Key 9 is in the cache once the first build has started.
+        while(cache.size() < 2)
+            std::this_thread::yield();
+        waiting = true;
+        jfpu::shared_ptr<counted> q = cache.get_or_build(9, build);
+        rebuilt = NULL != q.get() && q == cache.find(9);
+    });
+    first.join();
+    second.join();
+    SP_CHECK(threw);
+    SP_CHECK(rebuilt);
+    SP_CHECK(3 == builds);
+
+    p.reset();
+    SP_CHECK(2 == cache.sweep());
+    SP_CHECK(0 == cache.size());
+    SP_CHECK(0 == counted::live);
+}
+
+// Handles share the make_shared block's counts with shared_ptrs, and
+// anything but a make_shared block is refused.
+void check_shared_handle() {
+    static_assert(sizeof(jfpu::shared_handle<counted>) == sizeof(void*),
+                  "a handle is one pointer");
+    {
+        jfpu::shared_handle<counted> h = jfpu::make_shared_handle<counted>();
+        SP_CHECK(1 == h.use_count());
+        jfpu::shared_ptr<counted> p = h;
+        SP_CHECK(2 == h.use_count());
+        SP_CHECK(p.get() == h.get());
+        jfpu::shared_handle<counted> g(std::move(p));
+        SP_CHECK(NULL == p.get());
+        SP_CHECK(2 == h.use_count());
+        SP_CHECK(g == h);
+        jfpu::weak_ptr<counted> w(std::move(g).release_shared());
+        SP_CHECK(!g);
+        SP_CHECK(1 == h.use_count());
+
+        std::vector<std::thread> threads;
+        for(int t = 0; t < thread_count; ++t) {
+            threads.push_back(std::thread([&h, &w]() {
+                for(int i = 0; i < 20000; ++i) {
+                    jfpu::shared_handle<counted> c(h);
+                    jfpu::shared_ptr<counted> q = w.lock();
+                    jfpu::shared_handle<counted> d(std::move(q));
+                    if(0x5eed != c->magic || c != d)
+                        std::abort();
+                }
+            }));
+        }
+        for(std::size_t t = 0; t < threads.size(); ++t)
+            threads[t].join();
+        SP_CHECK(h.unique());
+        h.reset();
+        SP_CHECK(w.expired());
+        SP_CHECK(0 == counted::live);
+    }
+
+    // Aliases and other blocks throw and keep their reference.
+    jfpu::shared_ptr<counted> p = jfpu::make_shared<counted>();
+    jfpu::shared_ptr<int> alias(p, &p->magic);
+    bool threw = false;
+    try {
+        jfpu::shared_handle<int> h(std::move(alias));
+    } catch(const std::invalid_argument& ) {
+        threw = true;
+    }
+    SP_CHECK(threw);
+    SP_CHECK(NULL != alias.get());
+    SP_CHECK(2 == p.use_count());
+#ifdef __GXX_RTTI
+    jfpu::shared_ptr<counted> q(new counted);
+    threw = false;
+    try {
+        jfpu::shared_handle<counted> h(q);
+    } catch(const std::invalid_argument& ) {
+        threw = true;
+    }
+    SP_CHECK(threw);
+    SP_CHECK(1 == q.use_count());
+#endif
+}
+
+// Output iterator that throws on the write or on the step after it
+// once left runs out.
+struct throwing_output {
+    typedef std::output_iterator_tag iterator_category;
+    typedef void value_type;
+    typedef void difference_type;
+    typedef void pointer;
+    typedef void reference;
+
+    std::vector<jfpu::shared_ptr<counted> >* v;
+    int* left;
+    bool on_step;
+
+    throwing_output& operator*() {
+        return *this;
+    }
+
+    throwing_output& operator=(const jfpu::shared_ptr<counted>& p) {
+        jfpu::shared_ptr<counted> c(p);
+        return *this = std::move(c);
+    }
+
+    throwing_output& operator=(jfpu::shared_ptr<counted>&& p) {
+        if(!on_step && 0 == (*left)--)
+            throw std::runtime_error("write");
+        v->push_back(std::move(p));
+        return *this;
+    }
+
+    throwing_output& operator++() {
+        if(on_step && 0 == (*left)--)
+            throw std::runtime_error("step");
+        return *this;
+    }
+};
+
+// Records the count of another object when it runs.
+struct observing_deleter {
+    const jfpu::shared_ptr<counted>* other;
+    long* seen;
+
+    void operator()(counted* p) const {
+        *seen = other->use_count();
+        delete p;
+    }
+};
+
+// Ranges mix runs of one block, blocks that come back later in the
+// range, aliases and empty elements.
+void check_batch() {
+    const int n = 100;
+    std::vector<jfpu::shared_ptr<counted> > objs;
+    for(int i = 0; i < n; ++i)
+        objs.push_back(jfpu::make_shared<counted>());
+    std::vector<jfpu::shared_ptr<counted> > src;
+    std::uint32_t r = 54321;
+    for(int i = 0; i < 1000; ++i) {
+        r = r * 1664525u + 1013904223u;
+        int k = static_cast<int>((r >> 8) % n);
+        int len = static_cast<int>((r >> 20) % 4);
+        for(int j = 0; j < len; ++j)
+            src.push_back(objs[k]);
+        if(0 == (r & 0x30))
+            src.push_back(jfpu::shared_ptr<counted>());
+        if(0 == (r & 0xc0))
+            src.push_back(jfpu::shared_ptr<counted>(objs[k], objs[(k + 1) % n].get()));
+    }
+    std::vector<long> counts;
+    for(int i = 0; i < n; ++i)
+        counts.push_back(objs[i].use_count());
+
+    {
+        std::vector<jfpu::shared_ptr<counted> > out;
+        jfpu::copy_range(src.begin(), src.end(), std::back_inserter(out));
+        bool same = out.size() == src.size();
+        for(std::size_t i = 0; same && i < src.size(); ++i)
+            same = out[i].get() == src[i].get() && !out[i].owner_before(src[i]) && !src[i].owner_before(out[i]);
+        SP_CHECK(same);
+        jfpu::release_range(out.begin(), out.end());
+        bool empty = true;
+        for(std::size_t i = 0; i < out.size(); ++i)
+            empty = empty && !out[i];
+        SP_CHECK(empty);
+        bool back = true;
+        for(int i = 0; i < n; ++i)
+            back = back && counts[i] == objs[i].use_count();
+        SP_CHECK(back);
+    }
+
+    // Every write or step may throw: what reached the output is owned
+    // there, everything else is given back.
+    for(int on_step = 0; on_step < 2; ++on_step) {
+        bool ok = true;
+        for(int k = 0; k < 300; ++k) {
+            std::vector<jfpu::shared_ptr<counted> > out;
+            int left = k;
+            throwing_output o = { &out, &left, 0 != on_step };
+            bool threw = false;
+            try {
+                jfpu::copy_range(src.begin(), src.end(), o);
+            } catch(const std::runtime_error& ) {
+                threw = true;
+            }
+            ok = ok && threw && out.size() == static_cast<std::size_t>(on_step ? k + 1 : k);
+            for(std::size_t i = 0; ok && i < out.size(); ++i)
+                ok = out[i].get() == src[i].get();
+            out.clear();
+            for(int i = 0; ok && i < n; ++i)
+                ok = counts[i] == objs[i].use_count();
+        }
+        SP_CHECK(ok);
+    }
+
+    // Dropping the last references in the range: blocks die in runs,
+    // in blocks that come back after others and past SP_BATCH_DEFERRED
+    // of them in one call.
+    std::vector<jfpu::weak_ptr<counted> > ws;
+    for(int i = 0; i < n; ++i)
+        ws.push_back(objs[i]);
+    jfpu::shared_ptr<counted> keep = objs[0];
+    for(int i = 1; i < n; i += 2)
+        objs[i].reset();
+    src.insert(src.begin(), objs.begin(), objs.end());
+    objs.clear();
+    jfpu::release_range(src.begin(), src.end());
+    bool gone = !ws[0].expired();
+    for(int i = 1; i < n; ++i)
+        gone = gone && ws[i].expired();
+    SP_CHECK(gone);
+    SP_CHECK(1 == counted::live);
+    SP_CHECK(1 == keep.use_count());
+    keep.reset();
+
+    // The deleters of a batch run after its decrements.
+    long seen = 0;
+    observing_deleter d = { &keep, &seen };
+    keep.reset(new counted);
+    std::vector<jfpu::shared_ptr<counted> > v;
+    v.push_back(jfpu::shared_ptr<counted>(new counted, d));
+    v.push_back(keep);
+    v.push_back(keep);
+    v.push_back(v[0]);
+    v.push_back(jfpu::shared_ptr<counted>());
+    v.push_back(keep);
+    jfpu::release_range(v.begin(), v.end());
+    SP_CHECK(1 == seen);
+    SP_CHECK(1 == counted::live);
+    keep.reset();
+    SP_CHECK(0 == counted::live);
+}
+
+// Allocates from the block cache in a thread_local destructor that runs
+// after the thread's magazines are gone.
+struct late_allocator {
+    void** block;
+    std::size_t* asked;
+
+    late_allocator() : block(NULL), asked(NULL) {}
+
+    ~late_allocator() {
+        if(NULL == block)
+            return;
+        *block = jfpu::sp_block_cache::allocate(40);
+        *asked = last_new_size;
+    }
+};
+
+// Blocks freed on another thread, after the allocating thread exited,
+// and after its magazines were destroyed; trim() gives back the rest.
+void check_block_cache() {
+    typedef jfpu::sp_block_cache cache;
+    const int n = 1000;
+    std::vector<void*> blocks(n);
+    std::vector<jfpu::shared_ptr<counted> > ptrs(n);
+    int deletes = 0;
+    // Registers the block type with the profiler before counting.
+    ptrs[0] = jfpu::shared_ptr<counted>(new counted, counting_deleter(&deletes));
+    ptrs[0].reset();
+    deletes = 0;
+    cache::instance().trim_thread();
+    cache::instance().trim();
+    const long before = heap_blocks.load();
+
+    std::thread([&blocks]() {
+        for(int i = 0; i < n; ++i) {
+            blocks[i] = cache::allocate(32);
+            std::memset(blocks[i], i & 0xff, 32);
+        }
+    }).join();
+    bool intact = true;
+    for(int i = 0; i < n; ++i) {
+        const unsigned char* b = static_cast<const unsigned char*>(blocks[i]);
+        intact = intact && (i & 0xff) == b[0] && (i & 0xff) == b[31];
+        cache::deallocate(blocks[i], 32);
+    }
+    SP_CHECK(intact);
+    // The blocks come back from the cache, each one once.
+    std::set<void*> seen;
+    for(int i = 0; i < n; ++i) {
+        blocks[i] = cache::allocate(32);
+        std::memset(blocks[i], 0, 32);
+        seen.insert(blocks[i]);
+    }
+    SP_CHECK(n == static_cast<int>(seen.size()));
+    seen.clear();
+    for(int i = 0; i < n; ++i)
+        cache::deallocate(blocks[i], 32);
+
+    // Pointer and deleter blocks made on one thread, dropped on another.
+    std::thread([&ptrs, &deletes]() {
+        for(int i = 0; i < n; ++i)
+            ptrs[i] = jfpu::shared_ptr<counted>(new counted, counting_deleter(&deletes));
+    }).join();
+    std::thread([&ptrs]() {
+        for(int i = 0; i < n; ++i)
+            ptrs[i].reset();
+    }).join();
+    SP_CHECK(n == deletes);
+    SP_CHECK(0 == counted::live);
+
+    // A block allocated with the magazines gone still has its whole
+    // size class: it is cached and handed out again by this thread.
+    void* late = NULL;
+    std::size_t asked = 0;
+    std::thread([&late, &asked]() {
+        static thread_local late_allocator a;
+        a.block = &late;
+        a.asked = &asked;
+        cache::deallocate(cache::allocate(16), 16);
+    }).join();
+    SP_CHECK(NULL != late);
+    SP_CHECK(48 == asked);
+    cache::deallocate(late, 40);
+    void* again = cache::allocate(48);
+    std::memset(again, 0, 48);
+    cache::deallocate(again, 48);
+
+    cache::instance().trim_thread();
+    cache::instance().trim();
+    SP_CHECK(0 == cache::instance().depot_blocks());
+    SP_CHECK(before == heap_blocks.load());
+}
+
+struct index_check_tag {};
+
+typedef jfpu::shared_index_handle<counted, index_check_tag> index_handle;
+typedef jfpu::weak_index_handle<counted, index_check_tag> weak_index;
+typedef jfpu::shared_index_pool<counted, index_check_tag> index_pool;
+
+// Weak index handles racing with the last release, slot reuse under a
+// new generation, ranges, construction failures and compaction.
+void check_shared_index_pool() {
+    index_pool& pool = index_pool::instance();
+    {
+        index_handle h = jfpu::make_shared_index<counted, index_check_tag>();
+        index_handle c(h);
+        weak_index w(h);
+        SP_CHECK(2 == w.use_count());
+        SP_CHECK(w.lock() == h);
+        std::uint32_t slot = h.index();
+        c.reset();
+        h.reset();
+        SP_CHECK(w.expired());
+        SP_CHECK(!w.lock());
+        // The slot comes back under another generation.
+        index_handle n = jfpu::make_shared_index<counted, index_check_tag>();
+        SP_CHECK(slot == n.index());
+        SP_CHECK(w.expired());
+        SP_CHECK(!w.lock());
+        SP_CHECK(1 == pool.size());
+    }
+    SP_CHECK(0 == pool.size());
+    SP_CHECK(0 == counted::live);
+
+    for(int round = 0; round < 200; ++round) {
+        index_handle h = jfpu::make_shared_index<counted, index_check_tag>();
+        weak_index w(h);
+        std::atomic<int> bad(0);
+        std::vector<std::thread> threads;
+        for(int t = 0; t < thread_count; ++t) {
+            threads.push_back(std::thread([&w, &bad]() {
+                for(int i = 0; i < 200; ++i) {
+                    index_handle l = w.lock();
+                    if(!!l && 0x5eed != l->magic)
+                        ++bad;
+                    // Others reuse the slot meanwhile.
+                    index_handle o = jfpu::make_shared_index<counted, index_check_tag>();
+                }
+            }));
+        }
+        h.reset();
+        for(std::size_t t = 0; t < threads.size(); ++t)
+            threads[t].join();
+        SP_CHECK(0 == bad);
+        SP_CHECK(w.expired());
+        SP_CHECK(0 == counted::live);
+    }
+    SP_CHECK(0 == pool.size());
+
+    std::vector<index_handle> hs;
+    for(int i = 0; i < 10000; ++i)
+        hs.push_back(jfpu::make_shared_index<counted, index_check_tag>());
+    hs.push_back(hs[0]);
+    pool.release_range(hs.begin(), hs.end());
+    for(std::size_t i = 0; i < hs.size(); ++i)
+        SP_CHECK(!hs[i]);
+    SP_CHECK(0 == pool.size());
+    SP_CHECK(0 == counted::live);
+
+    typedef jfpu::shared_index_pool<throwing_ctor, index_check_tag> throwing_pool;
+    bool threw = false;
+    try {
+        throwing_pool::instance().make(true);
+    } catch(const std::runtime_error& ) {
+        threw = true;
+    }
+    SP_CHECK(threw);
+    SP_CHECK(0 == throwing_pool::instance().size());
+    SP_CHECK(!!throwing_pool::instance().make(false));
+
+    SP_CHECK(0 < pool.compact());
+    SP_CHECK(0 == pool.capacity());
+}
+
+// Runs f in a child process and tells whether it died of SIGABRT, the
+// way a failed assert ends.
+template<typename F>
+bool aborts(F f) {
+    std::fflush(NULL);
+    pid_t pid = fork();
+    if(0 == pid) {
+        // The assert message is expected, keep it off the output.
+        int null = open("/dev/null", O_WRONLY);
+        if(0 <= null)
+            dup2(null, 2);
+        f();
+        _exit(0);
+    }
+    int status = 0;
+    if(pid < 0 || waitpid(pid, &status, 0) != pid)
+        return false;
+    return WIFSIGNALED(status) && SIGABRT == WTERMSIG(status);
+}
+
+// Blocks stay counted until their last weak_ptr goes, release() asserts
+// there are none left.  A throwing constructor leaves its memory in the
+// arena and no block behind.
+void check_arena() {
+    {
+        jfpu::sp_arena arena(256);
+        jfpu::shared_ptr<counted> p = jfpu::allocate_arena_shared<counted>(arena);
+        jfpu::weak_ptr<counted> w(p);
+        SP_CHECK(0x5eed == p->magic);
+        SP_CHECK(1 == counted::live);
+        SP_CHECK(256 == arena.reserved());
+        p.reset();
+        SP_CHECK(0 == counted::live);
+        SP_CHECK(w.expired());
+        SP_CHECK(256 == arena.reserved());
+#ifndef NDEBUG
+        SP_CHECK(aborts([&arena]() { arena.release(); }));
+#endif
+        w.reset();
+        arena.release();
+        SP_CHECK(0 == arena.reserved());
+    }
+
+    {
+        jfpu::sp_arena arena(256);
+        std::vector<jfpu::shared_ptr<counted> > ps;
+        for(int i = 0; i < 100; ++i)
+            ps.push_back(jfpu::allocate_arena_shared<counted>(arena));
+        SP_CHECK(256 < arena.reserved());
+        SP_CHECK(100 == counted::live);
+        ps.clear();
+        SP_CHECK(0 == counted::live);
+    }
+
+    {
+        jfpu::sp_arena arena(256);
+        bool threw = false;
+        try {
+            jfpu::allocate_arena_shared<throwing_ctor>(arena, true);
+        } catch(const std::runtime_error& ) {
+            threw = true;
+        }
+        SP_CHECK(threw);
+        SP_CHECK(256 == arena.reserved());
+        SP_CHECK(!!jfpu::allocate_arena_shared<throwing_ctor>(arena, false));
+        arena.release();
+    }
+
+#if __cplusplus >= 201703L
+    {
+        char buf[4096];
+        std::pmr::monotonic_buffer_resource r(buf, sizeof(buf));
+        jfpu::shared_ptr<counted> p = jfpu::allocate_arena_shared<counted>(r);
+        char* c = reinterpret_cast<char*>(p.get());
+        SP_CHECK(buf <= c && c < buf + sizeof(buf));
+        SP_CHECK(1 == counted::live);
+        std::vector<jfpu::shared_ptr<counted> > ps;
+        for(int i = 0; i < 200; ++i)
+            ps.push_back(jfpu::allocate_arena_shared<counted>(r));
+        SP_CHECK(201 == counted::live);
+        ps.clear();
+        p.reset();
+        SP_CHECK(0 == counted::live);
+    }
+#endif
+}
+
+struct throwing_value {
+    int v;
+
+    explicit throwing_value(int x) : v(x) {
+        if(x < 0)
+            throw std::runtime_error("value");
+    }
+};
+
+// Keys are owners: aliases are the same key and weak_ptr keys outlive
+// their object.  Random inserts and erases are compared with a plain
+// presence table, probing chains have to survive the back shifts.
+void check_owner_flat_map() {
+    {
+        jfpu::owner_flat_set<jfpu::shared_ptr<counted> > set;
+        jfpu::shared_ptr<counted> p = jfpu::make_shared<counted>();
+        jfpu::shared_ptr<counted> alias(p, p.get());
+        SP_CHECK(set.insert(p));
+        SP_CHECK(!set.insert(alias));
+        SP_CHECK(!set.insert(jfpu::shared_ptr<counted>()));
+        SP_CHECK(set.contains(jfpu::weak_ptr<counted>(p)));
+        SP_CHECK(3 == p.use_count());
+        SP_CHECK(1 == set.erase(alias));
+        SP_CHECK(set.empty());
+    }
+    SP_CHECK(0 == counted::live);
+
+    {
+        const int n = 1000;
+        std::vector<jfpu::shared_ptr<counted> > objs;
+        jfpu::owner_flat_map<jfpu::weak_ptr<counted>, int> map;
+        for(int i = 0; i < n; ++i) {
+            objs.push_back(jfpu::make_shared<counted>());
+            SP_CHECK(map.try_emplace(objs.back(), i).second);
+        }
+        for(int i = 0; i < n; i += 2)
+            objs[i].reset();
+        SP_CHECK(n == static_cast<int>(map.size()));
+        SP_CHECK(n / 2 == static_cast<int>(map.erase_expired()));
+        bool found = true;
+        for(int i = 1; i < n; i += 2) {
+            const int* v = map.find(objs[i]);
+            found = found && NULL != v && i == *v;
+        }
+        SP_CHECK(found);
+
+        jfpu::owner_flat_map<jfpu::weak_ptr<counted>, int> copy(map);
+        SP_CHECK(copy.size() == map.size());
+        SP_CHECK(NULL != copy.find(objs[1]) && 1 == *copy.find(objs[1]));
+    }
+    SP_CHECK(0 == counted::live);
+
+    {
+        const int n = 512;
+        std::vector<jfpu::shared_ptr<int> > keys;
+        for(int i = 0; i < n; ++i)
+            keys.push_back(jfpu::make_shared<int>(i));
+        jfpu::owner_flat_map<jfpu::shared_ptr<int>, throwing_value> map;
+        std::vector<bool> present(n, false);
+        std::uint32_t r = 12345;
+        bool same = true;
+        for(int step = 0; step < 50000; ++step) {
+            r = r * 1664525u + 1013904223u;
+            int k = static_cast<int>((r >> 8) % n);
+            if(0 != (r & 0x80)) {
+                std::pair<throwing_value*, bool> e = map.try_emplace(keys[k], k);
+                same = same && e.second != present[k] && k == e.first->v;
+                present[k] = true;
+            } else {
+                same = same && map.erase(keys[k]) == (present[k] ? 1u : 0u);
+                present[k] = false;
+            }
+            if(0 == step % 5000) {
+                std::size_t live = 0;
+                for(int i = 0; i < n; ++i) {
+                    const throwing_value* v = map.find(keys[i]);
+                    same = same && (NULL != v) == present[i] && (NULL == v || i == v->v);
+                    live += present[i] ? 1 : 0;
+                }
+                same = same && live == map.size();
+            }
+        }
+        SP_CHECK(same);
+
+        // A throwing value leaves nothing behind.
+        map.clear();
+        bool threw = false;
+        try {
+            map.try_emplace(keys[0], -1);
+        } catch(const std::runtime_error& ) {
+            threw = true;
+        }
+        SP_CHECK(threw);
+        SP_CHECK(map.empty());
+        SP_CHECK(!map.contains(keys[0]));
+        SP_CHECK(1 == keys[0].use_count());
+    }
+}
+
+#if SP_ENABLE_COUNT_HOOKS
+// The owner thread counts in _biased, the others in _shared, and
+// references cross over in both directions.
+void check_biased() {
+    {
+        jfpu::shared_ptr<counted> p = jfpu::make_biased_shared<counted>();
+        jfpu::weak_ptr<counted> w(p);
+        std::atomic<int> bad(0);
+        std::atomic<int> done(0);
+        std::vector<jfpu::shared_ptr<counted> > handed;
+        std::vector<std::thread> threads;
+        for(int t = 0; t < thread_count; ++t) {
+            jfpu::shared_ptr<counted> mine(p);
+            threads.push_back(std::thread([&, mine]() mutable {
+                for(int i = 0; i < 5000; ++i) {
+                    jfpu::shared_ptr<counted> q(mine);
+                    jfpu::shared_ptr<counted> l = w.lock();
+                    if(0x5eed != q->magic || NULL == l.get())
+                        ++bad;
+                }
+                // Dropping a reference the owner counted makes lock()
+                // fail on other threads until the owner merges.
+                ++done;
+                while(thread_count != done)
+                    std::this_thread::yield();
+                mine.reset();
+            }));
+        }
+        for(int i = 0; i < 5000; ++i)
+            handed.push_back(p);
+        for(std::size_t t = 0; t < threads.size(); ++t)
+            threads[t].join();
+        SP_CHECK(0 == bad);
+        jfpu::sp_biased_merge();
+        SP_CHECK(5001 == p.use_count());
+        handed.clear();
+        p.reset();
+        jfpu::sp_biased_merge();
+        SP_CHECK(w.expired());
+        SP_CHECK(0 == counted::live);
+    }
+
+    // The owner's last reference released on another thread: the block
+    // waits on the owner's queue until the owner merges it.
+    {
+        jfpu::shared_ptr<counted> p = jfpu::make_biased_shared<counted>();
+        jfpu::weak_ptr<counted> w(p);
+        std::thread([&p]() { p.reset(); }).join();
+        SP_CHECK(1 == counted::live);
+        // Dead already: neither another thread nor the owner may bring
+        // it back before the merge.
+        SP_CHECK(w.expired());
+        bool locked = true;
+        std::thread([&w, &locked]() { locked = NULL != w.lock().get(); }).join();
+        SP_CHECK(!locked);
+        SP_CHECK(NULL == w.lock().get());
+        jfpu::sp_biased_merge();
+        SP_CHECK(w.expired());
+        SP_CHECK(0 == counted::live);
+    }
+
+    // The owner thread exits first; whoever releases last merges.
+    {
+        jfpu::shared_ptr<counted> p;
+        std::thread([&p]() { p = jfpu::make_biased_shared<counted>(); }).join();
+        jfpu::shared_ptr<counted> q(p);
+        SP_CHECK(2 == p.use_count());
+        p.reset();
+        SP_CHECK(1 == counted::live);
+        q.reset();
+        SP_CHECK(0 == counted::live);
+    }
+}
+
+// Threads copy and drop while the owner kills the block under them: the
+// object lives until the last reference, wherever it was counted.
+void check_sharded() {
+    for(int round = 0; round < 50; ++round) {
+        jfpu::sharded_owner<counted> owner = jfpu::make_sharded_owner<counted>();
+        jfpu::shared_ptr<counted> keep = owner.share();
+        jfpu::weak_ptr<counted> w(keep);
+        std::atomic<bool> go(false);
+        std::atomic<int> bad(0);
+        std::vector<std::thread> threads;
+        for(int t = 0; t < thread_count; ++t) {
+            jfpu::shared_ptr<counted> mine = owner.share();
+            threads.push_back(std::thread([&, mine]() mutable {
+                while(!go.load(std::memory_order_acquire))
+                    ;
+                std::vector<jfpu::shared_ptr<counted> > held;
+                for(int i = 0; i < 2000; ++i) {
+                    jfpu::shared_ptr<counted> q(mine);
+                    if(0x5eed != q->magic)
+                        ++bad;
+                    // References that move between threads' shards.
+                    if(0 == i % 7)
+                        held.push_back(q);
+                    jfpu::shared_ptr<counted> l = w.lock();
+                    if(NULL == l.get())
+                        ++bad;
+                }
+                held.clear();
+                mine.reset();
+            }));
+        }
+        SP_CHECK(NULL != owner.get());
+        go.store(true, std::memory_order_release);
+        if(0 == round % 2)
+            owner.kill();
+        for(std::size_t t = 0; t < threads.size(); ++t)
+            threads[t].join();
+        SP_CHECK(0 == bad);
+        SP_CHECK(1 == counted::live);
+        owner.kill();
+        SP_CHECK(!owner);
+        SP_CHECK(1 == keep.use_count());
+        keep.reset();
+        SP_CHECK(w.expired());
+        SP_CHECK(0 == counted::live);
+    }
+
+    // Killed with references outstanding: they keep the object, and
+    // use_count() is exact from then on.
+    jfpu::shared_ptr<counted> p;
+    {
+        jfpu::sharded_owner<counted> owner = jfpu::make_sharded_owner<counted>();
+        p = owner.share();
+        jfpu::shared_ptr<counted> q(p);
+        SP_CHECK(3 == p.use_count());
+    }
+    SP_CHECK(1 == p.use_count());
+    SP_CHECK(1 == counted::live);
+    p.reset();
+    SP_CHECK(0 == counted::live);
+}
+#endif
+
+// A chain of deferred objects, each holding the next one.
+struct deferred_node {
+    counted c;
+    jfpu::shared_ptr<deferred_node> next;
+};
+
+jfpu::shared_ptr<deferred_node> deferred_chain(jfpu::sp_reclaimer& r, int n) {
+    jfpu::shared_ptr<deferred_node> head;
+    for(int i = 0; i < n; ++i) {
+        jfpu::shared_ptr<deferred_node> p = jfpu::make_deferred_shared<deferred_node>(r);
+        p->next = head;
+        head = p;
+    }
+    return head;
+}
+
+void check_deferred() {
+    {
+        jfpu::sp_reclaimer r;
+        jfpu::shared_ptr<counted> p = jfpu::defer_shared(new counted, r);
+        jfpu::weak_ptr<counted> w(p);
+        p.reset();
+        // Queued: expired, but not destroyed yet.
+        SP_CHECK(w.expired());
+        SP_CHECK(1 == counted::live);
+        SP_CHECK(1 == r.depth());
+        SP_CHECK(1 == r.drain());
+        SP_CHECK(0 == counted::live);
+        SP_CHECK(0 == r.depth());
+    }
+
+    // Deleters releasing more deferred objects, on a queue too short for
+    // all of them: the reclaimer thread must not wait for itself.
+    {
+        jfpu::sp_reclaimer r(2, jfpu::sp_reclaim_wait, 1, std::chrono::microseconds(100));
+        r.start();
+        for(int round = 0; round < 20; ++round) {
+            jfpu::shared_ptr<deferred_node> head = deferred_chain(r, 3 + round * 50);
+            head.reset();
+            for(int i = 0; i < 10000 && 0 != counted::live; ++i)
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+            SP_CHECK(0 == counted::live);
+        }
+        r.stop();
+    }
+
+    // Without a thread, drain() keeps going until nested releases are
+    // done; overflow runs deleters inline.
+    {
+        jfpu::sp_reclaimer r(4, jfpu::sp_reclaim_wait);
+        jfpu::shared_ptr<deferred_node> head = deferred_chain(r, 100);
+        head.reset();
+        while(0 != r.drain())
+            ;
+        SP_CHECK(0 == counted::live);
+        SP_CHECK(0 == r.depth());
+    }
+    {
+        jfpu::sp_reclaimer r(4);
+        jfpu::shared_ptr<deferred_node> head = deferred_chain(r, 100);
+        head.reset();
+    }
+    SP_CHECK(0 == counted::live);
+}
+
+#if SP_ENABLE_PROFILE
+struct profiled {};
+
+// Counts made on threads that have exited since are kept, and every
+// operation is counted exactly once.
+void check_profile() {
+    jfpu::sp_profile_reset();
+    const int copies = 5000;
+    {
+        jfpu::shared_ptr<profiled> p = jfpu::make_shared<profiled>();
+        std::vector<std::thread> threads;
+        for(int t = 0; t < thread_count; ++t) {
+            threads.push_back(std::thread([&p]() {
+                for(int i = 0; i < copies; ++i) {
+                    jfpu::shared_ptr<profiled> q(p);
+                    jfpu::weak_ptr<profiled> w(q);
+                }
+            }));
+        }
+        for(std::size_t t = 0; t < threads.size(); ++t)
+            threads[t].join();
+    }
+
+    jfpu::sp_profile_snapshot s = jfpu::sp_profile_take_snapshot();
+    const jfpu::sp_profile_type_stats* st = NULL;
+    for(std::size_t i = 0; i < s.types.size(); ++i) {
+        if(std::string::npos != s.types[i].name.find("profiled"))
+            st = &s.types[i];
+    }
+    SP_CHECK(NULL != st);
+    if(NULL != st) {
+        unsigned long long n = static_cast<unsigned long long>(thread_count) * copies;
+        SP_CHECK(1 == st->counts[jfpu::sp_prof_alloc]);
+        SP_CHECK(n == st->counts[jfpu::sp_prof_add_ref_copy]);
+        SP_CHECK(n + 1 == st->counts[jfpu::sp_prof_release]);
+        SP_CHECK(n == st->counts[jfpu::sp_prof_weak_add_ref]);
+        SP_CHECK(n == st->counts[jfpu::sp_prof_weak_release]);
+        SP_CHECK(1 == st->counts[jfpu::sp_prof_dispose]);
+    }
+    // Every thread went through the sampling period at least once.
+    SP_CHECK(!s.hot.empty());
+    SP_CHECK(s.hot.empty() || std::string::npos != s.hot[0].type.find("profiled"));
+
+    jfpu::sp_profile_reset();
+    SP_CHECK(jfpu::sp_profile_take_snapshot().types.empty());
+}
+#endif
+
+#if SP_ENABLE_REGISTRY
+struct registered {};
+
+// Blocks created on several threads and freed on another one are all
+// listed while alive, grouped under their site, and unlinked after.
+void check_registry() {
+    jfpu::sp_registry& reg = jfpu::sp_registry::instance();
+    const std::size_t before = reg.size();
+    const int per_thread = 1000;
+    std::vector<jfpu::shared_ptr<registered> > made[thread_count];
+    {
+        std::vector<std::thread> threads;
+        for(int t = 0; t < thread_count; ++t) {
+            std::vector<jfpu::shared_ptr<registered> >* out = &made[t];
+            threads.push_back(std::thread([out]() {
+                SP_REGISTRY_SITE();
+                for(int i = 0; i < per_thread; ++i)
+                    out->push_back(jfpu::make_shared<registered>());
+            }));
+        }
+        for(std::size_t t = 0; t < threads.size(); ++t)
+            threads[t].join();
+    }
+    const std::size_t n = static_cast<std::size_t>(thread_count) * per_thread;
+    SP_CHECK(before + n == reg.size());
+
+    // One block kept only by a weak_ptr, one with a second reference.
+    jfpu::weak_ptr<registered> w(made[0][0]);
+    made[0][0].reset();
+    jfpu::shared_ptr<registered> extra(made[0][1]);
+
+    std::vector<jfpu::sp_registry_group> gs = reg.groups();
+    const jfpu::sp_registry_group* g = NULL;
+    for(std::size_t i = 0; i < gs.size(); ++i) {
+        if(NULL != gs[i].site && std::string::npos != gs[i].type.find("registered"))
+            g = &gs[i];
+    }
+    SP_CHECK(NULL != g);
+    if(NULL != g) {
+        SP_CHECK(n == g->blocks);
+        SP_CHECK(1 == g->expired);
+        SP_CHECK(static_cast<long>(n) == g->use_count);
+        SP_CHECK(1 == g->weak_count);
+    }
+
+    extra.reset();
+    for(int t = 0; t < thread_count; ++t)
+        made[t].clear();
+    SP_CHECK(before + 1 == reg.size());
+    w.reset();
+    SP_CHECK(before == reg.size());
+}
+#endif
+
+}
+
+int main() {
+    check_concurrent_copy<jfpu::_S_atomic>();
+    check_concurrent_copy<jfpu::_S_mutex>();
+    check_weak_lock_race();
+    check_exception_paths();
+    check_intrusive_ptr();
+    check_enable_shared_from_this();
+    check_deferred();
+    check_atomic_shared_ptr();
+    check_read_mostly_shared_ptr();
+    check_weak_value_cache();
+    check_shared_handle();
+    check_batch();
+    check_block_cache();
+    check_shared_index_pool();
+    check_arena();
+    check_owner_flat_map();
+#if SP_ENABLE_COUNT_HOOKS
+    check_biased();
+    check_sharded();
+#endif
+#if SP_ENABLE_PROFILE
+    check_profile();
+#endif
+#if SP_ENABLE_REGISTRY
+    check_registry();
+#endif
+
+    if(0 != failures) {
+        std::fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    std::printf("all checks passed\n");
+    return 0;
+}
@@ -0,0 +1,349 @@
+/*=============================================================================
+#     FileName: sp_contention_bench.cc
+#         Desc: multi-thread contention benchmark with hardware counters
+#       Author: Jeffrey Pu
+#        Email: pujunying@gmail.com
+#     HomePage: https://github.com/jfpu
+#      Version: 0.0.1
+#   LastChange: 2026-10-17 14:48:19
+#      History:
+=============================================================================*/
+
+// make contention
+// make contention BENCH_ARGS="--threads 1,8,32 --raw 0x04d2"
+//
+// Copy/release storms and weak_ptr::lock() storms, either on one hot
+// control block shared by every thread or on cold blocks private to
+// each thread, for a sweep of thread counts.  Every thread does the same
+// fixed number of operations; the run reports ops/sec, the number of
+// times add_ref_lock() retried its compare-and-swap, and hardware
+// counters from perf_event_open:
+//   cache_misses  PERF_COUNT_HW_CACHE_MISSES (last level)
+//   l1d_misses    L1 data read misses; a line that keeps moving between
+//                 cores shows up here on every access
+//   raw           the model specific event given with --raw, e.g. the
+//                 HITM (snoop hit modified) event of the CPU, which
+//                 counts cache-line transfers directly
+// Counters that cannot be opened (perf_event_paranoid, containers,
+// virtual machines) are reported as -1.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Counted per thread, summed when the thread is done.
+static thread_local unsigned long sp_lock_retries = 0;
+#define SP_ADD_REF_LOCK_RETRY() (++::sp_lock_retries)
+
+#include "shared_ptr.h"
+
+namespace {
+
+template<typename T>
+inline void do_not_optimize(T const& v) {
+    asm volatile("" : : "g"(&v) : "memory");
+}
+
+
+
+// One counter for the whole process.  inherit makes the threads started
+// after open() count too; their counts are added to ours when they
+// exit, so read() after join().
+class perf_counter {
+    int _fd;
+
+    perf_counter(perf_counter const& );
+    perf_counter& operator=(perf_counter const& );
+
+public:
+    // Leaves the counter closed when open is false.
+    perf_counter(unsigned type, unsigned long long config, bool open = true) : _fd(-1) {
+        if(!open)
+            return;
+        perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = type;
+        attr.config = config;
+        attr.disabled = 1;
+        attr.inherit = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        _fd = static_cast<int>(syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0));
+    }
+
+    ~perf_counter() {
+        if(_fd >= 0)
+            close(_fd);
+    }
+
+    bool valid() const {
+        return _fd >= 0;
+    }
+
+    void start() {
+        if(_fd >= 0) {
+            ioctl(_fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(_fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+
+    void stop() {
+        if(_fd >= 0)
+            ioctl(_fd, PERF_EVENT_IOC_DISABLE, 0);
+    }
+
+    long long read() const {
+        unsigned long long v = 0;
+        if(_fd >= 0 && sizeof(v) == ::read(_fd, &v, sizeof(v)))
+            return static_cast<long long>(v);
+        return -1;
+    }
+};
+
+
+
+struct options {
+    long ops;
+    int cold_blocks;
+    std::vector<int> threads;
+    std::string format;
+    std::string filter;
+    long long raw;
+
+    options() : ops(1000000), cold_blocks(256), format("csv"), raw(-1) {}
+};
+
+struct result {
+    std::string scenario;
+    int threads;
+    long ops;
+    double seconds;
+    double ops_per_sec;
+    unsigned long lock_retries;
+    long long cache_misses;
+    long long l1d_misses;
+    long long raw;
+};
+
+enum scenario_kind { copy_storm, lock_storm };
+
+struct scenario {
+    const char* name;
+    scenario_kind kind;
+    bool hot;
+};
+
+const scenario scenarios[] = {
+    { "copy_hot", copy_storm, true },
+    { "copy_cold", copy_storm, false },
+    { "lock_hot", lock_storm, true },
+    { "lock_cold", lock_storm, false },
+};
+
+typedef jfpu::shared_ptr<long> sp_long;
+typedef jfpu::weak_ptr<long> wp_long;
+
+// Both the hot pointer and the start flag sit on lines of their own so
+// that only the control block is contended.
+struct alignas(64) hot_slot {
+    sp_long p;
+};
+
+struct alignas(64) start_flag {
+    std::atomic<bool> go;
+};
+
+void worker(const scenario& s, const options& opt, const sp_long& hot,
+            const start_flag& start, std::atomic<int>& ready,
+            std::atomic<unsigned long>& retries) {
+    // Cold blocks are allocated by the thread that uses them.
+    std::vector<sp_long> mine;
+    if(s.hot)
+        mine.push_back(hot);
+    else
+        for(int i = 0; i < opt.cold_blocks; ++i)
+            mine.push_back(jfpu::make_shared<long>(i));
+    std::vector<wp_long> weak(mine.begin(), mine.end());
+    std::size_t n = mine.size();
+
+    ready.fetch_add(1);
+    while(!start.go.load(std::memory_order_acquire))
+        std::this_thread::yield();
+
+    sp_lock_retries = 0;
+    if(copy_storm == s.kind) {
+        for(long i = 0; i < opt.ops; ++i) {
+            sp_long q(mine[i % n]);
+            do_not_optimize(q);
+        }
+    } else {
+        for(long i = 0; i < opt.ops; ++i) {
+            sp_long q = weak[i % n].lock();
+            do_not_optimize(q);
+        }
+    }
+    retries.fetch_add(sp_lock_retries);
+}
+
+result run_one(const scenario& s, int threads, const options& opt,
+               perf_counter& misses, perf_counter& l1d, perf_counter& raw) {
+    hot_slot hot;
+    hot.p = jfpu::make_shared<long>(42);
+    start_flag start;
+    start.go.store(false);
+    std::atomic<int> ready(0);
+    std::atomic<unsigned long> retries(0);
+
+    // The counters are enabled before the threads exist so that they
+    // inherit them; setup is counted as well, the same for every run.
+    misses.start();
+    l1d.start();
+    raw.start();
+    std::vector<std::thread> ts;
+    for(int i = 0; i < threads; ++i)
+        ts.push_back(std::thread(worker, std::cref(s), std::cref(opt), std::cref(hot.p),
+                                 std::cref(start), std::ref(ready), std::ref(retries)));
+    while(ready.load() != threads)
+        std::this_thread::yield();
+
+    std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+    start.go.store(true, std::memory_order_release);
+    for(std::size_t i = 0; i < ts.size(); ++i)
+        ts[i].join();
+    std::chrono::steady_clock::time_point t1 = std::chrono::steady_clock::now();
+    misses.stop();
+    l1d.stop();
+    raw.stop();
+
+    result r;
+    r.scenario = s.name;
+    r.threads = threads;
+    r.ops = opt.ops * threads;
+    r.seconds = std::chrono::duration<double>(t1 - t0).count();
+    r.ops_per_sec = r.ops / r.seconds;
+    r.lock_retries = retries.load();
+    r.cache_misses = misses.read();
+    r.l1d_misses = l1d.read();
+    r.raw = raw.read();
+    return r;
+}
+
+
+
+void print_csv(const std::vector<result>& rs) {
+    std::printf("scenario,threads,ops,seconds,ops_per_sec,lock_retries,cache_misses,l1d_misses,raw\n");
+    for(std::size_t i = 0; i < rs.size(); ++i)
+        std::printf("%s,%d,%ld,%.6f,%.0f,%lu,%lld,%lld,%lld\n",
+                    rs[i].scenario.c_str(), rs[i].threads, rs[i].ops, rs[i].seconds,
+                    rs[i].ops_per_sec, rs[i].lock_retries, rs[i].cache_misses,
+                    rs[i].l1d_misses, rs[i].raw);
+}
+
+void print_json(const std::vector<result>& rs, const options& opt) {
+    std::printf("{\n  \"compiler\": \"%s\",\n  \"cores\": %u,\n  \"raw_event\": %lld,\n"
+                "  \"results\": [\n", __VERSION__, std::thread::hardware_concurrency(), opt.raw);
+    for(std::size_t i = 0; i < rs.size(); ++i)
+        std::printf("    {\"scenario\": \"%s\", \"threads\": %d, \"ops\": %ld, \"seconds\": %.6f, "
+                    "\"ops_per_sec\": %.0f, \"lock_retries\": %lu, \"cache_misses\": %lld, "
+                    "\"l1d_misses\": %lld, \"raw\": %lld}%s\n",
+                    rs[i].scenario.c_str(), rs[i].threads, rs[i].ops, rs[i].seconds,
+                    rs[i].ops_per_sec, rs[i].lock_retries, rs[i].cache_misses,
+                    rs[i].l1d_misses, rs[i].raw, i + 1 < rs.size() ? "," : "");
+    std::printf("  ]\n}\n");
+}
+
+void usage(const char* argv0) {
+    std::fprintf(stderr,
+                 "usage: %s [--ops N] [--threads 1,2,4] [--cold-blocks N] [--raw EVENT]\n"
+                 "          [--format csv|json] [--filter NAME]\n", argv0);
+    std::exit(2);
+}
+
+// 1, 2, 4, ... up to and including the number of cores.
+std::vector<int> default_threads() {
+    int cores = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<int> v;
+    for(int t = 1; t < cores; t *= 2)
+        v.push_back(t);
+    v.push_back(cores);
+    return v;
+}
+
+std::vector<int> parse_threads(const char* s) {
+    std::vector<int> v;
+    for(const char* p = s; *p; ) {
+        char* end;
+        long t = std::strtol(p, &end, 10);
+        if(end == p || t <= 0)
+            return std::vector<int>();
+        v.push_back(static_cast<int>(t));
+        p = ',' == *end ? end + 1 : end;
+    }
+    return v;
+}
+
+}
+
+int main(int argc, char* argv[]) {
+    options opt;
+    for(int i = 1; i < argc; ++i) {
+        std::string a = argv[i];
+        if(i + 1 >= argc)
+            usage(argv[0]);
+        const char* v = argv[++i];
+        if("--ops" == a)
+            opt.ops = std::atol(v);
+        else if("--threads" == a) {
+            opt.threads = parse_threads(v);
+            if(opt.threads.empty())
+                usage(argv[0]);
+        } else if("--cold-blocks" == a)
+            opt.cold_blocks = std::atoi(v);
+        else if("--raw" == a)
+            opt.raw = std::strtoll(v, NULL, 0);
+        else if("--format" == a)
+            opt.format = v;
+        else if("--filter" == a)
+            opt.filter = v;
+        else
+            usage(argv[0]);
+    }
+    if(opt.ops <= 0 || opt.cold_blocks <= 0 || ("csv" != opt.format && "json" != opt.format))
+        usage(argv[0]);
+    if(opt.threads.empty())
+        opt.threads = default_threads();
+
+    perf_counter misses(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+    perf_counter l1d(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D |
+                                         (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                         (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+    perf_counter raw(PERF_TYPE_RAW, opt.raw, opt.raw >= 0);
+    if(!misses.valid() || !l1d.valid())
+        std::fprintf(stderr, "perf_event_open failed, hardware counters reported as -1\n");
+
+    std::vector<result> rs;
+    for(std::size_t s = 0; s < sizeof(scenarios) / sizeof(scenarios[0]); ++s) {
+        if(!opt.filter.empty() && NULL == std::strstr(scenarios[s].name, opt.filter.c_str()))
+            continue;
+        for(std::size_t t = 0; t < opt.threads.size(); ++t) {
+            rs.push_back(run_one(scenarios[s], opt.threads[t], opt, misses, l1d, raw));
+        }
+    }
+
+    if("json" == opt.format)
+        print_json(rs, opt);
+    else
+        print_csv(rs);
+    return 0;
+}
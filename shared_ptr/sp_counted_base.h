@@ -12,14 +12,82 @@
 #ifndef _SP_COUNTED_BASE_H_
 #define _SP_COUNTED_BASE_H_
 
+#include <atomic>
 #include <type_traits>
+#include <utility>
+#include <new>
+#include <memory>
 // #include <tr1/type_traits>
 // #include <boost/type_traits.hpp>
 #include <debug/macros.h>
+#include <ext/concurrence.h>
+
+// -DSP_ENABLE_PROFILE=1 counts reference count operations per control
+// block type and samples the most contended blocks, see sp_profile.h.
+// Without it the SP_PROFILE_* hooks expand to nothing.
+#ifndef SP_ENABLE_PROFILE
+#define SP_ENABLE_PROFILE 0
+#endif
+
+#if SP_ENABLE_PROFILE
+#include "sp_profile.h"
+#endif
+
+// -DSP_ENABLE_REGISTRY=1 keeps a list of the live control blocks for
+// leak and lifetime dumps, see sp_registry.h.  Without it the registry
+// is not compiled and SP_REGISTRY_SITE() is a no-op.
+#ifndef SP_ENABLE_REGISTRY
+#define SP_ENABLE_REGISTRY 0
+#endif
+
+#if SP_ENABLE_REGISTRY
+#include "sp_registry.h"
+#else
+#define SP_REGISTRY_SITE() ((void)0)
+#endif
+
+// Blocks of shared_ptr(p) and shared_ptr(p, d) come from the per-thread
+// caches of sp_block_cache.h.  -DSP_USE_BLOCK_CACHE=0 uses global new
+// and delete; that is the default under AddressSanitizer, which cannot
+// see use after free of cached memory.
+#ifndef SP_USE_BLOCK_CACHE
+#if defined(__SANITIZE_ADDRESS__)
+#define SP_USE_BLOCK_CACHE 0
+#else
+#define SP_USE_BLOCK_CACHE 1
+#endif
+#endif
+
+#if SP_USE_BLOCK_CACHE
+#include "sp_block_cache.h"
+#endif
+
+#ifndef SP_ENABLE_COUNT_HOOKS
+#define SP_ENABLE_COUNT_HOOKS 0
+#endif
+
+#ifndef SP_USE_LEGACY_ATOMICS
+#define SP_USE_LEGACY_ATOMICS 0
+#endif
+
+// The macros above change the layout of the control blocks and the
+// inline code that touches them, so every translation unit linked
+// together has to agree on them.  Everything built on sp_counted_base
+// lives in an inline namespace named after their values: a mismatch
+// fails to link, with the namespaces in the undefined references,
+// instead of silently mixing two layouts.
+#define SP_ABI_NAME_(h, p, r, c, l) hooks##h##_profile##p##_registry##r##_cache##c##_legacy##l
+#define SP_ABI_NAME(h, p, r, c, l) SP_ABI_NAME_(h, p, r, c, l)
+#define SP_BEGIN_NAMESPACE_ABI                                         \
+    inline namespace SP_ABI_NAME(SP_ENABLE_COUNT_HOOKS, SP_ENABLE_PROFILE, \
+                                 SP_ENABLE_REGISTRY, SP_USE_BLOCK_CACHE, \
+                                 SP_USE_LEGACY_ATOMICS) {
+#define SP_END_NAMESPACE_ABI }
 
 // #define _GLIBCXX_DEBUG_ASSERT(_Condition) __glibcxx_assert(_Condition)
 
 namespace jfpu {
+SP_BEGIN_NAMESPACE_ABI
 
 
 // Use C++0x's static_assert if possible.
@@ -72,6 +140,17 @@ __throw_bad_weak_ptr()
 #endif
 }
 
+// make_shared<T[]>(n) with an n that overflows, like new T[n].
+inline void
+sp_throw_bad_array_new_length()
+{
+#if __EXCEPTIONS
+    throw std::bad_array_new_length();
+#else
+    __builtin_abort();
+#endif
+}
+
 
 
 template<typename T>
@@ -82,124 +161,929 @@ struct sp_deleter {
     void operator()(T* p) const { delete p; }
 };
 
+// Owner of new T[n], used by shared_ptr<T[]> and shared_ptr<T[N]>.
+template<typename T>
+struct sp_array_deleter {
+    typedef void result_type;
+    typedef T* argument_type;
+
+    void operator()(T* p) const { delete[] p; }
+};
+
+// Deleter of a pointer p of type Y* given to a shared_ptr<T>.
+template<typename T, typename Y>
+struct sp_default_deleter {
+    typedef typename std::conditional<std::is_array<T>::value,
+                                      sp_array_deleter<Y>, sp_deleter<Y> >::type type;
+};
+
 
 
-class sp_counted_base {
+// Policies for the reference counts, chosen per pointer type:
+//   _S_single  plain integers, for objects confined to one thread
+//   _S_mutex   counters guarded by a mutex in the control block, for
+//              targets without cheap atomic read-modify-write
+//   _S_atomic  lock-free atomic operations
+enum _Lock_policy { _S_single, _S_mutex, _S_atomic };
+
+// Same choice as libstdc++ makes for std::shared_ptr.
+static const _Lock_policy __default_lock_policy =
+#ifndef __GTHREADS
+    _S_single;
+#elif defined(_GLIBCXX_ATOMIC_BUILTINS)
+    _S_atomic;
+#else
+    _S_mutex;
+#endif
+
+// Control blocks with a counting scheme of their own (see
+// sp_counted_biased.h, sp_counted_sharded.h) park _uc at sp_custom_count
+// and implement the custom_* hooks.  The _S_atomic operations test for
+// them only when SP_ENABLE_COUNT_HOOKS is set, otherwise there is no
+// extra load and branch on the fast path.
+
+struct sp_custom_count_tag {};
+
+enum { sp_custom_count = -1 };
+
+// The _S_atomic counters are std::atomic with the weakest ordering each
+// operation allows.  -DSP_USE_LEGACY_ATOMICS=1 goes back to plain
+// _Atomic_word and the __gnu_cxx dispatch builtins, which are full
+// barriers.
+
+template<_Lock_policy _Lp>
+struct sp_count_word {
+    typedef _Atomic_word type;
+};
+
+#if !SP_USE_LEGACY_ATOMICS
+template<>
+struct sp_count_word<_S_atomic> {
+    typedef std::atomic<_Atomic_word> type;
+};
+#endif
+
+#if SP_ENABLE_PROFILE
+#define SP_PROFILE_BIND(Block) this->profile_bind(sp_profile_type<Block>::id())
+#define SP_PROFILE_COUNT(pi, ev) sp_profiler::instance().count((pi)->profile_type(), ev, pi)
+#define SP_PROFILE_COUNT_N(pi, ev, n) sp_profiler::instance().count((pi)->profile_type(), ev, pi, n)
+#define SP_PROFILE_DISPOSE(pi, call) \
+    do { sp_profile_timer sp_profile_timer_((pi)->profile_type(), pi); call; } while(0)
+#else
+#define SP_PROFILE_BIND(Block) ((void)0)
+#define SP_PROFILE_COUNT(pi, ev) ((void)0)
+#define SP_PROFILE_COUNT_N(pi, ev, n) ((void)0)
+#define SP_PROFILE_DISPOSE(pi, call) call
+#endif
+
+#if SP_ENABLE_REGISTRY
+#define SP_REGISTRY_BIND(Block) this->registry_bind(sp_registry_type<Block>::pretty())
+#else
+#define SP_REGISTRY_BIND(Block) ((void)0)
+#endif
+
+// Called at the end of the constructor of every block type.
+#define SP_BLOCK_BIND(Block) do { SP_PROFILE_BIND(Block); SP_REGISTRY_BIND(Block); } while(0)
+
+// Run each time add_ref_lock() loses a compare-and-swap on _uc to
+// another thread and retries.  sp_contention_bench.cc defines it to
+// count the retries.
+#ifndef SP_ADD_REF_LOCK_RETRY
+#define SP_ADD_REF_LOCK_RETRY() SP_PROFILE_COUNT(this, sp_prof_lock_retry)
+#endif
+
+// Order of a decrement that may free something.  ThreadSanitizer does
+// not understand fences, so under it the decrement itself carries the
+// acquire instead of a fence after the last one.
+#if defined(__SANITIZE_THREAD__)
+static const std::memory_order sp_release_order = std::memory_order_acq_rel;
+#else
+static const std::memory_order sp_release_order = std::memory_order_release;
+#endif
+
+// Only the _S_mutex policy carries a lock.
+template<_Lock_policy _Lp>
+class sp_mutex_base {
+};
+
+template<>
+class sp_mutex_base<_S_mutex> {
+protected:
+    __gnu_cxx::__mutex _mutex;
+};
+
+
+
+template<_Lock_policy _Lp = __default_lock_policy>
+class sp_counted_base : public sp_mutex_base<_Lp> {
     sp_counted_base(sp_counted_base const& );
     sp_counted_base& operator=(sp_counted_base const& );
 
     // http://gcc.gnu.org/onlinedocs/libstdc++/manual/ext_concurrency.html
-    _Atomic_word _uc;
-    _Atomic_word _wc;
+    typename sp_count_word<_Lp>::type _uc;
+    typename sp_count_word<_Lp>::type _wc;
+#if SP_ENABLE_PROFILE
+    unsigned _prof_type = 0;
+#endif
+#if SP_ENABLE_REGISTRY
+    sp_registry_node _reg = sp_registry_node();
+
+    static void registry_read(const void* b, long& use, long& weak) {
+        const sp_counted_base* pi = static_cast<const sp_counted_base*>(b);
+        long uc = pi->_uc;
+        long wc = pi->_wc;
+        use = uc < 0 ? -1 : uc;
+        weak = 0 != uc ? wc - 1 : wc;
+    }
+#endif
+
+protected:
+    explicit sp_counted_base(sp_custom_count_tag)
+      : _uc(sp_custom_count), _wc(1) {}
+
+    // Strong count operations of a custom block, the weak count stays
+    // in _wc.  custom_add_ref_lock() returns false if the count is 0.
+    virtual void custom_add_ref_copy() {}
+    virtual bool custom_add_ref_lock() { return false; }
+    virtual void custom_release() {}
+    virtual long custom_use_count() const { return 0; }
+
+#if SP_ENABLE_PROFILE
+    // Called by the constructor of each block type, counts the block.
+    void profile_bind(unsigned type) {
+        _prof_type = type;
+        SP_PROFILE_COUNT(this, sp_prof_alloc);
+    }
+#endif
+
+#if SP_ENABLE_REGISTRY
+    // Called by the constructor of each block type, lists the block.
+    void registry_bind(const char* type) {
+        _reg.block = this;
+        _reg.read = &registry_read;
+        _reg.type = type;
+        sp_registry::instance().insert(&_reg);
+    }
+#endif
 
 public:
     sp_counted_base() : _uc(1), _wc(1) {}
-    virtual ~sp_counted_base() {};
+    virtual ~sp_counted_base() {
+#if SP_ENABLE_REGISTRY
+        if(NULL != _reg.block)
+            sp_registry::instance().erase(&_reg);
+#endif
+    }
     virtual void dispose() = 0;
     virtual void destroy() { delete this;}
     virtual void* get_deleter(const std::type_info&) = 0;
-    
-    void add_ref_copy() {
-        // ++_uc;
-         __gnu_cxx::__atomic_add_dispatch(&_uc, 1);
+
+    // dispose() then weak_release(), called when the use count drops to
+    // zero.  The final block types override it so the whole teardown is
+    // one indirect call with the deleter and destroy() inlined.
+    virtual void release_last();
+
+    // The counting operations are specialized for each policy below.
+    void add_ref_copy();
+
+    // Takes a strong reference only if the count is not 0 yet.
+    bool add_ref_lock_nothrow();
+
+    void add_ref_lock() {
+        if(!add_ref_lock_nothrow())
+            __throw_bad_weak_ptr();
     }
 
-    // single, mutex, atomic
-    void add_ref_lock();
+    void release();
 
-    void release() {
-        // if(0 == --_uc) {
-        if(__gnu_cxx::__exchange_and_add_dispatch(&_uc, -1) == 1) {
-            dispose();
-            weak_release();
-        }
+    // Batch forms for sp_batch.h.  add_ref_copy(n) takes n references
+    // at once.  release_n(n) drops n and returns true if those were the
+    // last ones; it does not call release_last(), the caller does.
+    void add_ref_copy(long n);
+
+    bool release_n(long n);
+
+    void weak_add_ref();
+
+    void weak_release();
+
+    long use_count() const;
+
+#if SP_ENABLE_PROFILE
+    unsigned profile_type() const {
+        return _prof_type;
     }
+#endif
+};
+
+
+
+template<>
+inline void sp_counted_base<_S_single>::add_ref_copy() {
+    ++_uc;
+}
 
-    void weak_add_ref() {
-        // ++_wc;
-        __gnu_cxx::__atomic_add_dispatch(&_wc, 1);
+template<>
+inline bool sp_counted_base<_S_single>::add_ref_lock_nothrow() {
+    if(0 == _uc)
+        return false;
+    ++_uc;
+    return true;
+}
+
+template<>
+inline void sp_counted_base<_S_single>::weak_add_ref() {
+    ++_wc;
+}
+
+template<>
+inline void sp_counted_base<_S_single>::weak_release() {
+    if(0 == --_wc) {
+        destroy();
     }
+}
 
-    void weak_release() {
-        // if(0 == --_wc) {
-        if(__gnu_cxx::__exchange_and_add_dispatch(&_wc, -1) == 1) {
-            destroy();
-        }
+template<>
+inline void sp_counted_base<_S_single>::release() {
+    if(0 == --_uc) {
+        release_last();
     }
+}
 
-    long use_count() const {
-        return const_cast<const volatile _Atomic_word&>(_uc);
+template<>
+inline void sp_counted_base<_S_single>::add_ref_copy(long n) {
+    _uc += n;
+}
+
+template<>
+inline bool sp_counted_base<_S_single>::release_n(long n) {
+    return 0 == (_uc -= n);
+}
+
+template<>
+inline long sp_counted_base<_S_single>::use_count() const {
+    return _uc;
+}
+
+
+
+// The lock is dropped before dispose()/destroy(), the deleter may
+// release other pointers and destroy() frees the mutex itself.
+template<>
+inline void sp_counted_base<_S_mutex>::add_ref_copy() {
+    __gnu_cxx::__scoped_lock sentry(_mutex);
+    ++_uc;
+}
+
+template<>
+inline bool sp_counted_base<_S_mutex>::add_ref_lock_nothrow() {
+    __gnu_cxx::__scoped_lock sentry(_mutex);
+    if(0 == _uc)
+        return false;
+    ++_uc;
+    return true;
+}
+
+template<>
+inline void sp_counted_base<_S_mutex>::weak_add_ref() {
+    __gnu_cxx::__scoped_lock sentry(_mutex);
+    ++_wc;
+}
+
+template<>
+inline void sp_counted_base<_S_mutex>::weak_release() {
+    bool last;
+    {
+        __gnu_cxx::__scoped_lock sentry(_mutex);
+        last = (0 == --_wc);
     }
-};
+    if(last) {
+        destroy();
+    }
+}
+
+template<>
+inline void sp_counted_base<_S_mutex>::release() {
+    bool last;
+    {
+        __gnu_cxx::__scoped_lock sentry(_mutex);
+        last = (0 == --_uc);
+    }
+    if(last) {
+        release_last();
+    }
+}
+
+template<>
+inline void sp_counted_base<_S_mutex>::add_ref_copy(long n) {
+    __gnu_cxx::__scoped_lock sentry(_mutex);
+    _uc += n;
+}
+
+template<>
+inline bool sp_counted_base<_S_mutex>::release_n(long n) {
+    __gnu_cxx::__scoped_lock sentry(_mutex);
+    return 0 == (_uc -= n);
+}
+
+template<>
+inline long sp_counted_base<_S_mutex>::use_count() const {
+    __gnu_cxx::__scoped_lock sentry(const_cast<__gnu_cxx::__mutex&>(_mutex));
+    return _uc;
+}
+
+
+
+#if SP_USE_LEGACY_ATOMICS
+template<>
+inline void sp_counted_base<_S_atomic>::add_ref_copy() {
+#if SP_ENABLE_COUNT_HOOKS
+    if(__builtin_expect(const_cast<const volatile _Atomic_word&>(_uc) < 0, 0)) {
+        custom_add_ref_copy();
+        return;
+    }
+#endif
+    // ++_uc;
+     __gnu_cxx::__atomic_add_dispatch(&_uc, 1);
+}
 
-inline void sp_counted_base::add_ref_lock() {
+template<>
+inline bool sp_counted_base<_S_atomic>::add_ref_lock_nothrow() {
     // Perform lock-free add-if-not-zero operation.
     _Atomic_word __count;
 
     do {
         __count = _uc;
         if(0 == __count)
-            __throw_bad_weak_ptr();
+            return false;
+#if SP_ENABLE_COUNT_HOOKS
+        if(__builtin_expect(__count < 0, 0))
+            return custom_add_ref_lock();
+#endif
         
         // Replace the current counter value with the old value + 1, as
         // long as it's not changed meanwhile. 
-	} while (!__sync_bool_compare_and_swap(&_uc, __count, __count + 1));
+        if(__sync_bool_compare_and_swap(&_uc, __count, __count + 1))
+            return true;
+        SP_ADD_REF_LOCK_RETRY();
+    } while(true);
+}
+
+template<>
+inline void sp_counted_base<_S_atomic>::weak_add_ref() {
+    // ++_wc;
+    __gnu_cxx::__atomic_add_dispatch(&_wc, 1);
+}
+
+template<>
+inline void sp_counted_base<_S_atomic>::weak_release() {
+    // if(0 == --_wc) {
+    if(__gnu_cxx::__exchange_and_add_dispatch(&_wc, -1) == 1) {
+        destroy();
+    }
+}
+
+template<>
+inline void sp_counted_base<_S_atomic>::release() {
+#if SP_ENABLE_COUNT_HOOKS
+    if(__builtin_expect(const_cast<const volatile _Atomic_word&>(_uc) < 0, 0)) {
+        custom_release();
+        return;
+    }
+#endif
+    // if(0 == --_uc) {
+    if(__gnu_cxx::__exchange_and_add_dispatch(&_uc, -1) == 1) {
+        release_last();
+    }
+}
+
+// A custom block takes and drops the n references one at a time.
+template<>
+inline void sp_counted_base<_S_atomic>::add_ref_copy(long n) {
+#if SP_ENABLE_COUNT_HOOKS
+    if(__builtin_expect(const_cast<const volatile _Atomic_word&>(_uc) < 0, 0)) {
+        while(n-- > 0)
+            custom_add_ref_copy();
+        return;
+    }
+#endif
+    __gnu_cxx::__atomic_add_dispatch(&_uc, n);
+}
+
+template<>
+inline bool sp_counted_base<_S_atomic>::release_n(long n) {
+#if SP_ENABLE_COUNT_HOOKS
+    if(__builtin_expect(const_cast<const volatile _Atomic_word&>(_uc) < 0, 0)) {
+        while(n-- > 0)
+            custom_release();
+        return false;
+    }
+#endif
+    return __gnu_cxx::__exchange_and_add_dispatch(&_uc, -n) == n;
+}
+
+template<>
+inline long sp_counted_base<_S_atomic>::use_count() const {
+    _Atomic_word __count = const_cast<const volatile _Atomic_word&>(_uc);
+#if SP_ENABLE_COUNT_HOOKS
+    if(__builtin_expect(__count < 0, 0))
+        return custom_use_count();
+#endif
+    return __count;
 }
 
+#else
+
+// Increments need no ordering: a new reference is always made from an
+// existing one.  The decrements release, and only the one that reaches
+// zero pays an acquire fence before the object or the block is freed.
+// See sp_release_order for ThreadSanitizer builds.
+template<>
+inline void sp_counted_base<_S_atomic>::add_ref_copy() {
+#if SP_ENABLE_COUNT_HOOKS
+    if(__builtin_expect(_uc.load(std::memory_order_relaxed) < 0, 0)) {
+        custom_add_ref_copy();
+        return;
+    }
+#endif
+    _uc.fetch_add(1, std::memory_order_relaxed);
+}
+
+template<>
+inline bool sp_counted_base<_S_atomic>::add_ref_lock_nothrow() {
+    _Atomic_word __count = _uc.load(std::memory_order_relaxed);
+    for(;;) {
+        if(0 == __count)
+            return false;
+#if SP_ENABLE_COUNT_HOOKS
+        if(__builtin_expect(__count < 0, 0))
+            return custom_add_ref_lock();
+#endif
+        if(_uc.compare_exchange_weak(__count, __count + 1,
+                                     std::memory_order_relaxed,
+                                     std::memory_order_relaxed))
+            return true;
+        SP_ADD_REF_LOCK_RETRY();
+    }
+}
+
+template<>
+inline void sp_counted_base<_S_atomic>::weak_add_ref() {
+    _wc.fetch_add(1, std::memory_order_relaxed);
+}
 
+template<>
+inline void sp_counted_base<_S_atomic>::weak_release() {
+    if(_wc.fetch_sub(1, sp_release_order) == 1) {
+        std::atomic_thread_fence(std::memory_order_acquire);
+        destroy();
+    }
+}
+
+template<>
+inline void sp_counted_base<_S_atomic>::release() {
+#if SP_ENABLE_COUNT_HOOKS
+    if(__builtin_expect(_uc.load(std::memory_order_relaxed) < 0, 0)) {
+        custom_release();
+        return;
+    }
+#endif
+    if(_uc.fetch_sub(1, sp_release_order) == 1) {
+        std::atomic_thread_fence(std::memory_order_acquire);
+        release_last();
+    }
+}
+
+template<>
+inline void sp_counted_base<_S_atomic>::add_ref_copy(long n) {
+#if SP_ENABLE_COUNT_HOOKS
+    if(__builtin_expect(_uc.load(std::memory_order_relaxed) < 0, 0)) {
+        while(n-- > 0)
+            custom_add_ref_copy();
+        return;
+    }
+#endif
+    _uc.fetch_add(n, std::memory_order_relaxed);
+}
+
+template<>
+inline bool sp_counted_base<_S_atomic>::release_n(long n) {
+#if SP_ENABLE_COUNT_HOOKS
+    if(__builtin_expect(_uc.load(std::memory_order_relaxed) < 0, 0)) {
+        while(n-- > 0)
+            custom_release();
+        return false;
+    }
+#endif
+    if(_uc.fetch_sub(n, sp_release_order) == n) {
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return true;
+    }
+    return false;
+}
+
+template<>
+inline long sp_counted_base<_S_atomic>::use_count() const {
+    _Atomic_word __count = _uc.load(std::memory_order_relaxed);
+#if SP_ENABLE_COUNT_HOOKS
+    if(__builtin_expect(__count < 0, 0))
+        return custom_use_count();
+#endif
+    return __count;
+}
+
+#endif
+
+
+
+template<_Lock_policy _Lp>
+inline void sp_counted_base<_Lp>::release_last() {
+    SP_PROFILE_DISPOSE(this, dispose());
+    weak_release();
+}
+
+
+
+// Holds a deleter or an allocator of a control block.  Empty ones are
+// kept as a base class and take no room (empty base optimization);
+// N tells two members of the same block apart.
+template<int N, typename T,
+         bool = std::is_empty<T>::value && !__is_final(T)>
+class sp_ebo_holder : private T {
+public:
+    explicit sp_ebo_holder(const T& t) : T(t) {}
+    T& get() { return *this; }
+};
+
+template<int N, typename T>
+class sp_ebo_holder<N, T, false> {
+    T _t;
+public:
+    explicit sp_ebo_holder(const T& t) : _t(t) {}
+    T& get() { return _t; }
+};
+
+
+
+// With the default sp_deleter<T> the block is the vtable pointer, the
+// two counts and the pointer, and release_last() inlines the delete.
+template<typename Ptr, typename Deleter, _Lock_policy _Lp = __default_lock_policy>
+class sp_counted_impl final : public sp_counted_base<_Lp>,
+                              private sp_ebo_holder<0, Deleter> {
+    typedef sp_ebo_holder<0, Deleter> deleter_holder;
 
-template<typename Ptr, typename Deleter>
-class sp_counted_impl : public sp_counted_base {
-    // typedef sp_counted_impl<Ptr, Deleter> this_type;
     Ptr _px;
-    Deleter _del;
     
     sp_counted_impl(sp_counted_impl const& );
     sp_counted_impl& operator=(sp_counted_impl const& );
 
 public:
     explicit sp_counted_impl(Ptr px, Deleter del)
-      : _px(px), _del(del) {}
+      : deleter_holder(del), _px(px) {
+        SP_BLOCK_BIND(sp_counted_impl);
+    }
+
     void dispose() {
-	    _del(_px);
+        deleter_holder::get()(_px);
+    }
+
+    void destroy() {
+        delete this;
+    }
+
+    void release_last() {
+        SP_PROFILE_DISPOSE(this, sp_counted_impl::dispose());
+        this->weak_release();
+    }
+
+#if SP_USE_BLOCK_CACHE
+    static void* operator new(std::size_t n) {
+        return sp_block_cache::allocate(n, std::alignment_of<sp_counted_impl>::value);
     }
+
+    static void operator delete(void* p, std::size_t n) {
+        sp_block_cache::deallocate(p, n, std::alignment_of<sp_counted_impl>::value);
+    }
+#endif
     
     void* get_deleter(const std::type_info& ti) {
-#ifdef _GXX_RTTI
-        return ti == typeid(Deleter) ? _del : NULL;
+#ifdef __GXX_RTTI
+        return ti == typeid(Deleter) ? static_cast<void*>(&deleter_holder::get()) : NULL;
 #else
         return NULL;
 #endif
     }
-    #if 0
-    void* operator new(std::size_t ) {
-        return std::allocator<this_type>().allocate(1, static_cast<this_type*>(0));
+};
+
+
+
+// Control block for shared_ptr(p, d, a): the block itself is obtained
+// from (a rebound copy of) the user's allocator and given back to it.
+template<typename Ptr, typename Deleter, typename Alloc,
+         _Lock_policy _Lp = __default_lock_policy>
+class sp_counted_impl_pda final : public sp_counted_base<_Lp>,
+                                  private sp_ebo_holder<0, Deleter>,
+                                  private sp_ebo_holder<1, typename std::allocator_traits<Alloc>::template
+                                      rebind_alloc<sp_counted_impl_pda<Ptr, Deleter, Alloc, _Lp> > > {
+    typedef typename std::allocator_traits<Alloc>::template
+        rebind_alloc<sp_counted_impl_pda> block_alloc;
+    typedef std::allocator_traits<block_alloc> block_traits;
+    typedef sp_ebo_holder<0, Deleter> deleter_holder;
+    typedef sp_ebo_holder<1, block_alloc> alloc_holder;
+
+    Ptr _px;
+
+    sp_counted_impl_pda(sp_counted_impl_pda const& );
+    sp_counted_impl_pda& operator=(sp_counted_impl_pda const& );
+
+public:
+    sp_counted_impl_pda(Ptr px, Deleter del, const Alloc& a)
+      : deleter_holder(del), alloc_holder(block_alloc(a)), _px(px) {
+        SP_BLOCK_BIND(sp_counted_impl_pda);
     }
-    
-    void operator delete(void* p) {
-        std::allocator<this_type>().deallocate(static_cast<this_type*>(p), 1);
+
+    void dispose() {
+        deleter_holder::get()(_px);
+    }
+
+    void destroy() {
+        block_alloc a(alloc_holder::get());
+        this->~sp_counted_impl_pda();
+        block_traits::deallocate(a, this, 1);
+    }
+
+    void release_last() {
+        SP_PROFILE_DISPOSE(this, sp_counted_impl_pda::dispose());
+        this->weak_release();
+    }
+
+    void* get_deleter(const std::type_info& ti) {
+#ifdef __GXX_RTTI
+        return ti == typeid(Deleter) ? static_cast<void*>(&deleter_holder::get()) : NULL;
+#else
+        return NULL;
+#endif
     }
-    #endif
 };
 
 
 
+// Tag for make_shared: the control block and the object live in the
+// same allocation.  get_deleter(typeid(sp_inplace_tag<T>)) on such a
+// block returns the address of the object.
+template<typename T>
+struct sp_inplace_tag {};
+
+// Passed down from allocate_shared to shared_count, carries the
+// allocator used for the combined block.
+template<typename Alloc>
+struct sp_alloc_shared_tag {
+    const Alloc& _a;
+    explicit sp_alloc_shared_tag(const Alloc& a) : _a(a) {}
+};
+
+template<typename T>
+struct sp_is_alloc_shared_tag : std::false_type {};
+
+template<typename Alloc>
+struct sp_is_alloc_shared_tag<sp_alloc_shared_tag<Alloc> > : std::true_type {};
+
+// The object is constructed and destroyed through allocator_traits of
+// Alloc (so std::pmr::polymorphic_allocator propagates its resource),
+// and the block memory comes from Alloc rebound to the block type.
+template<typename T, typename Alloc, _Lock_policy _Lp = __default_lock_policy>
+class sp_counted_impl_inplace final
+  : public sp_counted_base<_Lp>,
+    private sp_ebo_holder<0, typename std::allocator_traits<Alloc>::template
+        rebind_alloc<typename std::remove_cv<T>::type> > {
+    typedef typename std::remove_cv<T>::type value_type;
+    typedef typename std::allocator_traits<Alloc>::template
+        rebind_alloc<value_type> value_alloc;
+    typedef std::allocator_traits<value_alloc> value_traits;
+    typedef typename std::allocator_traits<Alloc>::template
+        rebind_alloc<sp_counted_impl_inplace> block_alloc;
+    typedef std::allocator_traits<block_alloc> block_traits;
+    typedef typename std::aligned_storage<sizeof(T),
+                                          std::alignment_of<T>::value>::type storage_type;
+    typedef sp_ebo_holder<0, value_alloc> alloc_holder;
+
+    storage_type _storage;
+
+    sp_counted_impl_inplace(sp_counted_impl_inplace const& );
+    sp_counted_impl_inplace& operator=(sp_counted_impl_inplace const& );
+
+public:
+    template<typename... Args>
+    explicit sp_counted_impl_inplace(const Alloc& a, Args&&... args)
+      : alloc_holder(value_alloc(a)) {
+        value_traits::construct(alloc_holder::get(), ptr(), std::forward<Args>(args)...);
+        SP_BLOCK_BIND(sp_counted_impl_inplace);
+    }
+
+    value_type* ptr() {
+        return static_cast<value_type*>(static_cast<void*>(&_storage));
+    }
+
+    void dispose() {
+        value_traits::destroy(alloc_holder::get(), ptr());
+    }
+
+    void destroy() {
+        block_alloc a(alloc_holder::get());
+        this->~sp_counted_impl_inplace();
+        block_traits::deallocate(a, this, 1);
+    }
+
+    void release_last() {
+        SP_PROFILE_DISPOSE(this, sp_counted_impl_inplace::dispose());
+        this->weak_release();
+    }
+
+    void* get_deleter(const std::type_info& ti) {
+#ifdef __GXX_RTTI
+        return ti == typeid(sp_inplace_tag<T>) ? static_cast<void*>(ptr()) : NULL;
+#else
+        return NULL;
+#endif
+    }
+
+    // Allocate a block from a and construct the object in it.  If the
+    // object's constructor throws the memory goes back to a.
+    template<typename... Args>
+    static sp_counted_impl_inplace* create(const Alloc& a, Args&&... args) {
+        block_alloc ba(a);
+        sp_counted_impl_inplace* pi = block_traits::allocate(ba, 1);
+        try {
+            ::new(static_cast<void*>(pi)) sp_counted_impl_inplace(a, std::forward<Args>(args)...);
+        } catch(...) {
+            block_traits::deallocate(ba, pi, 1);
+            throw;
+        }
+        return pi;
+    }
+};
+
+
+
+// make_shared<T[]>(n): n elements placed right after the block in the
+// same allocation.  The memory is counted in units aligned for both the
+// block and the elements, obtained from Alloc rebound to the unit type.
+template<typename Block, typename E>
+struct sp_array_layout {
+    static const std::size_t align = std::alignment_of<Block>::value > std::alignment_of<E>::value
+                                   ? std::alignment_of<Block>::value : std::alignment_of<E>::value;
+    static const std::size_t offset = (sizeof(Block) + std::alignment_of<E>::value - 1)
+                                    / std::alignment_of<E>::value * std::alignment_of<E>::value;
+    typedef typename std::aligned_storage<align, align>::type unit_type;
+
+    // Throws std::bad_array_new_length, as new E[n] does, if the block
+    // and n elements do not fit in a size_t.
+    static std::size_t units(std::size_t n) {
+        if(n > (std::size_t(-1) - offset - sizeof(unit_type)) / sizeof(E))
+            sp_throw_bad_array_new_length();
+        return (offset + n * sizeof(E) + sizeof(unit_type) - 1) / sizeof(unit_type);
+    }
+};
+
+// How make_shared<T[]> initializes the elements.
+enum sp_array_init { sp_array_value_init, sp_array_default_init, sp_array_copy_init };
+
+template<typename E, typename Alloc, _Lock_policy _Lp = __default_lock_policy>
+class sp_counted_impl_array final
+  : public sp_counted_base<_Lp>,
+    private sp_ebo_holder<0, typename std::allocator_traits<Alloc>::template rebind_alloc<E> > {
+    typedef typename std::allocator_traits<Alloc>::template rebind_alloc<E> value_alloc;
+    typedef std::allocator_traits<value_alloc> value_traits;
+    typedef sp_ebo_holder<0, value_alloc> alloc_holder;
+
+    static_assert(!std::is_array<E>::value, "arrays of arrays are not supported");
+
+    std::size_t _n;
+
+    sp_counted_impl_array(sp_counted_impl_array const& );
+    sp_counted_impl_array& operator=(sp_counted_impl_array const& );
+
+    sp_counted_impl_array(const Alloc& a, std::size_t n)
+      : alloc_holder(value_alloc(a)), _n(n) {
+        SP_BLOCK_BIND(sp_counted_impl_array);
+    }
+
+    // Destroys the first n elements, last one first.
+    void destroy_elements(std::size_t n) {
+        E* p = ptr();
+        while(n > 0)
+            value_traits::destroy(alloc_holder::get(), p + --n);
+    }
+
+public:
+    E* ptr() {
+        typedef sp_array_layout<sp_counted_impl_array, E> layout;
+        return static_cast<E*>(static_cast<void*>(reinterpret_cast<char*>(this) + layout::offset));
+    }
+
+    std::size_t size() const {
+        return _n;
+    }
+
+    void dispose() {
+        destroy_elements(_n);
+    }
+
+    void destroy() {
+        typedef sp_array_layout<sp_counted_impl_array, E> layout;
+        typedef typename std::allocator_traits<Alloc>::template
+            rebind_alloc<typename layout::unit_type> unit_alloc;
+        unit_alloc a(alloc_holder::get());
+        typename std::allocator_traits<unit_alloc>::pointer mem =
+            static_cast<typename layout::unit_type*>(static_cast<void*>(this));
+        std::size_t units = layout::units(_n);
+        this->~sp_counted_impl_array();
+        std::allocator_traits<unit_alloc>::deallocate(a, mem, units);
+    }
+
+    void release_last() {
+        SP_PROFILE_DISPOSE(this, sp_counted_impl_array::dispose());
+        this->weak_release();
+    }
+
+    void* get_deleter(const std::type_info& ti) {
+#ifdef __GXX_RTTI
+        return ti == typeid(sp_inplace_tag<E[]>) ? static_cast<void*>(ptr()) : NULL;
+#else
+        return NULL;
+#endif
+    }
+
+    // Allocate a block with n elements from a.  If an element's
+    // constructor throws, the ones already built are destroyed and the
+    // memory goes back to a.  v is used by sp_array_copy_init only.
+    static sp_counted_impl_array* create(const Alloc& a, std::size_t n,
+                                         sp_array_init init, const E* v) {
+        typedef sp_array_layout<sp_counted_impl_array, E> layout;
+        typedef typename std::allocator_traits<Alloc>::template
+            rebind_alloc<typename layout::unit_type> unit_alloc;
+        unit_alloc ua(a);
+        std::size_t units = layout::units(n);
+        typename layout::unit_type* mem = std::allocator_traits<unit_alloc>::allocate(ua, units);
+        sp_counted_impl_array* pi = ::new(static_cast<void*>(mem)) sp_counted_impl_array(a, n);
+        E* p = pi->ptr();
+        std::size_t i = 0;
+        try {
+            for(; i < n; ++i) {
+                if(sp_array_default_init == init)
+                    ::new(static_cast<void*>(p + i)) E;
+                else if(sp_array_copy_init == init)
+                    value_traits::construct(pi->alloc_holder::get(), p + i, *v);
+                else
+                    value_traits::construct(pi->alloc_holder::get(), p + i);
+            }
+        } catch(...) {
+            pi->destroy_elements(i);
+            pi->~sp_counted_impl_array();
+            std::allocator_traits<unit_alloc>::deallocate(ua, mem, units);
+            throw;
+        }
+        return pi;
+    }
+};
+
+
+
+template<_Lock_policy _Lp = __default_lock_policy>
 class weak_count;
 
+// Passed to __shared_ptr with a shared_count made by shared_count::adopt().
+struct sp_adopt_tag {};
+
+// shared_count(weak_count, sp_nothrow_tag) is left empty instead of
+// throwing bad_weak_ptr when the object is gone.
+struct sp_nothrow_tag {};
+
+template<_Lock_policy _Lp = __default_lock_policy>
 class shared_count {
-    sp_counted_base* _pi;
+    sp_counted_base<_Lp>* _pi;
     
-    friend class weak_count;
+    friend class weak_count<_Lp>;
 
 public:
     shared_count() : _pi(NULL) {}
     ~shared_count() {
-        if(NULL != _pi) _pi->release();
+        if(NULL != _pi) {
+            SP_PROFILE_COUNT(_pi, sp_prof_release);
+            _pi->release();
+        }
     }
     
     shared_count(shared_count const& r) : _pi(r._pi) {
-        if(NULL != _pi)
+        if(NULL != _pi) {
+            SP_PROFILE_COUNT(_pi, sp_prof_add_ref_copy);
             _pi->add_ref_copy();
+        }
+    }
+
+    // Steals the reference, no atomic operation on the counters.
+    shared_count(shared_count&& r) noexcept : _pi(r._pi) {
+        r._pi = NULL;
     }
 
     // g++ -o use_shared_ptr -std=c++0x use_shared_ptr.cc
@@ -211,7 +1095,7 @@ public:
         // typedef typename std::tr1::remove_pointer<Ptr>::type native_type;
         // typedef typename boost::remove_pointer<Ptr>::type native_type;
         try {
-            _pi = new sp_counted_impl<Ptr, sp_deleter<native_type> >(p, sp_deleter<native_type>());
+            _pi = new sp_counted_impl<Ptr, sp_deleter<native_type>, _Lp>(p, sp_deleter<native_type>());
         } catch(...) {
             delete p;
             throw;
@@ -221,36 +1105,110 @@ public:
     template<typename Ptr, typename Deleter>
     shared_count(Ptr p, Deleter d) : _pi(NULL) {
         try {
-            _pi = new sp_counted_impl<Ptr, Deleter>(p, d);
+            _pi = new sp_counted_impl<Ptr, Deleter, _Lp>(p, d);
         } catch(...) {
             d(p);
             throw;
         }
     }
-    
-    // template<class P, class D, class A> shared_count( P p, D d, A a )
-    #if 0
+
+    // The control block is allocated with a copy of a rebound to the
+    // block type.  If that fails d(p) is called.
+    template<typename Ptr, typename Deleter, typename Alloc,
+             typename Z = typename std::enable_if<!sp_is_alloc_shared_tag<Deleter>::value>::type >
+    shared_count(Ptr p, Deleter d, Alloc a) : _pi(NULL) {
+        typedef sp_counted_impl_pda<Ptr, Deleter, Alloc, _Lp> impl_type;
+        typedef typename std::allocator_traits<Alloc>::template
+            rebind_alloc<impl_type> impl_alloc;
+        typedef std::allocator_traits<impl_alloc> impl_traits;
+        impl_alloc a2(a);
+        impl_type* pi = NULL;
+        try {
+            pi = impl_traits::allocate(a2, 1);
+            ::new(static_cast<void*>(pi)) impl_type(p, d, a);
+            _pi = pi;
+        } catch(...) {
+            if(NULL != pi)
+                impl_traits::deallocate(a2, pi, 1);
+            d(p);
+            throw;
+        }
+    }
+
+    // make_shared/allocate_shared: one allocation for the counters and
+    // the object, p is set to the object constructed inside the block.
+    template<typename T, typename Alloc, typename... Args>
+    shared_count(T*& p, sp_alloc_shared_tag<Alloc> tag, Args&&... args) : _pi(NULL) {
+        typedef sp_counted_impl_inplace<T, Alloc, _Lp> impl_type;
+        impl_type* pi = impl_type::create(tag._a, std::forward<Args>(args)...);
+        p = pi->ptr();
+        _pi = pi;
+    }
+
+    // Takes over r's pointer.  r lets go of it only once the block
+    // exists, so if allocating the block throws r still owns it.  An
+    // empty r gives an empty count.
+    template<typename Y, typename D>
+    explicit shared_count(std::unique_ptr<Y, D>&& r) : _pi(NULL) {
+        typedef typename std::unique_ptr<Y, D>::pointer pointer;
+        if(!r)
+            return;
+        _pi = new sp_counted_impl<pointer, D, _Lp>(r.get(), r.get_deleter());
+        r.release();
+    }
+
+#if !defined(__GXX_EXPERIMENTAL_CXX0X__) || _GLIBCXX_USE_DEPRECATED
     template<typename T>
     explicit shared_count(std::auto_ptr<T>& r)
-      : _pi(new sp_counted_impl<T*, sp_deleter<T> >(r.get(), sp_deleter<T>())){
+      : _pi(new sp_counted_impl<T*, sp_deleter<T>, _Lp>(r.get(), sp_deleter<T>())) {
         r.release();
     }
-    #endif
-    // explicit shared_count( std::unique_ptr<Y, D> & r ): pi_( 0 )
-    shared_count(weak_count const& r);
+#endif
+
+    // Takes over the reference held by pi, a control block created by
+    // one of the make_*_shared variants outside this header.
+    static shared_count adopt(sp_counted_base<_Lp>* pi) {
+        shared_count r;
+        r._pi = pi;
+        return r;
+    }
+
+    // For sp_batch.h: the block, and giving up the reference without
+    // touching the counts.
+    sp_counted_base<_Lp>* _internal_block() const {
+        return _pi;
+    }
+
+    sp_counted_base<_Lp>* _internal_detach() {
+        sp_counted_base<_Lp>* pi = _pi;
+        _pi = NULL;
+        return pi;
+    }
+
+    shared_count(weak_count<_Lp> const& r);
     
-    #if 0
-    shared_count(weak_count const& r, sp_nothrow_tag);
-    #endif
+    shared_count(weak_count<_Lp> const& r, sp_nothrow_tag);
+
     shared_count& operator=(shared_count const& r) {
-        sp_counted_base* tmp = r._pi;
+        sp_counted_base<_Lp>* tmp = r._pi;
         if(_pi != tmp) {
-            if(NULL != tmp) tmp->add_ref_copy();
-            if(NULL != _pi) _pi->release();
+            if(NULL != tmp) {
+                SP_PROFILE_COUNT(tmp, sp_prof_add_ref_copy);
+                tmp->add_ref_copy();
+            }
+            if(NULL != _pi) {
+                SP_PROFILE_COUNT(_pi, sp_prof_release);
+                _pi->release();
+            }
             _pi = tmp;
         }
         return *this;
     }
+
+    shared_count& operator=(shared_count&& r) noexcept {
+        shared_count(std::move(r)).swap(*this);
+        return *this;
+    }
     
     friend inline bool operator==(shared_count const& a, shared_count const& b) {
         return a._pi == b._pi;
@@ -261,7 +1219,7 @@ public:
     }
     
     void swap(shared_count& r) {
-        sp_counted_base* tmp = r._pi;
+        sp_counted_base<_Lp>* tmp = r._pi;
         r._pi = _pi;
         _pi = tmp;
     }
@@ -286,43 +1244,71 @@ public:
 
 
 
+template<_Lock_policy _Lp>
 class weak_count {
-    sp_counted_base* _pi;
+    sp_counted_base<_Lp>* _pi;
 
-    friend class shared_count;
+    friend class shared_count<_Lp>;
 public:
     weak_count() : _pi(NULL) {}
     ~weak_count() {
-        if(NULL != _pi)
+        if(NULL != _pi) {
+            SP_PROFILE_COUNT(_pi, sp_prof_weak_release);
             _pi->weak_release();
+        }
     }
     
-    weak_count(const shared_count& r) :_pi(r._pi) {
-        if(NULL != _pi)
+    weak_count(const shared_count<_Lp>& r) :_pi(r._pi) {
+        if(NULL != _pi) {
+            SP_PROFILE_COUNT(_pi, sp_prof_weak_add_ref);
             _pi->weak_add_ref();
+        }
     }
 
     weak_count(const weak_count& r) : _pi(r._pi) {
-        if(NULL != _pi)
+        if(NULL != _pi) {
+            SP_PROFILE_COUNT(_pi, sp_prof_weak_add_ref);
             _pi->weak_add_ref();
+        }
+    }
+
+    weak_count(weak_count&& r) noexcept : _pi(r._pi) {
+        r._pi = NULL;
     }
     
-    weak_count& operator=(shared_count const& r) {
-        sp_counted_base* tmp = r._pi;
-        if(NULL != tmp) tmp->weak_add_ref();
-        if(NULL != _pi) _pi->weak_release();
+    weak_count& operator=(shared_count<_Lp> const& r) {
+        sp_counted_base<_Lp>* tmp = r._pi;
+        if(NULL != tmp) {
+            SP_PROFILE_COUNT(tmp, sp_prof_weak_add_ref);
+            tmp->weak_add_ref();
+        }
+        if(NULL != _pi) {
+            SP_PROFILE_COUNT(_pi, sp_prof_weak_release);
+            _pi->weak_release();
+        }
         _pi = tmp;
         return *this;
     }
     
     weak_count& operator=(weak_count const& r) {
-        sp_counted_base* tmp = r._pi;
-        if(NULL != tmp) tmp->weak_add_ref();
-        if(NULL != _pi) _pi->weak_release();
+        sp_counted_base<_Lp>* tmp = r._pi;
+        if(NULL != tmp) {
+            SP_PROFILE_COUNT(tmp, sp_prof_weak_add_ref);
+            tmp->weak_add_ref();
+        }
+        if(NULL != _pi) {
+            SP_PROFILE_COUNT(_pi, sp_prof_weak_release);
+            _pi->weak_release();
+        }
         _pi = tmp;
         return *this;
     }
 
+    weak_count& operator=(weak_count&& r) noexcept {
+        weak_count(std::move(r)).swap(*this);
+        return *this;
+    }
+
     friend inline bool operator==(weak_count const& a, weak_count const& b) {
         return a._pi == b._pi;
     }
@@ -330,9 +1316,13 @@ public:
     friend inline bool operator<(weak_count const& a, weak_count const& b) {
         return a._pi < b._pi;
     }
+
+    sp_counted_base<_Lp>* _internal_block() const {
+        return _pi;
+    }
     
     void swap(weak_count& r) {
-        sp_counted_base* tmp = r._pi;
+        sp_counted_base<_Lp>* tmp = r._pi;
         r._pi = _pi;
         _pi = tmp;
     }
@@ -344,15 +1334,28 @@ public:
 
 
 
-inline shared_count::shared_count(weak_count const& r) : _pi(r._pi) {
-    if(NULL != _pi)
+template<_Lock_policy _Lp>
+inline shared_count<_Lp>::shared_count(weak_count<_Lp> const& r) : _pi(r._pi) {
+    if(NULL != _pi) {
+        SP_PROFILE_COUNT(_pi, sp_prof_lock);
         _pi->add_ref_lock();
-    else
+    } else
         __throw_bad_weak_ptr();
 }
 
+template<_Lock_policy _Lp>
+inline shared_count<_Lp>::shared_count(weak_count<_Lp> const& r, sp_nothrow_tag)
+  : _pi(r._pi) {
+    if(NULL == _pi)
+        return;
+    SP_PROFILE_COUNT(_pi, sp_prof_lock);
+    if(!_pi->add_ref_lock_nothrow())
+        _pi = NULL;
+}
+
 
 
+SP_END_NAMESPACE_ABI
 }
 
 #endif
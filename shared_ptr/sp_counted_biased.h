@@ -0,0 +1,405 @@
+/*=============================================================================
+#     FileName: sp_counted_biased.h
+#         Desc: biased reference counting for thread-owned objects
+#       Author: Jeffrey Pu
+#        Email: pujunying@gmail.com
+#     HomePage: https://github.com/jfpu
+#      Version: 0.0.1
+#   LastChange: 2026-10-17 10:12:41
+#      History:
+=============================================================================*/
+
+#ifndef _SP_COUNTED_BIASED_H_
+#define _SP_COUNTED_BIASED_H_
+
+#include <atomic>
+#include <vector>
+#include "shared_ptr.h"
+
+// g++ -DSP_ENABLE_COUNT_HOOKS=1 ...
+// in every translation unit; the ones built without it use another
+// inline namespace and do not link with these, see SP_BEGIN_NAMESPACE_ABI.
+#if !SP_ENABLE_COUNT_HOOKS
+#error "sp_counted_biased.h needs SP_ENABLE_COUNT_HOOKS=1 in every translation unit"
+#endif
+
+namespace jfpu {
+SP_BEGIN_NAMESPACE_ABI
+
+// Biased reference counting (Choi, Shull, Torrellas, PACT 2018).
+//
+// The thread that creates the object owns the control block and counts
+// its references in _biased with plain loads and stores.  Every other
+// thread uses the atomic _shared counter, which holds sp_biased_bias
+// on top of its own count while the block is biased, so it can only
+// reach zero after the owner has given up its references:
+//
+//   - when _biased drops to 0 the owner merges: it removes the bias
+//     and from then on every thread uses _shared;
+//   - when another thread releases a reference the owner created, the
+//     shared part goes negative; that thread queues the block on the
+//     owner's sp_biased_queue and the owner merges it at its next
+//     release, in sp_biased_merge() or when it exits.  Until then
+//     weak_ptr::lock() fails on threads other than the owner.
+//
+// Only for shared_ptr with the _S_atomic policy.
+
+class sp_counted_biased_base;
+
+// Far above any real count, leaves room below for the shared part.
+static const long sp_biased_bias = 1L << (sizeof(long) * 8 - 2);
+
+// Per thread list of blocks waiting to be merged by their owner.  Kept
+// alive by the thread and by every block still biased towards it, so
+// a block can outlive its owner thread.
+class sp_biased_queue {
+    std::atomic<long> _refs;
+    std::atomic<bool> _pending;
+    __gnu_cxx::__mutex _mutex;
+    bool _dead;
+    bool _draining;
+    std::vector<sp_counted_biased_base*> _blocks;
+
+    sp_biased_queue(sp_biased_queue const& );
+    sp_biased_queue& operator=(sp_biased_queue const& );
+
+    // Registers the exit hook of the calling thread.
+    struct thread_exit {
+        sp_biased_queue* q;
+        thread_exit() : q(NULL) {}
+        ~thread_exit() {
+            if(NULL != q)
+                q->retire();
+        }
+    };
+
+    static sp_biased_queue*& local_slot() {
+        static thread_local sp_biased_queue* q = NULL;
+        return q;
+    }
+
+public:
+    sp_biased_queue() : _refs(1), _pending(false), _dead(false), _draining(false) {}
+
+    // Queue of the calling thread, NULL if it never created a block.
+    static sp_biased_queue* local() {
+        return local_slot();
+    }
+
+    static sp_biased_queue* current() {
+        sp_biased_queue*& q = local_slot();
+        if(NULL == q) {
+            static thread_local thread_exit hook;
+            q = new sp_biased_queue();
+            hook.q = q;
+        }
+        return q;
+    }
+
+    void add_ref() {
+        _refs.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void release() {
+        if(_refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            delete this;
+    }
+
+    bool pending() const {
+        return _pending.load(std::memory_order_relaxed);
+    }
+
+    // Called by a thread that is not the owner; returns false if the
+    // owner has exited, the caller has to merge the block itself.
+    bool push(sp_counted_biased_base* pi) {
+        __gnu_cxx::__scoped_lock sentry(_mutex);
+        if(_dead)
+            return false;
+        _blocks.push_back(pi);
+        _pending.store(true, std::memory_order_release);
+        return true;
+    }
+
+    // Owner only.
+    inline void drain();
+
+private:
+    inline void retire();
+};
+
+
+
+class sp_counted_biased_base : public sp_counted_base<_S_atomic> {
+    // _queue is the creating thread's queue for the whole life of the
+    // block, _owner is cleared once the counts are merged.
+    sp_biased_queue* const _queue;
+    std::atomic<sp_biased_queue*> _owner;
+    std::atomic<long> _biased;
+    std::atomic<long> _shared;
+    std::atomic<bool> _queued;
+
+    friend class sp_biased_queue;
+
+    // Below the bias but not merged yet: references the owner counted
+    // were released on other threads.  Real counts never get anywhere
+    // near half the bias.
+    static bool crossed(long c) {
+        return sp_biased_bias / 2 <= c && c < sp_biased_bias;
+    }
+
+    bool owned(sp_biased_queue* o) const {
+        return NULL != o && o == sp_biased_queue::local();
+    }
+
+    // Owner side, stores only: no other thread writes _biased.
+    void biased_add(long n) {
+        _biased.store(_biased.load(std::memory_order_relaxed) + n,
+                      std::memory_order_relaxed);
+    }
+
+    // Fold _biased into _shared and drop the bias.  Called by the owner
+    // or, once the owner has exited, by whoever finds the block queued.
+    void merge() {
+        _owner.store(NULL, std::memory_order_release);
+        long b = _biased.load(std::memory_order_relaxed);
+        _biased.store(0, std::memory_order_relaxed);
+        long delta = b - sp_biased_bias;
+        if(_shared.fetch_add(delta, std::memory_order_acq_rel) + delta == 0) {
+            dispose();
+            weak_release();
+        }
+    }
+
+    // A non-owner is about to take the shared part below zero.  The
+    // weak reference taken first keeps the block, and with it _queue,
+    // alive after the decrement; it is handed to the queue.
+    void release_crossing() {
+        weak_add_ref();
+        long prev = _shared.fetch_sub(1, std::memory_order_acq_rel);
+        if(1 == prev) {
+            dispose();
+            weak_release();
+        }
+        if(sp_biased_bias != prev || _queued.exchange(true, std::memory_order_acq_rel)) {
+            weak_release();
+            return;
+        }
+        if(!_queue->push(this)) {
+            if(NULL != _owner.load(std::memory_order_acquire))
+                merge();
+            weak_release();
+        }
+    }
+
+protected:
+    sp_counted_biased_base()
+      : sp_counted_base<_S_atomic>(sp_custom_count_tag()),
+        _queue(sp_biased_queue::current()), _owner(_queue), _biased(1),
+        _shared(sp_biased_bias), _queued(false) {
+        _queue->add_ref();
+    }
+
+    ~sp_counted_biased_base() {
+        _queue->release();
+    }
+
+    void custom_add_ref_copy() {
+        if(owned(_owner.load(std::memory_order_relaxed))) {
+            biased_add(1);
+            return;
+        }
+        _shared.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // A reference the owner counted may have been released on another
+    // thread since, leaving the count at 0 until the owner merges.  The
+    // owner sees that in its own _biased; other threads cannot tell it
+    // apart from references still held and refuse while _shared is
+    // below the bias, the object would come back from the dead
+    // otherwise.  merge() clears _owner before it folds the counts, so
+    // this goes by the value alone.
+    bool custom_add_ref_lock() {
+        if(owned(_owner.load(std::memory_order_relaxed))) {
+            long b = _biased.load(std::memory_order_relaxed);
+            if(b + _shared.load(std::memory_order_acquire) - sp_biased_bias <= 0)
+                return false;
+            biased_add(1);
+            return true;
+        }
+        long c = _shared.load(std::memory_order_acquire);
+        for(;;) {
+            if(0 == c || crossed(c))
+                return false;
+            if(_shared.compare_exchange_weak(c, c + 1,
+                                             std::memory_order_acq_rel,
+                                             std::memory_order_acquire))
+                return true;
+        }
+    }
+
+    void custom_release() {
+        sp_biased_queue* o = _owner.load(std::memory_order_relaxed);
+        if(owned(o)) {
+            biased_add(-1);
+            if(0 == _biased.load(std::memory_order_relaxed))
+                merge();
+            if(o->pending())
+                o->drain();
+            return;
+        }
+        long c = _shared.load(std::memory_order_relaxed);
+        do {
+            if(sp_biased_bias == c) {
+                // This thread releases a reference the owner counted.
+                release_crossing();
+                return;
+            }
+        } while(!_shared.compare_exchange_weak(c, c - 1,
+                                               std::memory_order_acq_rel,
+                                               std::memory_order_relaxed));
+        if(1 == c) {
+            dispose();
+            weak_release();
+        }
+    }
+
+    long custom_use_count() const {
+        long s = _shared.load(std::memory_order_relaxed);
+        if(NULL == _owner.load(std::memory_order_relaxed))
+            return s;
+        return _biased.load(std::memory_order_relaxed) + s - sp_biased_bias;
+    }
+};
+
+
+
+inline void sp_biased_queue::drain() {
+    if(_draining)
+        return;
+    _draining = true;
+    std::vector<sp_counted_biased_base*> blocks;
+    {
+        __gnu_cxx::__scoped_lock sentry(_mutex);
+        _pending.store(false, std::memory_order_relaxed);
+        blocks.swap(_blocks);
+    }
+    for(std::size_t i = 0; i < blocks.size(); ++i) {
+        if(this == blocks[i]->_owner.load(std::memory_order_relaxed))
+            blocks[i]->merge();
+        blocks[i]->weak_release();
+    }
+    _draining = false;
+}
+
+inline void sp_biased_queue::retire() {
+    drain();
+    std::vector<sp_counted_biased_base*> blocks;
+    {
+        __gnu_cxx::__scoped_lock sentry(_mutex);
+        _dead = true;
+        blocks.swap(_blocks);
+    }
+    for(std::size_t i = 0; i < blocks.size(); ++i) {
+        if(this == blocks[i]->_owner.load(std::memory_order_relaxed))
+            blocks[i]->merge();
+        blocks[i]->weak_release();
+    }
+    local_slot() = NULL;
+    release();
+}
+
+// Merge the blocks other threads queued for the calling thread.  Owner
+// threads that rarely release a biased pointer should call this now and
+// then, a queued block is not freed before its owner merges it.
+inline void sp_biased_merge() {
+    sp_biased_queue* q = sp_biased_queue::local();
+    if(NULL != q && q->pending())
+        q->drain();
+}
+
+
+
+// make_shared layout with a biased count.
+template<typename T, typename Alloc>
+class sp_counted_biased_inplace : public sp_counted_biased_base {
+    typedef typename std::remove_cv<T>::type value_type;
+    typedef typename std::allocator_traits<Alloc>::template
+        rebind_alloc<value_type> value_alloc;
+    typedef std::allocator_traits<value_alloc> value_traits;
+    typedef typename std::allocator_traits<Alloc>::template
+        rebind_alloc<sp_counted_biased_inplace> block_alloc;
+    typedef std::allocator_traits<block_alloc> block_traits;
+    typedef typename std::aligned_storage<sizeof(T),
+                                          std::alignment_of<T>::value>::type storage_type;
+
+    value_alloc _alloc;
+    storage_type _storage;
+
+    sp_counted_biased_inplace(sp_counted_biased_inplace const& );
+    sp_counted_biased_inplace& operator=(sp_counted_biased_inplace const& );
+
+public:
+    template<typename... Args>
+    explicit sp_counted_biased_inplace(const Alloc& a, Args&&... args) : _alloc(a) {
+        value_traits::construct(_alloc, ptr(), std::forward<Args>(args)...);
+        SP_BLOCK_BIND(sp_counted_biased_inplace);
+    }
+
+    value_type* ptr() {
+        return static_cast<value_type*>(static_cast<void*>(&_storage));
+    }
+
+    void dispose() {
+        value_traits::destroy(_alloc, ptr());
+    }
+
+    void destroy() {
+        block_alloc a(_alloc);
+        this->~sp_counted_biased_inplace();
+        block_traits::deallocate(a, this, 1);
+    }
+
+    void* get_deleter(const std::type_info& ti) {
+#ifdef __GXX_RTTI
+        return ti == typeid(sp_inplace_tag<T>) ? static_cast<void*>(ptr()) : NULL;
+#else
+        return NULL;
+#endif
+    }
+
+    template<typename... Args>
+    static sp_counted_biased_inplace* create(const Alloc& a, Args&&... args) {
+        block_alloc ba(a);
+        sp_counted_biased_inplace* pi = block_traits::allocate(ba, 1);
+        try {
+            ::new(static_cast<void*>(pi)) sp_counted_biased_inplace(a, std::forward<Args>(args)...);
+        } catch(...) {
+            block_traits::deallocate(ba, pi, 1);
+            throw;
+        }
+        return pi;
+    }
+};
+
+// Like allocate_shared, the calling thread becomes the owner of the
+// control block: its copies and releases are plain increments.
+template<typename T, typename Alloc, typename... Args>
+inline shared_ptr<T> allocate_biased_shared(const Alloc& a, Args&&... args) {
+    static_assert(_S_atomic == __default_lock_policy,
+                  "biased counts need the _S_atomic policy");
+    typedef sp_counted_biased_inplace<T, Alloc> impl_type;
+    impl_type* pi = impl_type::create(a, std::forward<Args>(args)...);
+    return shared_ptr<T>(sp_adopt_tag(), pi->ptr(), shared_count<>::adopt(pi));
+}
+
+template<typename T, typename... Args>
+inline shared_ptr<T> make_biased_shared(Args&&... args) {
+    typedef typename std::remove_cv<T>::type value_type;
+    return jfpu::allocate_biased_shared<T>(std::allocator<value_type>(),
+                                           std::forward<Args>(args)...);
+}
+
+SP_END_NAMESPACE_ABI
+}
+
+#endif
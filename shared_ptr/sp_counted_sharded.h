@@ -0,0 +1,316 @@
+/*=============================================================================
+#     FileName: sp_counted_sharded.h
+#         Desc: sharded reference counts for objects copied by every core
+#       Author: Jeffrey Pu
+#        Email: pujunying@gmail.com
+#     HomePage: https://github.com/jfpu
+#      Version: 0.0.1
+#   LastChange: 2026-10-17 18:52:17
+#      History:
+=============================================================================*/
+
+#ifndef _SP_COUNTED_SHARDED_H_
+#define _SP_COUNTED_SHARDED_H_
+
+#include <atomic>
+#include <utility>
+#include "shared_ptr.h"
+
+// g++ -DSP_ENABLE_COUNT_HOOKS=1 ...
+// in every translation unit; the ones built without it use another
+// inline namespace and do not link with these, see SP_BEGIN_NAMESPACE_ABI.
+#if !SP_ENABLE_COUNT_HOOKS
+#error "sp_counted_sharded.h needs SP_ENABLE_COUNT_HOOKS=1 in every translation unit"
+#endif
+
+// Number of counter shards per block, each on its own cache line.
+#ifndef SP_SHARDED_SLOTS
+#define SP_SHARDED_SLOTS 16
+#endif
+
+namespace jfpu {
+SP_BEGIN_NAMESPACE_ABI
+
+// Sharded strong count for objects that all threads copy all the time,
+// in the manner of the kernel's percpu_ref.
+//
+// The block has two modes.  While it is live, every thread counts the
+// references it takes and drops in one of SP_SHARDED_SLOTS shards with
+// a single fetch_add on a line no other shard shares.  Shard counts are
+// signed: a reference taken on one shard and dropped on another leaves
+// one above and the other below where they were.  _central carries a
+// bias, far above any real count, so nothing can reach 0 while the
+// block is live.
+//
+// kill() ends that mode: it swaps every shard for a sentinel value and
+// adds what the shards held, minus the bias, to _central, which is the
+// exact count from then on.  An operation that lands on a killed shard
+// sees the sentinel in the old value, takes its change back and applies
+// it to _central instead, where the usual release to 0 disposes of the
+// object.  Until the last shard is collected _central cannot reach 0:
+// it still carries the bias.
+//
+// kill() is the owner's to call, see sharded_owner: the object never
+// dies while the block is live.  weak_ptr::lock() adds to _central
+// unless it is 0.  use_count() is approximate while the block is live.
+//
+// A block is over a kilobyte: only for a few hot objects, and only for
+// shared_ptr with the _S_atomic policy.
+
+class sp_counted_sharded_base : public sp_counted_base<_S_atomic> {
+    struct alignas(64) shard {
+        std::atomic<long> count;
+
+        shard() : count(0) {}
+    };
+
+    static const long bias = 1L << (sizeof(long) * 8 - 3);
+    // A killed shard holds killed_value plus whatever lands on it late;
+    // anything below killed_limit is one.
+    static const long killed_value = -2 * bias;
+    static const long killed_limit = -bias;
+
+    alignas(64) std::atomic<long> _central;
+    std::atomic<bool> _killed;
+    shard _shards[SP_SHARDED_SLOTS];
+
+    static int local_slot() {
+        static std::atomic<unsigned> next(0);
+        static thread_local int s = static_cast<int>(next.fetch_add(1) % SP_SHARDED_SLOTS);
+        return s;
+    }
+
+    void central_release(long n) {
+        if(_central.fetch_sub(n, std::memory_order_acq_rel) == n) {
+            dispose();
+            weak_release();
+        }
+    }
+
+protected:
+    // The reference returned by make_sharded_owner() starts in _central.
+    sp_counted_sharded_base()
+      : sp_counted_base<_S_atomic>(sp_custom_count_tag()), _central(bias + 1), _killed(false) {}
+
+    void custom_add_ref_copy() {
+        shard& s = _shards[local_slot()];
+        if(s.count.fetch_add(1, std::memory_order_relaxed) < killed_limit) {
+            s.count.fetch_sub(1, std::memory_order_relaxed);
+            _central.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    bool custom_add_ref_lock() {
+        long c = _central.load(std::memory_order_relaxed);
+        do {
+            if(0 == c)
+                return false;
+        } while(!_central.compare_exchange_weak(c, c + 1,
+                                                std::memory_order_acq_rel,
+                                                std::memory_order_relaxed));
+        return true;
+    }
+
+    void custom_release() {
+        shard& s = _shards[local_slot()];
+        if(s.count.fetch_sub(1, std::memory_order_release) < killed_limit) {
+            s.count.fetch_add(1, std::memory_order_relaxed);
+            central_release(1);
+        }
+    }
+
+    long custom_use_count() const {
+        long n = _central.load(std::memory_order_relaxed);
+        if(0 == n)
+            return 0;
+        if(!_killed.load(std::memory_order_relaxed)) {
+            n -= bias;
+            for(int i = 0; i < SP_SHARDED_SLOTS; ++i) {
+                long c = _shards[i].count.load(std::memory_order_relaxed);
+                if(c >= killed_limit)
+                    n += c;
+            }
+        }
+        return n > 0 ? n : 1;
+    }
+
+public:
+    // Moves the count to _central for good.  Once only, by the owner,
+    // whose own reference keeps the object alive through it.
+    void kill() {
+        long sum = 0;
+        for(int i = 0; i < SP_SHARDED_SLOTS; ++i)
+            sum += _shards[i].count.exchange(killed_value, std::memory_order_acq_rel);
+        central_release(bias - sum);
+        _killed.store(true, std::memory_order_relaxed);
+    }
+};
+
+
+
+// make_shared layout with a sharded count.
+template<typename T, typename Alloc>
+class sp_counted_sharded_inplace : public sp_counted_sharded_base {
+    typedef typename std::remove_cv<T>::type value_type;
+    typedef typename std::allocator_traits<Alloc>::template
+        rebind_alloc<value_type> value_alloc;
+    typedef std::allocator_traits<value_alloc> value_traits;
+    typedef typename std::allocator_traits<Alloc>::template
+        rebind_alloc<sp_counted_sharded_inplace> block_alloc;
+    typedef std::allocator_traits<block_alloc> block_traits;
+    typedef typename std::aligned_storage<sizeof(T),
+                                          std::alignment_of<T>::value>::type storage_type;
+
+    value_alloc _alloc;
+    storage_type _storage;
+
+    sp_counted_sharded_inplace(sp_counted_sharded_inplace const& );
+    sp_counted_sharded_inplace& operator=(sp_counted_sharded_inplace const& );
+
+public:
+    template<typename... Args>
+    explicit sp_counted_sharded_inplace(const Alloc& a, Args&&... args) : _alloc(a) {
+        value_traits::construct(_alloc, ptr(), std::forward<Args>(args)...);
+        SP_BLOCK_BIND(sp_counted_sharded_inplace);
+    }
+
+    value_type* ptr() {
+        return static_cast<value_type*>(static_cast<void*>(&_storage));
+    }
+
+    void dispose() {
+        value_traits::destroy(_alloc, ptr());
+    }
+
+    void destroy() {
+        block_alloc a(_alloc);
+        this->~sp_counted_sharded_inplace();
+        block_traits::deallocate(a, this, 1);
+    }
+
+    void* get_deleter(const std::type_info& ti) {
+#ifdef __GXX_RTTI
+        return ti == typeid(sp_inplace_tag<T>) ? static_cast<void*>(ptr()) : NULL;
+#else
+        return NULL;
+#endif
+    }
+
+    template<typename... Args>
+    static sp_counted_sharded_inplace* create(const Alloc& a, Args&&... args) {
+        block_alloc ba(a);
+        sp_counted_sharded_inplace* pi = block_traits::allocate(ba, 1);
+        try {
+            ::new(static_cast<void*>(pi)) sp_counted_sharded_inplace(a, std::forward<Args>(args)...);
+        } catch(...) {
+            block_traits::deallocate(ba, pi, 1);
+            throw;
+        }
+        return pi;
+    }
+};
+
+// Owner of an object whose strong count is spread over SP_SHARDED_SLOTS
+// cache lines.  share() hands out shared_ptrs; their copies and
+// releases stay on the calling thread's shard for as long as the owner
+// exists.  Destroying the owner, or kill(), switches the block to one
+// count: from then on the object lives as long as any shared_ptr to it,
+// like one from make_shared, and the owner is empty.
+template<typename T>
+class sharded_owner {
+    sp_counted_sharded_base* _pi;
+    T* _px;
+
+    sharded_owner(sharded_owner const& );
+    sharded_owner& operator=(sharded_owner const& );
+
+public:
+    typedef T element_type;
+
+    sharded_owner() : _pi(NULL), _px(NULL) {}
+
+    // Takes over the block and the reference pi was created with.
+    sharded_owner(sp_counted_sharded_base* pi, T* px) : _pi(pi), _px(px) {}
+
+    sharded_owner(sharded_owner&& r) noexcept : _pi(r._pi), _px(r._px) {
+        r._pi = NULL;
+        r._px = NULL;
+    }
+
+    sharded_owner& operator=(sharded_owner&& r) noexcept {
+        sharded_owner(std::move(r)).swap(*this);
+        return *this;
+    }
+
+    ~sharded_owner() {
+        kill();
+    }
+
+    void swap(sharded_owner& r) noexcept {
+        std::swap(_pi, r._pi);
+        std::swap(_px, r._px);
+    }
+
+    // A new reference, counted on the calling thread's shard.
+    shared_ptr<T> share() const {
+        if(NULL == _pi)
+            return shared_ptr<T>();
+        SP_PROFILE_COUNT(_pi, sp_prof_add_ref_copy);
+        _pi->add_ref_copy();
+        return shared_ptr<T>(sp_adopt_tag(), _px, shared_count<>::adopt(_pi));
+    }
+
+    // Gives the block its single count and drops the owner's reference.
+    void kill() {
+        if(NULL == _pi)
+            return;
+        sp_counted_sharded_base* pi = _pi;
+        _pi = NULL;
+        _px = NULL;
+        pi->kill();
+        SP_PROFILE_COUNT(pi, sp_prof_release);
+        pi->release();
+    }
+
+    T* get() const {
+        return _px;
+    }
+
+    T& operator*() const {
+        assert(NULL != _px);
+        return *_px;
+    }
+
+    T* operator->() const {
+        assert(NULL != _px);
+        return _px;
+    }
+
+    bool operator!() const {
+        return NULL == _pi;
+    }
+};
+
+template<typename T, typename Alloc, typename... Args>
+inline sharded_owner<T> allocate_sharded_owner(const Alloc& a, Args&&... args) {
+    static_assert(_S_atomic == __default_lock_policy,
+                  "sharded counts need the _S_atomic policy");
+    typedef sp_counted_sharded_inplace<T, Alloc> impl_type;
+    impl_type* pi = impl_type::create(a, std::forward<Args>(args)...);
+    return sharded_owner<T>(pi, pi->ptr());
+}
+
+// Like make_shared, returning the owner of a block with a sharded count.
+// Before C++17 the allocator may not honour the shards' alignment; they
+// are still a line apart.
+template<typename T, typename... Args>
+inline sharded_owner<T> make_sharded_owner(Args&&... args) {
+    typedef typename std::remove_cv<T>::type value_type;
+    return jfpu::allocate_sharded_owner<T>(std::allocator<value_type>(),
+                                           std::forward<Args>(args)...);
+}
+
+SP_END_NAMESPACE_ABI
+}
+
+#endif
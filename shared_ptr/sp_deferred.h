@@ -0,0 +1,335 @@
+/*=============================================================================
+#     FileName: sp_deferred.h
+#         Desc: deferred disposal of shared objects
+#       Author: Jeffrey Pu
+#        Email: pujunying@gmail.com
+#     HomePage: https://github.com/jfpu
+#      Version: 0.0.1
+#   LastChange: 2026-10-17 11:05:27
+#      History:
+=============================================================================*/
+
+#ifndef _SP_DEFERRED_H_
+#define _SP_DEFERRED_H_
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include "shared_ptr.h"
+
+namespace jfpu {
+SP_BEGIN_NAMESPACE_ABI
+
+// Deferred disposal.
+//
+// The last release of a deferred block does not run the deleter: it
+// pins the block with a weak reference and pushes it on the queue of an
+// sp_reclaimer.  The reclaimer's background thread, or whoever calls
+// drain(), later runs the deleters of everything queued in one batch and
+// drops the pins, which frees the blocks.  weak_ptrs already see the
+// object as expired while it waits in the queue.
+//
+// The queue is bounded.  When it is full the releasing thread either
+// runs the deleter itself (sp_reclaim_inline) or waits for the
+// background thread to make room (sp_reclaim_wait; falls back to inline
+// when no thread is running, and inside drain(), where a deleter
+// releasing another deferred object must not wait for the reclaimer
+// that is running it).
+
+class sp_reclaimer;
+
+enum sp_reclaim_overflow { sp_reclaim_inline, sp_reclaim_wait };
+
+class sp_deferred_base : public sp_counted_base<> {
+    sp_reclaimer* _reclaimer;
+    sp_deferred_base* _next;
+
+    friend class sp_reclaimer;
+
+protected:
+    explicit sp_deferred_base(sp_reclaimer& r) : _reclaimer(&r), _next(NULL) {}
+
+    // The real deleter, run by the reclaimer.
+    virtual void reclaim() = 0;
+
+public:
+    inline void dispose();
+};
+
+
+
+class sp_reclaimer {
+    std::atomic<sp_deferred_base*> _head;
+    std::atomic<std::size_t> _depth;
+    std::size_t _max_depth;
+    std::size_t _batch;
+    sp_reclaim_overflow _overflow;
+    std::chrono::microseconds _period;
+
+    std::mutex _mutex;
+    std::condition_variable _work;
+    std::condition_variable _space;
+    std::atomic<bool> _running;
+    std::thread _thread;
+
+    sp_reclaimer(sp_reclaimer const& );
+    sp_reclaimer& operator=(sp_reclaimer const& );
+
+    // Take a slot in the queue, false if the caller has to run the
+    // deleter itself.
+    bool reserve() {
+        std::size_t d = _depth.load(std::memory_order_relaxed);
+        for(;;) {
+            if(d < _max_depth) {
+                if(_depth.compare_exchange_weak(d, d + 1, std::memory_order_relaxed))
+                    return true;
+                continue;
+            }
+            // Never wait from inside a drain: the reclaimer thread would
+            // wait for itself, and any drain holds back the deleters it
+            // has yet to run.
+            if(sp_reclaim_wait != _overflow || !_running.load(std::memory_order_acquire)
+               || NULL != draining())
+                return false;
+            std::unique_lock<std::mutex> lk(_mutex);
+            _work.notify_one();
+            _space.wait_for(lk, _period);
+            d = _depth.load(std::memory_order_relaxed);
+        }
+    }
+
+    // The reclaimer whose drain() runs on this thread, if any.
+    static sp_reclaimer*& draining() {
+        static thread_local sp_reclaimer* r = NULL;
+        return r;
+    }
+
+    void run() {
+        std::unique_lock<std::mutex> lk(_mutex);
+        while(_running.load(std::memory_order_relaxed)) {
+            if(_depth.load(std::memory_order_relaxed) < _batch)
+                _work.wait_for(lk, _period);
+            lk.unlock();
+            drain();
+            lk.lock();
+        }
+    }
+
+public:
+    // max_depth bounds the blocks waiting in the queue; the background
+    // thread is woken once batch of them are queued, and otherwise
+    // polls every period.
+    explicit sp_reclaimer(std::size_t max_depth = 4096,
+                          sp_reclaim_overflow overflow = sp_reclaim_inline,
+                          std::size_t batch = 64,
+                          std::chrono::microseconds period = std::chrono::milliseconds(1))
+      : _head(NULL), _depth(0), _max_depth(max_depth), _batch(batch),
+        _overflow(overflow), _period(period), _running(false) {}
+
+    // Runs whatever is still queued, including what those deleters
+    // queue in turn.
+    ~sp_reclaimer() {
+        stop();
+        while(0 != drain())
+            ;
+    }
+
+    // Process wide reclaimer, never destroyed: call drain() or stop()
+    // before exit if the queued deleters have to run.
+    static sp_reclaimer& global() {
+        static sp_reclaimer* r = new sp_reclaimer();
+        return *r;
+    }
+
+    void start() {
+        std::lock_guard<std::mutex> lk(_mutex);
+        if(_running.load(std::memory_order_relaxed))
+            return;
+        _running.store(true, std::memory_order_release);
+        _thread = std::thread(&sp_reclaimer::run, this);
+    }
+
+    // Joins the background thread and runs what it left behind.
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lk(_mutex);
+            if(!_running.load(std::memory_order_relaxed))
+                return;
+            _running.store(false, std::memory_order_release);
+            _work.notify_all();
+        }
+        _thread.join();
+        while(0 != drain())
+            ;
+    }
+
+    std::size_t depth() const {
+        return _depth.load(std::memory_order_relaxed);
+    }
+
+    // Hands pi to the reclaimer, false if the queue is full.
+    bool push(sp_deferred_base* pi) {
+        if(!reserve())
+            return false;
+        sp_deferred_base* head = _head.load(std::memory_order_relaxed);
+        do {
+            pi->_next = head;
+        } while(!_head.compare_exchange_weak(head, pi,
+                                             std::memory_order_release,
+                                             std::memory_order_relaxed));
+        if(_depth.load(std::memory_order_relaxed) == _batch)
+            _work.notify_one();
+        return true;
+    }
+
+    // Runs the deleters of everything queued so far, oldest first, and
+    // returns how many there were.  Safe to call from any thread.
+    //
+    // The queue slots are given back before the deleters run, so objects
+    // they release can be queued again instead of waiting for room.
+    std::size_t drain() {
+        sp_deferred_base* list = _head.exchange(NULL, std::memory_order_acquire);
+        sp_deferred_base* fifo = NULL;
+        std::size_t n = 0;
+        while(NULL != list) {
+            sp_deferred_base* next = list->_next;
+            list->_next = fifo;
+            fifo = list;
+            list = next;
+            ++n;
+        }
+        if(0 == n)
+            return 0;
+        _depth.fetch_sub(n, std::memory_order_relaxed);
+        if(sp_reclaim_wait == _overflow) {
+            std::lock_guard<std::mutex> lk(_mutex);
+            _space.notify_all();
+        }
+        sp_reclaimer* outer = draining();
+        draining() = this;
+        while(NULL != fifo) {
+            sp_deferred_base* next = fifo->_next;
+            fifo->reclaim();
+            fifo->weak_release();
+            fifo = next;
+        }
+        draining() = outer;
+        return n;
+    }
+};
+
+
+
+inline void sp_deferred_base::dispose() {
+    // Paired with the weak_release() after reclaim().
+    weak_add_ref();
+    if(!_reclaimer->push(this)) {
+        reclaim();
+        weak_release();
+    }
+}
+
+
+
+template<typename Ptr, typename Deleter>
+class sp_counted_deferred : public sp_deferred_base {
+    Ptr _px;
+    Deleter _del;
+
+    sp_counted_deferred(sp_counted_deferred const& );
+    sp_counted_deferred& operator=(sp_counted_deferred const& );
+
+protected:
+    void reclaim() {
+        _del(_px);
+    }
+
+public:
+    sp_counted_deferred(Ptr px, Deleter del, sp_reclaimer& r)
+      : sp_deferred_base(r), _px(px), _del(del) {
+        SP_BLOCK_BIND(sp_counted_deferred);
+    }
+
+    void* get_deleter(const std::type_info& ti) {
+#ifdef __GXX_RTTI
+        return ti == typeid(Deleter) ? static_cast<void*>(&_del) : NULL;
+#else
+        return NULL;
+#endif
+    }
+};
+
+// make_shared layout: the object is destroyed and the memory freed on
+// the reclaimer.
+template<typename T>
+class sp_counted_deferred_inplace : public sp_deferred_base {
+    typedef typename std::remove_cv<T>::type value_type;
+    typedef typename std::aligned_storage<sizeof(T),
+                                          std::alignment_of<T>::value>::type storage_type;
+
+    storage_type _storage;
+
+    sp_counted_deferred_inplace(sp_counted_deferred_inplace const& );
+    sp_counted_deferred_inplace& operator=(sp_counted_deferred_inplace const& );
+
+protected:
+    void reclaim() {
+        ptr()->~value_type();
+    }
+
+public:
+    template<typename... Args>
+    explicit sp_counted_deferred_inplace(sp_reclaimer& r, Args&&... args)
+      : sp_deferred_base(r) {
+        ::new(static_cast<void*>(ptr())) value_type(std::forward<Args>(args)...);
+        SP_BLOCK_BIND(sp_counted_deferred_inplace);
+    }
+
+    value_type* ptr() {
+        return static_cast<value_type*>(static_cast<void*>(&_storage));
+    }
+
+    void* get_deleter(const std::type_info& ti) {
+#ifdef __GXX_RTTI
+        return ti == typeid(sp_inplace_tag<T>) ? static_cast<void*>(ptr()) : NULL;
+#else
+        return NULL;
+#endif
+    }
+};
+
+
+
+// shared_ptr(p, d) whose deleter runs on r.
+template<typename T, typename Deleter>
+inline shared_ptr<T> defer_shared(T* p, Deleter d, sp_reclaimer& r = sp_reclaimer::global()) {
+    typedef sp_counted_deferred<T*, Deleter> impl_type;
+    impl_type* pi;
+    try {
+        pi = new impl_type(p, d, r);
+    } catch(...) {
+        d(p);
+        throw;
+    }
+    return shared_ptr<T>(sp_adopt_tag(), p, shared_count<>::adopt(pi));
+}
+
+template<typename T>
+inline shared_ptr<T> defer_shared(T* p, sp_reclaimer& r = sp_reclaimer::global()) {
+    return jfpu::defer_shared(p, sp_deleter<T>(), r);
+}
+
+// make_shared whose object is destroyed on r.
+template<typename T, typename... Args>
+inline shared_ptr<T> make_deferred_shared(sp_reclaimer& r, Args&&... args) {
+    typedef sp_counted_deferred_inplace<T> impl_type;
+    impl_type* pi = new impl_type(r, std::forward<Args>(args)...);
+    return shared_ptr<T>(sp_adopt_tag(), pi->ptr(), shared_count<>::adopt(pi));
+}
+
+SP_END_NAMESPACE_ABI
+}
+
+#endif
@@ -0,0 +1,381 @@
+/*=============================================================================
+#     FileName: sp_profile.h
+#         Desc: reference count profiling per control block type
+#       Author: Jeffrey Pu
+#        Email: pujunying@gmail.com
+#     HomePage: https://github.com/jfpu
+#      Version: 0.0.1
+#   LastChange: 2026-10-17 15:21:40
+#      History:
+=============================================================================*/
+
+#ifndef _SP_PROFILE_H_
+#define _SP_PROFILE_H_
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Included by sp_counted_base.h when SP_ENABLE_PROFILE is set.
+//
+// Every control block type (which spells out the pointer, deleter and
+// allocator types) gets a small id the first time a block of it is
+// created.  shared_count and weak_count count their operations per id
+// in counters owned by the calling thread, so counting does not make the
+// threads share any more cache lines than the counts themselves do;
+// sp_profiler::snapshot() adds them up.
+//
+// Every SP_PROFILE_SAMPLE_PERIOD-th count operation of a thread, and
+// every failed add_ref_lock() compare-and-swap, records the block in a
+// fixed table of hot blocks together with the threads that touched it.
+// Blocks seen by many threads are the ones whose counts ping-pong
+// between caches.  Addresses can be reused once a block is freed; the
+// type shown is the one of the first block sampled at that address.
+
+#ifndef SP_PROFILE_MAX_TYPES
+#define SP_PROFILE_MAX_TYPES 256
+#endif
+
+// Power of two.
+#ifndef SP_PROFILE_SAMPLE_PERIOD
+#define SP_PROFILE_SAMPLE_PERIOD 1024
+#endif
+
+#ifndef SP_PROFILE_HOT_SLOTS
+#define SP_PROFILE_HOT_SLOTS 4096
+#endif
+
+namespace jfpu {
+
+enum sp_profile_event {
+    sp_prof_alloc,
+    sp_prof_add_ref_copy,
+    sp_prof_release,
+    sp_prof_weak_add_ref,
+    sp_prof_weak_release,
+    sp_prof_lock,
+    sp_prof_lock_retry,
+    sp_prof_dispose,
+    sp_prof_dispose_ns,
+    sp_prof_events
+};
+
+inline const char* sp_profile_event_name(int e) {
+    static const char* const names[sp_prof_events] = {
+        "alloc", "add_ref_copy", "release", "weak_add_ref", "weak_release",
+        "lock", "lock_retry", "dispose", "dispose_ns"
+    };
+    return names[e];
+}
+
+struct sp_profile_type_stats {
+    std::string name;
+    unsigned long long counts[sp_prof_events];
+
+    // Count operations, the ones that touch the counters.
+    unsigned long long traffic() const {
+        return counts[sp_prof_add_ref_copy] + counts[sp_prof_release]
+             + counts[sp_prof_weak_add_ref] + counts[sp_prof_weak_release]
+             + counts[sp_prof_lock] + counts[sp_prof_lock_retry];
+    }
+};
+
+struct sp_profile_hot_block {
+    const void* block;
+    std::string type;
+    unsigned long long samples;
+    unsigned long long retries;
+    unsigned threads;
+};
+
+struct sp_profile_snapshot {
+    // Busiest type first.
+    std::vector<sp_profile_type_stats> types;
+    // Most contended block first: samples times distinct threads, plus
+    // the add_ref_lock() retries.
+    std::vector<sp_profile_hot_block> hot;
+    // Samples lost because the hot table was full.
+    unsigned long long dropped;
+};
+
+
+
+class sp_profiler {
+    typedef std::atomic<unsigned long long> counter;
+
+    // Written only by its own thread, read by snapshot().
+    struct thread_counts {
+        counter counts[SP_PROFILE_MAX_TYPES][sp_prof_events];
+        unsigned index;
+        unsigned long tick;
+        thread_counts* next;
+
+        thread_counts() : tick(0) {
+            for(int i = 0; i < SP_PROFILE_MAX_TYPES; ++i)
+                for(int e = 0; e < sp_prof_events; ++e)
+                    counts[i][e].store(0, std::memory_order_relaxed);
+            instance().attach(this);
+        }
+
+        ~thread_counts() {
+            dead() = true;
+            instance().detach(this);
+        }
+    };
+
+    struct hot_slot {
+        std::atomic<const void*> block;
+        std::atomic<unsigned> type;
+        counter samples;
+        counter retries;
+        // Bit (thread index % 64) for every thread that sampled it.
+        counter threads;
+    };
+
+    std::mutex _mutex;
+    std::vector<std::string> _names;
+    thread_counts* _threads;
+    unsigned _next_index;
+    // Counts of threads that have exited.
+    counter _retired[SP_PROFILE_MAX_TYPES][sp_prof_events];
+    hot_slot _hot[SP_PROFILE_HOT_SLOTS];
+    counter _dropped;
+
+    sp_profiler(sp_profiler const& );
+    sp_profiler& operator=(sp_profiler const& );
+
+    sp_profiler() : _threads(NULL), _next_index(0) {
+        _names.push_back("(unknown)");
+        clear();
+    }
+
+    // Set once the calling thread's counters are gone; counts made by
+    // destructors of later thread_local objects go to _retired.
+    static bool& dead() {
+        static thread_local bool d = false;
+        return d;
+    }
+
+    static thread_counts* local() {
+        if(dead())
+            return NULL;
+        static thread_local thread_counts t;
+        return &t;
+    }
+
+    void attach(thread_counts* t) {
+        std::lock_guard<std::mutex> lk(_mutex);
+        t->index = _next_index++;
+        t->next = _threads;
+        _threads = t;
+    }
+
+    void detach(thread_counts* t) {
+        std::lock_guard<std::mutex> lk(_mutex);
+        for(int i = 0; i < SP_PROFILE_MAX_TYPES; ++i)
+            for(int e = 0; e < sp_prof_events; ++e)
+                _retired[i][e].fetch_add(t->counts[i][e].load(std::memory_order_relaxed),
+                                         std::memory_order_relaxed);
+        thread_counts** p = &_threads;
+        while(*p != t)
+            p = &(*p)->next;
+        *p = t->next;
+    }
+
+    // Zeroes everything but the type names, _mutex held or not shared yet.
+    void clear() {
+        for(int i = 0; i < SP_PROFILE_MAX_TYPES; ++i)
+            for(int e = 0; e < sp_prof_events; ++e)
+                _retired[i][e].store(0, std::memory_order_relaxed);
+        for(thread_counts* t = _threads; NULL != t; t = t->next)
+            for(int i = 0; i < SP_PROFILE_MAX_TYPES; ++i)
+                for(int e = 0; e < sp_prof_events; ++e)
+                    t->counts[i][e].store(0, std::memory_order_relaxed);
+        for(int i = 0; i < SP_PROFILE_HOT_SLOTS; ++i) {
+            _hot[i].block.store(NULL, std::memory_order_relaxed);
+            _hot[i].type.store(0, std::memory_order_relaxed);
+            _hot[i].samples.store(0, std::memory_order_relaxed);
+            _hot[i].retries.store(0, std::memory_order_relaxed);
+            _hot[i].threads.store(0, std::memory_order_relaxed);
+        }
+        _dropped.store(0, std::memory_order_relaxed);
+    }
+
+    void sample(const void* block, unsigned type, unsigned index, bool retry) {
+        std::size_t h = (reinterpret_cast<std::size_t>(block) >> 4) * 0x9E3779B97F4A7C15ull;
+        for(int probe = 0; probe < 8; ++probe) {
+            hot_slot& s = _hot[(h + probe) % SP_PROFILE_HOT_SLOTS];
+            const void* cur = s.block.load(std::memory_order_relaxed);
+            if(NULL == cur) {
+                if(s.block.compare_exchange_strong(cur, block, std::memory_order_relaxed)) {
+                    s.type.store(type, std::memory_order_relaxed);
+                    cur = block;
+                }
+            }
+            if(cur != block)
+                continue;
+            (retry ? s.retries : s.samples).fetch_add(1, std::memory_order_relaxed);
+            s.threads.fetch_or(1ull << (index % 64), std::memory_order_relaxed);
+            return;
+        }
+        _dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    static bool is_ref_op(sp_profile_event ev) {
+        return sp_prof_add_ref_copy <= ev && ev <= sp_prof_lock;
+    }
+
+public:
+    // Never destroyed, blocks may be released during static destruction.
+    static sp_profiler& instance() {
+        static sp_profiler* p = new sp_profiler();
+        return *p;
+    }
+
+    // Ids past SP_PROFILE_MAX_TYPES share id 0.
+    unsigned register_type(const char* pretty) {
+        // "... [with Block = X]" from __PRETTY_FUNCTION__.
+        std::string name(pretty);
+        std::string::size_type b = name.find("= ");
+        if(std::string::npos != b && ']' == name[name.size() - 1])
+            name = name.substr(b + 2, name.size() - b - 3);
+        std::lock_guard<std::mutex> lk(_mutex);
+        if(_names.size() >= SP_PROFILE_MAX_TYPES)
+            return 0;
+        _names.push_back(name);
+        return static_cast<unsigned>(_names.size() - 1);
+    }
+
+    void count(unsigned type, sp_profile_event ev, const void* block,
+               unsigned long long n = 1) {
+        thread_counts* t = local();
+        if(NULL == t) {
+            _retired[type][ev].fetch_add(n, std::memory_order_relaxed);
+            return;
+        }
+        counter& c = t->counts[type][ev];
+        c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+        if(sp_prof_lock_retry == ev)
+            sample(block, type, t->index, true);
+        else if(is_ref_op(ev) && 0 == (++t->tick & (SP_PROFILE_SAMPLE_PERIOD - 1)))
+            sample(block, type, t->index, false);
+    }
+
+    // Sums the counters of all threads.  Counts made while it runs may
+    // or may not be included.  top limits the hot blocks returned.
+    sp_profile_snapshot snapshot(std::size_t top = 16) {
+        sp_profile_snapshot r;
+        std::lock_guard<std::mutex> lk(_mutex);
+        for(std::size_t i = 0; i < _names.size(); ++i) {
+            sp_profile_type_stats s;
+            s.name = _names[i];
+            bool any = false;
+            for(int e = 0; e < sp_prof_events; ++e) {
+                s.counts[e] = _retired[i][e].load(std::memory_order_relaxed);
+                for(thread_counts* t = _threads; NULL != t; t = t->next)
+                    s.counts[e] += t->counts[i][e].load(std::memory_order_relaxed);
+                any = any || 0 != s.counts[e];
+            }
+            if(any)
+                r.types.push_back(s);
+        }
+        std::sort(r.types.begin(), r.types.end(),
+                  [](const sp_profile_type_stats& a, const sp_profile_type_stats& b) {
+                      return a.traffic() > b.traffic();
+                  });
+
+        for(int i = 0; i < SP_PROFILE_HOT_SLOTS; ++i) {
+            const void* block = _hot[i].block.load(std::memory_order_relaxed);
+            if(NULL == block)
+                continue;
+            sp_profile_hot_block h;
+            h.block = block;
+            h.type = _names[_hot[i].type.load(std::memory_order_relaxed)];
+            h.samples = _hot[i].samples.load(std::memory_order_relaxed);
+            h.retries = _hot[i].retries.load(std::memory_order_relaxed);
+            h.threads = __builtin_popcountll(_hot[i].threads.load(std::memory_order_relaxed));
+            r.hot.push_back(h);
+        }
+        std::sort(r.hot.begin(), r.hot.end(),
+                  [](const sp_profile_hot_block& a, const sp_profile_hot_block& b) {
+                      return a.samples * a.threads + a.retries > b.samples * b.threads + b.retries;
+                  });
+        if(r.hot.size() > top)
+            r.hot.resize(top);
+        r.dropped = _dropped.load(std::memory_order_relaxed);
+        return r;
+    }
+
+    // Starts over.  Counts made by other threads while it runs may
+    // survive it.
+    void reset() {
+        std::lock_guard<std::mutex> lk(_mutex);
+        clear();
+    }
+};
+
+
+
+// Id of the control block type Block.
+template<typename Block>
+struct sp_profile_type {
+    static const char* pretty() {
+        return __PRETTY_FUNCTION__;
+    }
+
+    static unsigned id() {
+        static const unsigned i = sp_profiler::instance().register_type(pretty());
+        return i;
+    }
+};
+
+// Adds the time until it goes out of scope to dispose_ns.
+class sp_profile_timer {
+    unsigned _type;
+    const void* _block;
+    std::chrono::steady_clock::time_point _t0;
+
+public:
+    sp_profile_timer(unsigned type, const void* block)
+      : _type(type), _block(block), _t0(std::chrono::steady_clock::now()) {}
+
+    ~sp_profile_timer() {
+        unsigned long long ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - _t0).count();
+        sp_profiler::instance().count(_type, sp_prof_dispose, _block);
+        sp_profiler::instance().count(_type, sp_prof_dispose_ns, _block, ns);
+    }
+};
+
+inline sp_profile_snapshot sp_profile_take_snapshot(std::size_t top = 16) {
+    return sp_profiler::instance().snapshot(top);
+}
+
+inline void sp_profile_reset() {
+    sp_profiler::instance().reset();
+}
+
+inline std::ostream& operator<<(std::ostream& os, const sp_profile_snapshot& s) {
+    for(std::size_t i = 0; i < s.types.size(); ++i) {
+        os << s.types[i].name << "\n ";
+        for(int e = 0; e < sp_prof_events; ++e)
+            os << " " << sp_profile_event_name(e) << "=" << s.types[i].counts[e];
+        os << "\n";
+    }
+    for(std::size_t i = 0; i < s.hot.size(); ++i)
+        os << "hot " << s.hot[i].block << " samples=" << s.hot[i].samples
+           << " retries=" << s.hot[i].retries << " threads=" << s.hot[i].threads
+           << " " << s.hot[i].type << "\n";
+    if(0 != s.dropped)
+        os << "dropped samples=" << s.dropped << "\n";
+    return os;
+}
+
+}
+
+#endif
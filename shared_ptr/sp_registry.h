@@ -0,0 +1,264 @@
+/*=============================================================================
+#     FileName: sp_registry.h
+#         Desc: registry of live control blocks for leak and lifetime dumps
+#       Author: Jeffrey Pu
+#        Email: pujunying@gmail.com
+#     HomePage: https://github.com/jfpu
+#      Version: 0.0.1
+#   LastChange: 2026-10-17 16:02:13
+#      History:
+=============================================================================*/
+
+#ifndef _SP_REGISTRY_H_
+#define _SP_REGISTRY_H_
+
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <new>
+#include <ostream>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Included by sp_counted_base.h when SP_ENABLE_REGISTRY is set.
+//
+// Every control block links itself into one of SP_REGISTRY_SHARDS lists
+// when it is created and unlinks itself when it is destroyed.  A thread
+// always inserts into the same shard, so threads allocating at the same
+// time do not wait for each other; a block freed by another thread
+// takes that shard's lock for the unlink.
+//
+// The block records its type and the innermost SP_REGISTRY_SITE() scope
+// active on the creating thread.  sp_registry::dump() groups the live
+// blocks by type and site, with their strong and weak counts.  Blocks
+// whose object is gone but which are kept by weak_ptrs show up as
+// expired; with make_shared that is the whole object's memory.
+
+#ifndef SP_REGISTRY_SHARDS
+#define SP_REGISTRY_SHARDS 64
+#endif
+
+namespace jfpu {
+
+struct sp_registry_site {
+    const char* file;
+    int line;
+    const char* function;
+};
+
+// Part of sp_counted_base.  read fetches the counts of block.
+struct sp_registry_node {
+    sp_registry_node* prev;
+    sp_registry_node* next;
+    const void* block;
+    void (*read)(const void* block, long& use, long& weak);
+    const char* type;
+    const sp_registry_site* site;
+    int shard;
+};
+
+// Sets the site recorded by blocks created on this thread until it
+// goes out of scope.  Use SP_REGISTRY_SITE().
+class sp_registry_scope {
+    const sp_registry_site* _prev;
+
+    sp_registry_scope(sp_registry_scope const& );
+    sp_registry_scope& operator=(sp_registry_scope const& );
+
+public:
+    explicit sp_registry_scope(const sp_registry_site& s) : _prev(current()) {
+        current() = &s;
+    }
+
+    ~sp_registry_scope() {
+        current() = _prev;
+    }
+
+    static const sp_registry_site*& current() {
+        static thread_local const sp_registry_site* s = NULL;
+        return s;
+    }
+};
+
+struct sp_registry_entry {
+    const void* block;
+    std::string type;
+    const sp_registry_site* site;
+    // -1 for blocks that count in a scheme of their own.
+    long use_count;
+    long weak_count;
+};
+
+struct sp_registry_group {
+    std::string type;
+    const sp_registry_site* site;
+    std::size_t blocks;
+    // Blocks with use_count 0 kept by weak_ptrs.
+    std::size_t expired;
+    long use_count;
+    long weak_count;
+};
+
+
+
+class sp_registry {
+    struct alignas(64) shard {
+        std::mutex mutex;
+        sp_registry_node head;
+    };
+
+    shard _shards[SP_REGISTRY_SHARDS];
+
+    sp_registry(sp_registry const& );
+    sp_registry& operator=(sp_registry const& );
+
+    sp_registry() {
+        for(int i = 0; i < SP_REGISTRY_SHARDS; ++i) {
+            _shards[i].head.prev = &_shards[i].head;
+            _shards[i].head.next = &_shards[i].head;
+        }
+    }
+
+    static int local_shard() {
+        static std::atomic<unsigned> next(0);
+        static thread_local int s = static_cast<int>(next.fetch_add(1) % SP_REGISTRY_SHARDS);
+        return s;
+    }
+
+    // "... [with Block = X]" from __PRETTY_FUNCTION__.
+    static std::string type_name(const char* pretty) {
+        std::string name(pretty);
+        std::string::size_type b = name.find("= ");
+        if(std::string::npos != b && ']' == name[name.size() - 1])
+            name = name.substr(b + 2, name.size() - b - 3);
+        return name;
+    }
+
+public:
+    // Never destroyed, blocks may outlive static destruction.  Placed in
+    // static storage since plain new ignores the shard alignment before
+    // C++17.
+    static sp_registry& instance() {
+        static std::aligned_storage<sizeof(sp_registry),
+                                    alignof(sp_registry)>::type mem;
+        static sp_registry* r = ::new(static_cast<void*>(&mem)) sp_registry();
+        return *r;
+    }
+
+    void insert(sp_registry_node* n) {
+        n->site = sp_registry_scope::current();
+        n->shard = local_shard();
+        shard& s = _shards[n->shard];
+        std::lock_guard<std::mutex> lk(s.mutex);
+        n->prev = &s.head;
+        n->next = s.head.next;
+        s.head.next->prev = n;
+        s.head.next = n;
+    }
+
+    void erase(sp_registry_node* n) {
+        shard& s = _shards[n->shard];
+        std::lock_guard<std::mutex> lk(s.mutex);
+        n->prev->next = n->next;
+        n->next->prev = n->prev;
+    }
+
+    // Every live block.  Each shard is locked in turn, so blocks created
+    // or destroyed meanwhile may or may not be listed.
+    std::vector<sp_registry_entry> snapshot() {
+        std::vector<sp_registry_entry> r;
+        for(int i = 0; i < SP_REGISTRY_SHARDS; ++i) {
+            shard& s = _shards[i];
+            std::lock_guard<std::mutex> lk(s.mutex);
+            for(sp_registry_node* n = s.head.next; n != &s.head; n = n->next) {
+                sp_registry_entry e;
+                e.block = n->block;
+                e.type = n->type;
+                e.site = n->site;
+                n->read(n->block, e.use_count, e.weak_count);
+                r.push_back(e);
+            }
+        }
+        for(std::size_t i = 0; i < r.size(); ++i)
+            r[i].type = type_name(r[i].type.c_str());
+        return r;
+    }
+
+    // Live blocks by type and creation site, most blocks first.
+    std::vector<sp_registry_group> groups() {
+        std::vector<sp_registry_entry> es = snapshot();
+        std::map<std::pair<std::string, const sp_registry_site*>, sp_registry_group> m;
+        for(std::size_t i = 0; i < es.size(); ++i) {
+            sp_registry_group& g = m[std::make_pair(es[i].type, es[i].site)];
+            if(0 == g.blocks) {
+                g.type = es[i].type;
+                g.site = es[i].site;
+                g.expired = 0;
+                g.use_count = 0;
+                g.weak_count = 0;
+            }
+            ++g.blocks;
+            if(0 == es[i].use_count)
+                ++g.expired;
+            if(es[i].use_count > 0)
+                g.use_count += es[i].use_count;
+            g.weak_count += es[i].weak_count;
+        }
+        std::vector<sp_registry_group> r;
+        for(std::map<std::pair<std::string, const sp_registry_site*>,
+                     sp_registry_group>::iterator it = m.begin(); it != m.end(); ++it)
+            r.push_back(it->second);
+        std::sort(r.begin(), r.end(),
+                  [](const sp_registry_group& a, const sp_registry_group& b) {
+                      return a.blocks > b.blocks;
+                  });
+        return r;
+    }
+
+    std::size_t size() {
+        std::size_t n = 0;
+        for(int i = 0; i < SP_REGISTRY_SHARDS; ++i) {
+            shard& s = _shards[i];
+            std::lock_guard<std::mutex> lk(s.mutex);
+            for(sp_registry_node* p = s.head.next; p != &s.head; p = p->next)
+                ++n;
+        }
+        return n;
+    }
+
+    void dump(std::ostream& os) {
+        std::vector<sp_registry_group> gs = groups();
+        for(std::size_t i = 0; i < gs.size(); ++i) {
+            os << gs[i].blocks << " blocks";
+            if(0 != gs[i].expired)
+                os << " (" << gs[i].expired << " expired)";
+            os << " use=" << gs[i].use_count << " weak=" << gs[i].weak_count
+               << " " << gs[i].type << " at ";
+            if(NULL != gs[i].site)
+                os << gs[i].site->file << ":" << gs[i].site->line << " " << gs[i].site->function;
+            else
+                os << "(unknown)";
+            os << "\n";
+        }
+    }
+};
+
+template<typename Block>
+struct sp_registry_type {
+    static const char* pretty() {
+        return __PRETTY_FUNCTION__;
+    }
+};
+
+}
+
+// Blocks created in the rest of the enclosing scope record this line as
+// their site.
+#define SP_REGISTRY_SITE() \
+    static const jfpu::sp_registry_site sp_registry_site_ = { __FILE__, __LINE__, __func__ }; \
+    jfpu::sp_registry_scope sp_registry_scope_(sp_registry_site_)
+
+#endif
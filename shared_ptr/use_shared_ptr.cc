@@ -9,7 +9,7 @@
 #      History:
 =============================================================================*/
 
-// g++ -o use_shared_ptr -std=c++0x use_shared_ptr.cc
+// make use_shared_ptr
 
 #include <iostream>
 #include <vector>
@@ -55,20 +55,29 @@ int main()
 		assert(0 == p2.use_count());
 	}
 	{
-		while(1)
-		{
-			std::vector<jfpu::shared_ptr<int> > vec;
-			for(int i = 0; i < 1000000; ) {
-				vec.push_back(jfpu::shared_ptr<int>(new int(++i)));
-			}
-			std::vector<jfpu::shared_ptr<int> >::iterator it = vec.begin();
-			std::vector<jfpu::shared_ptr<int> >::iterator itEnd = vec.end();
-			std::cout << "vec: " << std::ends;
-			for(; it != itEnd; ++it) {
-				std::cout << *(it->get()) << " ";
-			}
-			std::cout << std::endl;
+		jfpu::shared_ptr<int> p = jfpu::make_shared<int>(42);
+		jfpu::weak_ptr<int> wp(p);
+		assert(42 == *p);
+		assert(1 == p.use_count());
+		assert(!wp.expired());
+		p.reset();
+		assert(wp.expired());
+	}
+	{
+		// timings live in sp_bench.cc
+		std::vector<jfpu::shared_ptr<int> > vec;
+		for(int i = 0; i < 1000000; ) {
+			vec.push_back(jfpu::make_shared<int>(++i));
+		}
+		long long sum = 0;
+		std::vector<jfpu::shared_ptr<int> >::iterator it = vec.begin();
+		std::vector<jfpu::shared_ptr<int> >::iterator itEnd = vec.end();
+		for(; it != itEnd; ++it) {
+			assert(1 == it->use_count());
+			sum += *(it->get());
 		}
+		assert(500000500000LL == sum);
+		std::cout << "vec: " << vec.size() << " sum " << sum << std::endl;
     }
     {
         // #if 0
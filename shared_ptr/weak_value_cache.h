@@ -0,0 +1,216 @@
+/*=============================================================================
+#     FileName: weak_value_cache.h
+#         Desc: sharded concurrent cache of weak_ptrs by key
+#       Author: Jeffrey Pu
+#        Email: pujunying@gmail.com
+#     HomePage: https://github.com/jfpu
+#      Version: 0.0.1
+#   LastChange: 2026-10-17 17:58:30
+#      History:
+=============================================================================*/
+
+#ifndef _WEAK_VALUE_CACHE_H_
+#define _WEAK_VALUE_CACHE_H_
+
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include "shared_ptr.h"
+
+namespace jfpu {
+SP_BEGIN_NAMESPACE_ABI
+
+// Map from key to weak_ptr<T>: the cache never keeps a value alive, it
+// hands out the one that is still alive elsewhere or builds a new one.
+//
+// Keys are spread over a power of two number of shards, each a mutex
+// and an unordered_map.  A hit is one weak_ptr::lock() under the
+// shard's mutex.  On a miss the first thread marks the entry as being
+// built and runs the builder without the lock; other threads asking
+// for the same key wait for it instead of building their own.  If the
+// builder throws, one of the waiters builds instead.
+//
+// Entries whose value has expired are removed as the cache is used:
+// every insertion checks the next sweep_step buckets of its shard.
+// sweep() cleans everything at once.
+template<typename Key, typename T, typename Hash = std::hash<Key>,
+         typename Pred = std::equal_to<Key> >
+class weak_value_cache {
+    struct entry {
+        weak_ptr<T> value;
+        bool building;
+
+        entry() : building(false) {}
+    };
+
+    typedef std::unordered_map<Key, entry, Hash, Pred> map_type;
+
+    struct alignas(64) shard {
+        std::mutex mutex;
+        std::condition_variable built;
+        map_type map;
+        std::size_t cursor;
+
+        shard() : cursor(0) {}
+    };
+
+    std::vector<shard> _shards;
+    unsigned _shift;
+    std::size_t _sweep_step;
+    Hash _hash;
+
+    weak_value_cache(weak_value_cache const& );
+    weak_value_cache& operator=(weak_value_cache const& );
+
+    // The top bits of the mixed hash, the map uses the low ones.
+    shard& shard_of(const Key& k) {
+        if(0 == _shift)
+            return _shards[0];
+        std::uint64_t h = static_cast<std::uint64_t>(_hash(k)) * 0x9E3779B97F4A7C15ull;
+        return _shards[static_cast<std::size_t>(h >> (64 - _shift))];
+    }
+
+    // Removes expired entries from the next n buckets, lock held.
+    static std::size_t sweep_some(shard& s, std::size_t n) {
+        std::size_t removed = 0;
+        std::size_t buckets = s.map.bucket_count();
+        for(std::size_t i = 0; i < n && i < buckets; ++i) {
+            std::size_t b = s.cursor++ % buckets;
+            for(typename map_type::local_iterator it = s.map.begin(b); it != s.map.end(b); ) {
+                const entry& e = it->second;
+                if(!e.building && e.value.expired()) {
+                    // Erasing invalidates only this element's iterators.
+                    Key k = it->first;
+                    ++it;
+                    s.map.erase(k);
+                    ++removed;
+                } else {
+                    ++it;
+                }
+            }
+        }
+        return removed;
+    }
+
+public:
+    // shards is rounded up to a power of two.
+    explicit weak_value_cache(std::size_t shards = 16, std::size_t sweep_step = 2,
+                              const Hash& hash = Hash())
+      : _shift(0), _sweep_step(sweep_step), _hash(hash) {
+        std::size_t n = 1;
+        while(n < shards) {
+            n *= 2;
+            ++_shift;
+        }
+        _shards = std::vector<shard>(n);
+    }
+
+    // The value for k if it is still alive, empty otherwise.  Does not
+    // wait for a value being built.
+    shared_ptr<T> find(const Key& k) {
+        shard& s = shard_of(k);
+        std::lock_guard<std::mutex> lk(s.mutex);
+        typename map_type::iterator it = s.map.find(k);
+        if(it == s.map.end())
+            return shared_ptr<T>();
+        return it->second.value.lock();
+    }
+
+    // The value for k, built with build() if there is none alive.  An
+    // empty result of build() is returned but not cached.
+    template<typename Builder>
+    shared_ptr<T> get_or_build(const Key& k, Builder build) {
+        shard& s = shard_of(k);
+        std::unique_lock<std::mutex> lk(s.mutex);
+        typename map_type::iterator it;
+        for(;;) {
+            it = s.map.find(k);
+            if(it == s.map.end()) {
+                sweep_some(s, _sweep_step);
+                it = s.map.insert(typename map_type::value_type(k, entry())).first;
+                break;
+            }
+            if(!it->second.building) {
+                shared_ptr<T> p = it->second.value.lock();
+                if(!!p)
+                    return p;
+                break;
+            }
+            s.built.wait(lk);
+        }
+        it->second.building = true;
+        lk.unlock();
+
+        shared_ptr<T> p;
+        try {
+            p = build();
+        } catch(...) {
+            lk.lock();
+            s.map.erase(k);
+            s.built.notify_all();
+            throw;
+        }
+
+        lk.lock();
+        // Nobody else touches an entry that is being built.
+        it = s.map.find(k);
+        if(!p)
+            s.map.erase(it);
+        else {
+            it->second.value = p;
+            it->second.building = false;
+        }
+        s.built.notify_all();
+        return p;
+    }
+
+    // Replaces the value for k.  A build in progress for k still stores
+    // its result when it finishes.
+    void insert(const Key& k, const shared_ptr<T>& p) {
+        shard& s = shard_of(k);
+        std::lock_guard<std::mutex> lk(s.mutex);
+        sweep_some(s, _sweep_step);
+        entry& e = s.map[k];
+        if(!e.building)
+            e.value = p;
+    }
+
+    // Forgets k unless it is being built.
+    void erase(const Key& k) {
+        shard& s = shard_of(k);
+        std::lock_guard<std::mutex> lk(s.mutex);
+        typename map_type::iterator it = s.map.find(k);
+        if(it != s.map.end() && !it->second.building)
+            s.map.erase(it);
+    }
+
+    // Removes every expired entry, returns how many there were.
+    std::size_t sweep() {
+        std::size_t removed = 0;
+        for(std::size_t i = 0; i < _shards.size(); ++i) {
+            shard& s = _shards[i];
+            std::lock_guard<std::mutex> lk(s.mutex);
+            removed += sweep_some(s, s.map.bucket_count());
+        }
+        return removed;
+    }
+
+    // Entries, expired ones not swept yet included.
+    std::size_t size() {
+        std::size_t n = 0;
+        for(std::size_t i = 0; i < _shards.size(); ++i) {
+            shard& s = _shards[i];
+            std::lock_guard<std::mutex> lk(s.mutex);
+            n += s.map.size();
+        }
+        return n;
+    }
+};
+
+SP_END_NAMESPACE_ABI
+}
+
+#endif